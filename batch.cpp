@@ -0,0 +1,297 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "isa.h"
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+// nodes past this are run on, but their memory is left to first touch
+#define MAX_NODES 64
+
+#define DATA_SIZE 0x100
+
+// the items of a node, and the workers on it
+struct share {
+    uint32_t node;
+    uint32_t begin, count; // of the inputs
+    uint32_t nworkers;
+    const uint32_t *in; // count each, on the node if the run is local
+    uint32_t *out;
+    std::atomic<uint32_t> next; // items claimed
+};
+
+struct batch_runtime {
+    const uint8_t *code;
+    const uint8_t *data;
+    const uint32_t *inputs;
+    uint32_t *outputs;
+    bool local; // the shares have buffers on their nodes
+    struct share *shares;
+    uint32_t nshares;
+    pthread_mutex_t start; // held while the workers are created, until the barrier counts them
+    pthread_barrier_t barrier;
+    std::atomic<int> result; // VM_CONTINUE while running
+    std::atomic<uint64_t> remote;
+    std::atomic<bool> pinned;
+    std::atomic<bool> bound;
+};
+
+struct worker_arg {
+    struct batch_runtime *rt;
+    uint32_t share;
+    int cpu; // -1 if not pinned
+    bool first; // of its share, copies the share in and out
+};
+
+// --------------------------------------------------
+// TOPOLOGY
+// --------------------------------------------------
+
+// the cpus of "0-3,8-11" into set
+static void parse_cpulist(const char *s, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*s >= '0' && *s <= '9') {
+        char *end;
+        unsigned long lo = strtoul(s, &end, 10), hi = lo;
+        if (*end == '-') {
+            hi = strtoul(end + 1, &end, 10);
+        }
+        for (unsigned long c = lo; c <= hi && c < CPU_SETSIZE; c++) {
+            CPU_SET(c, set);
+        }
+        s = *end == ',' ? end + 1 : end;
+    }
+}
+
+// The nodes with cpus the process may run on: their ids and those cpus, returns their count. A host
+// without /sys/devices/system/node is one node 0 of all the allowed cpus.
+static uint32_t read_nodes(const cpu_set_t *allowed, uint32_t *ids, cpu_set_t *cpus) {
+    uint32_t n = 0;
+    for (uint32_t node = 0; node < MAX_NODES; node++) {
+        char path[64], list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+        FILE *f = fopen(path, "r");
+        if (!f) {
+            continue;
+        }
+        bool read = fgets(list, sizeof(list), f);
+        fclose(f);
+        if (!read) {
+            continue;
+        }
+        parse_cpulist(list, &cpus[n]);
+        CPU_AND(&cpus[n], &cpus[n], allowed);
+        if (CPU_COUNT(&cpus[n])) {
+            ids[n++] = node;
+        }
+    }
+    if (!n) {
+        ids[0] = 0;
+        cpus[0] = *allowed;
+        n = 1;
+    }
+    return n;
+}
+
+// the i-th cpu of set, wrapping around
+static int nth_cpu(const cpu_set_t *set, uint32_t i) {
+    i %= CPU_COUNT(set);
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (CPU_ISSET(c, set) && !i--) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+// size bytes on the node if bind, false in *bound if they could not be bound
+static void *node_alloc(size_t size, uint32_t node, bool bind, std::atomic<bool> *bound) {
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        puts("out of memory");
+        exit(1);
+    }
+    if (bind) {
+        unsigned long mask = node < MAX_NODES ? 1ul << node : 0;
+        // maxnode counts one past the bits of the mask
+        if (!mask || syscall(SYS_mbind, p, size, MPOL_BIND, &mask, MAX_NODES + 1, 0) != 0) {
+            *bound = false;
+        }
+    }
+    return p;
+}
+
+// --------------------------------------------------
+// WORKERS
+// --------------------------------------------------
+
+static void *worker(void *p) {
+    struct worker_arg *a = (struct worker_arg *) p;
+    struct batch_runtime *rt = a->rt;
+    struct share *own = &rt->shares[a->share];
+    if (a->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(a->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            rt->pinned = false;
+        }
+    }
+    size_t share_size = own->count * sizeof(uint32_t);
+    if (a->first && rt->local && own->count) {
+        uint32_t *in = (uint32_t *) node_alloc(share_size, own->node, true, &rt->bound);
+        memcpy(in, rt->inputs + own->begin, share_size);
+        own->in = in;
+        own->out = (uint32_t *) node_alloc(share_size, own->node, true, &rt->bound);
+    }
+    // the state is on the stack of the pinned thread, the data segment on its node
+    uint8_t *data = (uint8_t *) node_alloc(DATA_SIZE, own->node, rt->local, &rt->bound);
+    pthread_mutex_lock(&rt->start);
+    pthread_mutex_unlock(&rt->start);
+    pthread_barrier_wait(&rt->barrier);
+
+    // the own share first, then help the others
+    for (uint32_t k = 0; k < rt->nshares && rt->result == VM_CONTINUE; k++) {
+        struct share *s = &rt->shares[(a->share + k) % rt->nshares];
+        uint32_t i;
+        while (rt->result == VM_CONTINUE && (i = s->next.fetch_add(BATCH_CHUNK)) < s->count) {
+            uint32_t end = i + BATCH_CHUNK < s->count ? i + BATCH_CHUNK : s->count;
+            if (k) {
+                rt->remote += end - i;
+            }
+            for (; i < end; i++) {
+                if (rt->data) {
+                    memcpy(data, rt->data, DATA_SIZE);
+                } else {
+                    memset(data, 0, DATA_SIZE);
+                }
+                struct state st = {};
+                st.regfile[0] = s->in[i];
+                st.data = data + DATA_SIZE / 2;
+                st.code = rt->code;
+                int res = isa_interp(&st);
+                if (res != VM_HALT) {
+                    int expected = VM_CONTINUE;
+                    rt->result.compare_exchange_strong(expected, res);
+                    break;
+                }
+                s->out[i] = st.regfile[0];
+            }
+        }
+    }
+
+    pthread_barrier_wait(&rt->barrier);
+    if (a->first && rt->local && own->count) {
+        memcpy(rt->outputs + own->begin, own->out, share_size);
+        munmap((void *) own->in, share_size);
+        munmap(own->out, share_size);
+    }
+    munmap(data, DATA_SIZE);
+    return nullptr;
+}
+
+// --------------------------------------------------
+// RUNTIME
+// --------------------------------------------------
+
+int batch_run(const uint8_t *code, const uint8_t *data, const uint32_t *inputs, uint32_t *outputs, uint32_t n,
+              uint32_t workers, bool numa, struct batch_stats *stats) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        CPU_ZERO(&allowed);
+        CPU_SET(0, &allowed);
+    }
+    if (workers == 0) {
+        workers = CPU_COUNT(&allowed);
+    }
+    uint32_t ids[MAX_NODES];
+    cpu_set_t *cpus = (cpu_set_t *) calloc(MAX_NODES, sizeof(cpu_set_t));
+    uint32_t nnodes = numa ? read_nodes(&allowed, ids, cpus) : 1;
+    if (!numa) {
+        ids[0] = 0;
+    }
+    uint32_t nshares = workers < nnodes ? workers : nnodes;
+
+    struct batch_runtime *rt = new batch_runtime();
+    rt->code = code;
+    rt->data = data;
+    rt->inputs = inputs;
+    rt->outputs = outputs;
+    rt->local = numa && nshares > 1;
+    rt->nshares = nshares;
+    rt->shares = new share[nshares]();
+    rt->result = VM_CONTINUE;
+    rt->remote = 0;
+    rt->pinned = numa;
+    rt->bound = rt->local;
+    pthread_mutex_init(&rt->start, nullptr);
+
+    // workers spread over the nodes, the items split by the workers on each
+    for (uint32_t s = 0; s < nshares; s++) {
+        rt->shares[s].node = ids[s];
+        rt->shares[s].nworkers = workers / nshares + (s < workers % nshares);
+    }
+    uint32_t begin = 0;
+    for (uint32_t s = 0; s < nshares; s++) {
+        struct share *sh = &rt->shares[s];
+        sh->begin = begin;
+        sh->count = s + 1 < nshares ? (uint64_t) n * sh->nworkers / workers : n - begin;
+        sh->in = inputs + begin;
+        sh->out = outputs + begin;
+        begin += sh->count;
+    }
+
+    pthread_t *threads = (pthread_t *) calloc(workers, sizeof(pthread_t));
+    struct worker_arg *args = (struct worker_arg *) calloc(workers, sizeof(struct worker_arg));
+    for (uint32_t w = 0; w < workers; w++) {
+        uint32_t s = w % nshares;
+        args[w].rt = rt;
+        args[w].share = s;
+        args[w].cpu = numa ? nth_cpu(&cpus[s], w / nshares) : -1;
+        args[w].first = w < nshares;
+    }
+    // Every worker runs items of every share, so the items are all run by as many workers as could
+    // be created (a share whose first worker is missing is run from inputs and outputs in place).
+    // With none, the calling thread runs them.
+    pthread_mutex_lock(&rt->start);
+    uint32_t started = 0;
+    while (started < workers && pthread_create(&threads[started], nullptr, worker, &args[started]) == 0) {
+        started++;
+    }
+    pthread_barrier_init(&rt->barrier, nullptr, started ? started : 1);
+    pthread_mutex_unlock(&rt->start);
+    if (!started) {
+        worker(&args[0]);
+    }
+    for (uint32_t w = 0; w < started; w++) {
+        pthread_join(threads[w], nullptr);
+    }
+
+    if (stats) {
+        stats->workers = started ? started : 1;
+        stats->nodes = nshares;
+        stats->pinned = rt->pinned;
+        stats->bound = rt->bound;
+        stats->remote = rt->remote;
+    }
+    int res = rt->result == VM_CONTINUE ? VM_HALT : rt->result.load();
+    pthread_barrier_destroy(&rt->barrier);
+    pthread_mutex_destroy(&rt->start);
+    free(threads);
+    free(args);
+    free(cpus);
+    delete[] rt->shares;
+    delete rt;
+    return res;
+}
@@ -0,0 +1,43 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <cstdint>
+
+#include "vm.h"
+
+// --------------------------------------------------
+// BATCH EXECUTION
+// --------------------------------------------------
+//
+// Runs one program over an array of inputs, each in a fresh state whose r0 is the input and whose
+// data segment starts as a copy of one image, and collects r0 after each halts. Items run on a pool
+// of host workers in the interpreter of isa.cpp.
+//
+// With numa, the pool is laid out over the NUMA nodes of the host (from /sys/devices/system/node):
+// workers are spread over the nodes and pinned to a core each, and the inputs are split by node in
+// proportion to its workers. A worker of each node copies the node's share of the inputs into a
+// buffer on the node, its workers run them with their states and data segments on the node too,
+// and the outputs are gathered in a buffer on the node and copied out once at the end. Memory is
+// bound with the mbind system call, without libnuma; where it fails (no NUMA in the kernel, or not
+// permitted) the pages still land on the node by first touch from the pinned workers. A node that
+// runs out of items helps the others. A host with one node gets pinning only.
+
+// items claimed at a time from a node's share
+#define BATCH_CHUNK 256
+
+struct batch_stats {
+    uint32_t workers; // that could be started, fewer than asked for if thread creation failed
+    uint32_t nodes; // that workers ran on
+    bool pinned; // every worker to its core
+    bool bound; // every node local buffer with mbind
+    uint64_t remote; // items run by a worker of another node than the share's
+};
+
+// Runs code over inputs[0..n), the r0 of each into outputs. data is the initial data
+// segment (0x100 bytes, st->data at its middle), nullptr for zeros. workers 0 for one per core.
+// Returns VM_HALT, or the result of the first item that stopped on anything else, which stops the
+// others. Like interp in vm.cpp, the code must not run past its end. stats may be nullptr.
+int batch_run(const uint8_t *code, const uint8_t *data, const uint32_t *inputs, uint32_t *outputs, uint32_t n,
+              uint32_t workers, bool numa, struct batch_stats *stats);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include "vm.h"
+#include "bytecode.h"
+
+// --------------------------------------------------
+// BENCHMARK FIXTURE
+// --------------------------------------------------
+//
+// The programs of bytecode.h whose run length is set by r0, and the harness of one run: the clock,
+// a fresh state on a zeroed data segment, and the check that the run halted. Shared by the
+// benchmarks that compare engines on them (bench_super, bench_compile, bench_checkpoint).
+
+struct bench_program {
+    const char *name;
+    const uint8_t *code;
+    uint32_t len;
+    uint32_t divisor; // of steps, for r0
+};
+
+inline const struct bench_program bench_programs[] = {
+        {"fib",      fib,      sizeof(fib) - 1,      1},
+        {"xorshift", xorshift, sizeof(xorshift) - 1, 4},
+        {"jstates",  jstates,  sizeof(jstates) - 1,  2},
+};
+
+// the data segment of the state of bench_init, for one run at a time
+inline uint8_t bench_data[0x100];
+
+inline double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// st fresh to run code on r0 = input, bench_data zeroed as its data segment
+inline void bench_init(struct state *st, const uint8_t *code, uint32_t input) {
+    memset(bench_data, 0, sizeof(bench_data));
+    *st = {};
+    st->regfile[0] = input;
+    st->data = bench_data + 0x80;
+    st->code = code;
+}
+
+// the steps of the command line, or the default
+inline uint32_t bench_steps(int argc, char **argv) {
+    return argc > 1 ? strtoul(argv[1], NULL, 10) : 40000000;
+}
+
+// exits unless the run halted
+inline void bench_halted(int res) {
+    if (res != VM_HALT) {
+        puts("program did not halt");
+        exit(1);
+    }
+}
+
+#endif
@@ -0,0 +1,79 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <sched.h>
+
+#include "vm.h"
+#include "bytecode.h"
+#include "batch.h"
+#include "isa.h"
+
+// --------------------------------------------------
+// BENCHMARK
+// batch execution over 1, 2, 4... workers, with and without NUMA placement
+// --------------------------------------------------
+//
+// Runs xorshift over an array of inputs (each a few dozen steps) with batch.cpp on 1, 2, 4...
+// workers up to max, each both without NUMA placement (unpinned, every buffer where the caller
+// allocated it) and with it (workers spread over the nodes and pinned, buffers on the nodes), and
+// checks the outputs against one item at a time. On a host with several sockets the difference
+// between the two is the cross-socket traffic of the first.
+//
+// usage: bench_batch.out [items] [max workers]
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+    uint32_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    cpu_set_t allowed;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    uint32_t max = argc > 2 ? strtoul(argv[2], NULL, 10) : CPU_COUNT(&allowed);
+    uint32_t *inputs = (uint32_t *) calloc(n, sizeof(uint32_t));
+    uint32_t *expected = (uint32_t *) calloc(n, sizeof(uint32_t));
+    uint32_t *outputs = (uint32_t *) calloc(n, sizeof(uint32_t));
+    uint8_t data[0x100] = {};
+    for (uint32_t i = 0; i < n; i++) {
+        inputs[i] = 10 + i % 50;
+        struct state st = {};
+        st.regfile[0] = inputs[i];
+        st.data = data + 0x80;
+        st.code = xorshift;
+        if (isa_interp(&st) != VM_HALT) {
+            puts("program did not halt");
+            return 1;
+        }
+        expected[i] = st.regfile[0];
+    }
+    bool ok = true;
+    for (uint32_t workers = 1; workers <= max; workers *= 2) {
+        double rate[2];
+        struct batch_stats stats;
+        for (int numa = 0; numa < 2; numa++) {
+            memset(outputs, 0, n * sizeof(uint32_t));
+            double t = now();
+            int res = batch_run(xorshift, nullptr, inputs, outputs, n, workers, numa, &stats);
+            t = now() - t;
+            bool same = res == VM_HALT && !memcmp(outputs, expected, n * sizeof(uint32_t));
+            ok &= same;
+            rate[numa] = n / t;
+            if (!same) {
+                printf("%u workers%s: RESULTS DIFFER\n", workers, numa ? " (numa)" : "");
+            }
+        }
+        printf("%3u workers: %6.2f M items/s, numa %6.2f M items/s (%.2fx) on %u node%s, %spinned, %sbound, "
+               "%llu remote\n", workers, rate[0] / 1e6, rate[1] / 1e6, rate[1] / rate[0], stats.nodes,
+               stats.nodes == 1 ? "" : "s", stats.pinned ? "" : "not ", stats.bound ? "" : "not ",
+               (unsigned long long) stats.remote);
+    }
+    free(inputs);
+    free(expected);
+    free(outputs);
+    return ok ? 0 : 1;
+}
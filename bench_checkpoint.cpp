@@ -0,0 +1,84 @@
+#include <cstdint>
+#include <cstdio>
+
+#include <unistd.h>
+
+#include "vm.h"
+#include "bench.h"
+#include "block.h"
+#include "checkpoint.h"
+
+// --------------------------------------------------
+// BENCHMARK
+// checkpointing at back edges, and resuming
+// --------------------------------------------------
+//
+// Runs programs of bytecode.h in the checkpointing interpreter without checkpoints and with one
+// every 10 ms, to measure the cost of the safe points, and times each checkpoint as it is saved.
+// Then runs each again in slices of fuel, every slice resumed from the checkpoint of the last one
+// in a fresh state, and resumes the checkpoint of the first slice in block.cpp as well; checks that
+// all leave the same r0.
+//
+// usage: bench_checkpoint.out [steps]
+
+// seconds to run to the halt, r0 into r0
+static double run(const uint8_t *code, uint32_t len, uint32_t input, const struct ckpt_policy *policy,
+                  struct ckpt_stats *stats, uint32_t *r0) {
+    struct state st;
+    bench_init(&st, code, input);
+    double t = bench_now();
+    int res = ckpt_run(code, len, &st, bench_data, sizeof(bench_data), policy, stats);
+    t = bench_now() - t;
+    bench_halted(res);
+    *r0 = st.regfile[0];
+    return t;
+}
+
+int main(int argc, char **argv) {
+    uint32_t steps = bench_steps(argc, argv);
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/bench_checkpoint.%d.ckpt", (int) getpid());
+    bool ok = true;
+    for (const auto &p: bench_programs) {
+        uint32_t input = steps / p.divisor;
+        uint32_t r0[4];
+        struct ckpt_stats stats, saved;
+        struct ckpt_policy none = {path, 0, 0}, every = {path, 0.01, 0};
+        double plain_t = run(p.code, p.len, input, &none, &stats, &r0[0]);
+        double saved_t = run(p.code, p.len, input, &every, &saved, &r0[1]);
+
+        // in 8 slices, each in a fresh state
+        struct ckpt_policy slice = {path, 0, stats.back_edges / 8 + 1};
+        struct state st;
+        bench_init(&st, p.code, input);
+        uint32_t slices = 1;
+        int res;
+        while ((res = ckpt_run(p.code, p.len, &st, bench_data, sizeof(bench_data), &slice, nullptr)) == VM_OUT_OF_FUEL) {
+            if (slices == 1) {
+                // the first checkpoint resumed in block.cpp
+                struct state bst;
+                bench_init(&bst, p.code, 0);
+                struct vm_program *prog = prog_translate(p.code, p.len);
+                ok &= !ckpt_load(path, p.code, p.len, &bst, bench_data, sizeof(bench_data)) && prog_run(prog, &bst) == VM_HALT;
+                prog_free(prog);
+                r0[3] = bst.regfile[0];
+            }
+            bench_init(&st, p.code, 0);
+            const char *err = ckpt_load(path, p.code, p.len, &st, bench_data, sizeof(bench_data));
+            if (err) {
+                printf("%s\n", err);
+                return 1;
+            }
+            slices++;
+        }
+        ok &= res == VM_HALT;
+        r0[2] = st.regfile[0];
+        unlink(path);
+        bool same = r0[1] == r0[0] && r0[2] == r0[0] && r0[3] == r0[0];
+        printf("%-9s %7.1f ms, checkpointed %7.1f ms (%u checkpoints, %.1f us each), resumed over %u slices%s\n",
+               p.name, plain_t * 1e3, saved_t * 1e3, saved.saves,
+               saved.saves ? saved.save_seconds / saved.saves * 1e6 : 0.0, slices, same ? "" : ", RESULTS DIFFER");
+        ok &= same;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,70 @@
+#include <cstdint>
+#include <cstdio>
+
+#include "vm.h"
+#include "bench.h"
+#include "block.h"
+#include "context.h"
+#include "closure.h"
+
+// --------------------------------------------------
+// BENCHMARK
+// load-time compilation, context threaded and to closures, against the switch of block.cpp
+// --------------------------------------------------
+//
+// Runs programs of bytecode.h in block.cpp, which dispatches through a switch, translated by
+// context.cpp and compiled to closures by closure.cpp, and checks that all leave the same r0.
+// Context threading is skipped on a host that is not x86-64.
+//
+// usage: bench_compile.out [steps]
+
+enum engine { BLOCKS, CONTEXT, CLOSURES };
+
+// seconds to run st on input in engine e, its r0 into r0; closures are compiled for st
+static double run(enum engine e, struct vm_program *prog, struct ctx_program *ctx, struct cl_program *cl,
+                  struct state *st, uint32_t input, uint32_t *r0) {
+    bench_init(st, nullptr, input);
+    double t = bench_now();
+    int res = e == CONTEXT ? ctx_run(ctx, st) : e == CLOSURES ? cl_run(cl) : prog_run(prog, st);
+    t = bench_now() - t;
+    bench_halted(res);
+    *r0 = st->regfile[0];
+    return t;
+}
+
+int main(int argc, char **argv) {
+    uint32_t steps = bench_steps(argc, argv);
+    bool ok = true;
+    for (const auto &p: bench_programs) {
+        uint32_t input = steps / p.divisor;
+        struct state st;
+        struct vm_program *prog = prog_translate(p.code, p.len);
+        double ctx_load = bench_now();
+        struct ctx_program *ctx = ctx_translate(p.code, p.len);
+        ctx_load = bench_now() - ctx_load;
+        double cl_load = bench_now();
+        struct cl_program *cl = cl_compile(p.code, p.len, &st);
+        cl_load = bench_now() - cl_load;
+
+        uint32_t r0[3];
+        double block_t = run(BLOCKS, prog, ctx, cl, &st, input, &r0[BLOCKS]);
+        double cl_t = run(CLOSURES, prog, ctx, cl, &st, input, &r0[CLOSURES]);
+        bool same = r0[CLOSURES] == r0[BLOCKS];
+        printf("%-9s block.cpp %7.1f ms\n", p.name, block_t * 1e3);
+        if (ctx) {
+            double ctx_t = run(CONTEXT, prog, ctx, cl, &st, input, &r0[CONTEXT]);
+            same &= r0[CONTEXT] == r0[BLOCKS];
+            printf("%-9s context threaded %7.1f ms (%.2fx), translated in %.1f us to %u bytes\n", "",
+                   ctx_t * 1e3, block_t / ctx_t, ctx_load * 1e6, ctx->text_used);
+            ctx_free(ctx);
+        } else {
+            printf("%-9s context threaded: needs an x86-64 host\n", "");
+        }
+        printf("%-9s closures %7.1f ms (%.2fx), compiled in %.1f us to %u blocks of %u closures%s\n", "",
+               cl_t * 1e3, block_t / cl_t, cl_load * 1e6, cl->nblocks, cl->ninsns, same ? "" : ", RESULTS DIFFER");
+        ok &= same;
+        prog_free(prog);
+        cl_free(cl);
+    }
+    return ok ? 0 : 1;
+}
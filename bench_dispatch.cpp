@@ -0,0 +1,64 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include "vm.h"
+#include "block.h"
+
+// --------------------------------------------------
+// BENCHMARK
+// dispatch on sparse pcs
+// --------------------------------------------------
+//
+// Runs the program written by gen_sparse.cpp, whose every step is an indirect jump to a pc far
+// from the last, in block.cpp and as generated by cogen with a switch over the pcs and with a
+// minimal perfect hash of them, and checks they compute the same.
+//
+// usage: bench_dispatch.out [steps]
+
+extern "C" int sparse_switch(struct state *st);
+extern "C" int sparse_hash(struct state *st);
+extern "C" const uint8_t sparse_hash_code[];
+extern "C" const uint32_t sparse_hash_code_len;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint32_t result;
+
+static void run(const char *name, int (*entry)(struct state *st), struct vm_program *prog, uint32_t steps) {
+    static uint8_t data[0x100];
+    struct state st = {};
+    st.regfile[0] = steps;
+    st.data = data;
+    double t = now();
+    int res = entry ? entry(&st) : prog_run(prog, &st);
+    t = now() - t;
+    if (res != VM_HALT) {
+        puts("program did not halt");
+        exit(1);
+    }
+    printf("%-14s %8.3f ms, %.2f ns per step\n", name, t * 1e3, t / steps * 1e9);
+    result = st.regfile[0];
+}
+
+int main(int argc, char **argv) {
+    uint32_t steps = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+    printf("%u bytes of code\n", sparse_hash_code_len);
+    struct vm_program *prog = prog_translate(sparse_hash_code, sparse_hash_code_len);
+    run("blocks", nullptr, prog, steps);
+    uint32_t expect = result;
+    run("cogen, switch", sparse_switch, nullptr, steps);
+    bool ok = result == expect;
+    run("cogen, hash", sparse_hash, nullptr, steps);
+    ok &= result == expect;
+    prog_free(prog);
+    if (!ok) {
+        puts("results differ");
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,144 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <unistd.h>
+
+#include "vm.h"
+#include "bytecode.h"
+#include "image.h"
+#include "isa.h"
+
+// --------------------------------------------------
+// BENCHMARK
+// instances of one initial data image, copied or mapped copy-on-write
+// --------------------------------------------------
+//
+// Makes instances of one image (a table of bytes) as private copies and as mappings of image.cpp,
+// and in each runs vsum over a window of the table, vxform over the same window, and vsum again,
+// so that every instance reads and writes one page of it. Then resets every instance to the image
+// and runs vsum once more. Reports the time to make and to reset an instance and the memory each
+// holds privately, and checks that both ways give the same sums, and the first sum after a reset.
+//
+// usage: bench_image.out [instances] [image KiB]
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint32_t run(const uint8_t *code, uint8_t *data, uint32_t input) {
+    struct state st = {};
+    st.regfile[0] = input;
+    st.data = data;
+    st.code = code;
+    if (isa_interp(&st) != VM_HALT) {
+        puts("program did not halt");
+        exit(1);
+    }
+    return st.regfile[0];
+}
+
+struct result {
+    double create, reset; // seconds, over all instances
+    size_t private_pages; // written, over all instances
+    bool same; // the sum after the reset is the first
+};
+
+// n instances into segs by make(), the sums of the runs of instance i into sums[3 * i...]
+template<class Make, class Reset, class Free>
+static struct result measure(uint8_t **segs, uint32_t n, size_t page, size_t npages, uint32_t *sums, Make make,
+                             Reset reset, Free free_seg) {
+    struct result r = {};
+    r.same = true;
+    double t = now();
+    for (uint32_t i = 0; i < n; i++) {
+        segs[i] = make();
+    }
+    r.create = now() - t;
+    for (uint32_t i = 0; i < n; i++) {
+        uint8_t *window = segs[i] + (i * 97ull % npages) * page + 0x80;
+        sums[3 * i] = run(vsum, window, 0);
+        run(vxform, window, i + 1);
+        sums[3 * i + 1] = run(vsum, window, 0);
+    }
+    t = now();
+    for (uint32_t i = 0; i < n; i++) {
+        r.private_pages += reset(segs[i]);
+    }
+    r.reset = now() - t;
+    for (uint32_t i = 0; i < n; i++) {
+        uint8_t *window = segs[i] + (i * 97ull % npages) * page + 0x80;
+        sums[3 * i + 2] = run(vsum, window, 0);
+        r.same &= sums[3 * i + 2] == sums[3 * i];
+        free_seg(segs[i]);
+    }
+    return r;
+}
+
+int main(int argc, char **argv) {
+    uint32_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 256;
+    size_t size = (argc > 2 ? strtoul(argv[2], NULL, 10) : 1024) * 1024;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t npages = size / page;
+    if (!n || !npages) {
+        puts("usage: bench_image.out [instances] [image KiB]");
+        return 1;
+    }
+    uint8_t *table = (uint8_t *) malloc(size);
+    for (size_t i = 0; i < size; i++) {
+        table[i] = i * 7 + 3;
+    }
+    uint8_t **segs = (uint8_t **) calloc(n, sizeof(uint8_t *));
+    uint32_t *copy_sums = (uint32_t *) calloc(3 * n, sizeof(uint32_t));
+    uint32_t *image_sums = (uint32_t *) calloc(3 * n, sizeof(uint32_t));
+
+    struct result copy = measure(
+            segs, n, page, npages, copy_sums,
+            [&] {
+                uint8_t *seg = (uint8_t *) malloc(size);
+                memcpy(seg, table, size);
+                return seg;
+            },
+            [&](uint8_t *seg) {
+                memcpy(seg, table, size);
+                return npages;
+            },
+            [](uint8_t *seg) { free(seg); });
+
+    double t = now();
+    struct vm_image *img = image_create(table, size);
+    double load = now() - t;
+    if (!img) {
+        puts("can't create the image");
+        return 1;
+    }
+    struct result image = measure(
+            segs, n, page, npages, image_sums,
+            [&] {
+                uint8_t *seg = image_map(img);
+                if (!seg) {
+                    puts("can't map the image");
+                    exit(1);
+                }
+                return seg;
+            },
+            [&](uint8_t *seg) { return image_reset(img, seg); },
+            [&](uint8_t *seg) { image_unmap(img, seg); });
+    image_free(img);
+
+    bool same = copy.same && image.same && !memcmp(copy_sums, image_sums, 3 * n * sizeof(uint32_t));
+    printf("%u instances of a %zu KiB image, loaded once in %.0f us\n", n, size / 1024, load * 1e6);
+    printf("copies: %8.2f us to make, %8.2f us to reset, %8.1f KiB private each\n", copy.create / n * 1e6,
+           copy.reset / n * 1e6, (double) copy.private_pages * page / n / 1024);
+    printf("image:  %8.2f us to make, %8.2f us to reset, %8.1f KiB private each%s\n", image.create / n * 1e6,
+           image.reset / n * 1e6, (double) image.private_pages * page / n / 1024, same ? "" : ", RESULTS DIFFER");
+    free(table);
+    free(segs);
+    free(copy_sums);
+    free(image_sums);
+    return same ? 0 : 1;
+}
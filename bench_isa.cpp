@@ -0,0 +1,99 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include "vm.h"
+#include "bytecode.h"
+#include "isa.h"
+
+// --------------------------------------------------
+// BENCHMARK
+// the interpreter of each ISA level the host supports
+// --------------------------------------------------
+//
+// Runs programs of bytecode.h, scalar and vector, in the interpreter of every level of isa.cpp the
+// host supports, and checks that all leave the same r0 and data.
+//
+// usage: bench_isa.out [runs]
+
+static const struct {
+    const char *name;
+    const uint8_t *code;
+    uint32_t input;
+    uint32_t divisor; // of runs
+} programs[] = {
+        {"fib",        fib,        1000, 100},
+        {"xorshift",   xorshift,   1000, 100},
+        {"simd_sum",   simd_sum,   0,    1},
+        {"simd_xform", simd_xform, 3,    1},
+        {"simd_count", simd_count, 11,   1},
+};
+
+struct result {
+    uint32_t r0;
+    uint8_t data[0x100];
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// run `runs` times on a copy of init, seconds per run
+static double run(isa_interp_fn interp, const uint8_t *code, uint32_t input, uint32_t runs, const uint8_t *init,
+                  struct result *res) {
+    memcpy(res->data, init, 0x100);
+    struct state st;
+    double t = now();
+    for (uint32_t i = 0; i < runs; i++) {
+        st = {};
+        st.regfile[0] = input;
+        st.data = res->data + 0x80;
+        st.code = code;
+        if (interp(&st) != VM_HALT) {
+            puts("program did not halt");
+            exit(1);
+        }
+    }
+    t = now() - t;
+    res->r0 = st.regfile[0];
+    return t / runs;
+}
+
+int main(int argc, char **argv) {
+    uint32_t runs = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    uint8_t init[0x100];
+    for (int i = 0; i < 0x100; i++) {
+        init[i] = i * 37 + 11;
+    }
+    isa_report(stdout);
+    printf("%-10s", "");
+    for (uint32_t l = 0; l < isa_nlevels; l++) {
+        if (isa_levels[l].supported) {
+            printf(" %10s", isa_levels[l].name);
+        }
+    }
+    putchar('\n');
+    bool ok = true;
+    for (const auto &p: programs) {
+        struct result first, res;
+        bool same = true;
+        printf("%-10s", p.name);
+        for (uint32_t l = 0; l < isa_nlevels; l++) {
+            if (!isa_levels[l].supported) {
+                continue;
+            }
+            double t = run(isa_levels[l].interp, p.code, p.input, runs / p.divisor, init, &res);
+            printf(" %7.1f ns", t * 1e9);
+            // xform works in place, the results are compared after one run
+            run(isa_levels[l].interp, p.code, p.input, 1, init, l ? &res : &first);
+            same &= !l || (res.r0 == first.r0 && !memcmp(res.data, first.data, sizeof(res.data)));
+        }
+        printf("%s\n", same ? "" : "   RESULTS DIFFER");
+        ok &= same;
+    }
+    return ok ? 0 : 1;
+}
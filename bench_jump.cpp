@@ -0,0 +1,63 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include "vm.h"
+#include "block.h"
+#include "bytecode.h"
+
+// --------------------------------------------------
+// BENCHMARK
+// indirect jumps in cogen output
+// --------------------------------------------------
+//
+// Runs `jstates`, whose states are dispatched by register indirect jumps, in block.cpp, and as
+// generated by cogen without a profile (every jump goes through the jump table) and with one (the
+// profiled targets are compared against first), and checks they compute the same.
+//
+// usage: bench_jump.out [steps]
+
+extern "C" int jstates_table(struct state *st);
+extern "C" int jstates_profiled(struct state *st);
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint32_t result;
+
+static double run(const char *name, int (*entry)(struct state *st), struct vm_program *prog, uint32_t steps) {
+    static uint8_t data[0x100];
+    struct state st = {};
+    st.regfile[0] = steps;
+    st.data = data;
+    double t = now();
+    int res = entry ? entry(&st) : prog_run(prog, &st);
+    t = now() - t;
+    if (res != VM_HALT) {
+        puts("program did not halt");
+        exit(1);
+    }
+    printf("%-18s %8.3f ms, %.2f ns per step\n", name, t * 1e3, t / steps * 1e9);
+    result = st.regfile[0];
+    return t;
+}
+
+int main(int argc, char **argv) {
+    uint32_t steps = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000000;
+    struct vm_program *prog = prog_translate(jstates, sizeof(jstates) - 1);
+    run("blocks", nullptr, prog, steps);
+    uint32_t expect = result;
+    run("cogen, table", jstates_table, nullptr, steps);
+    bool ok = result == expect;
+    run("cogen, profiled", jstates_profiled, nullptr, steps);
+    ok &= result == expect;
+    prog_free(prog);
+    if (!ok) {
+        puts("results differ");
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,128 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include "vm.h"
+#include "bytecode.h"
+#include "block.h"
+#include "super.h"
+#include "lazy.h"
+
+// --------------------------------------------------
+// BENCHMARK
+// decoding on first execution, against decoding up front
+// --------------------------------------------------
+//
+// Runs xorshift followed by a tail of code that never runs (copies of the other programs of
+// bytecode.h, as the decoys of an obfuscated program) in the interpreters of super.cpp (every pc
+// decoded up front, without superinstructions), block.cpp (blocks translated on first use, over a
+// copy of the code) and lazy.cpp. First the time to the first result of a short run, from the
+// bytecode to r0, at growing sizes of the tail; then a long run, where only the interpreters are
+// left. Checks that all leave the same r0.
+//
+// usage: bench_lazy.out [steps]
+
+enum engine { PREDECODED, BLOCKS, LAZY, ENGINES };
+
+static const char *names[ENGINES] = {"pre-decoded", "blocks", "lazy"};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// seconds from the bytecode to the r0 of a run on input, into r0; the instructions decoded into decoded
+static double run(enum engine e, const uint8_t *code, uint32_t len, uint32_t input, uint32_t *r0,
+                  uint64_t *decoded) {
+    uint8_t data[0x100] = {};
+    struct state st = {};
+    st.regfile[0] = input;
+    st.data = data + 0x80;
+    st.code = code;
+    double t = now();
+    int res;
+    switch (e) {
+        case PREDECODED: {
+            struct super_program *prog = super_translate(code, len, false);
+            res = super_run(prog, &st);
+            super_free(prog);
+            *decoded = len;
+            break;
+        }
+        case BLOCKS: {
+            struct vm_program *prog = prog_translate(code, len);
+            res = prog_run(prog, &st);
+            *decoded = prog->decoded;
+            prog_free(prog);
+            break;
+        }
+        default: {
+            struct lazy_program *prog = lazy_open(code, len);
+            if (!prog) {
+                puts("out of memory");
+                exit(1);
+            }
+            res = lazy_run(prog, &st);
+            *decoded = prog->decoded;
+            lazy_free(prog);
+            break;
+        }
+    }
+    t = now() - t;
+    if (res != VM_HALT) {
+        puts("program did not halt");
+        exit(1);
+    }
+    *r0 = st.regfile[0];
+    return t;
+}
+
+int main(int argc, char **argv) {
+    uint32_t steps = argc > 1 ? strtoul(argv[1], NULL, 10) : 40000000;
+    const uint32_t max = 16 << 20;
+    uint8_t *code = (uint8_t *) malloc(max);
+    uint32_t live = sizeof(xorshift) - 1;
+    memcpy(code, xorshift, live);
+    const struct {
+        const uint8_t *code;
+        uint32_t len;
+    } decoys[] = {{fib, sizeof(fib) - 1}, {jstates, sizeof(jstates) - 1}, {vmvm, sizeof(vmvm) - 1}};
+    for (uint32_t at = live, i = 0; at < max; i++) {
+        uint32_t n = decoys[i % 3].len < max - at ? decoys[i % 3].len : max - at;
+        memcpy(code + at, decoys[i % 3].code, n);
+        at += n;
+    }
+
+    bool ok = true;
+    uint32_t expected = 0;
+    uint64_t decoded;
+    // (warm, so that the first size is not charged for the first touch of the code)
+    run(LAZY, code, live, 1000, &expected, &decoded);
+    for (uint32_t len = 64 << 10; len <= max; len *= 4) {
+        printf("%6u KiB, first result:", len >> 10);
+        for (int e = 0; e < ENGINES; e++) {
+            uint32_t r0;
+            double t = run((enum engine) e, code, len, 1000, &r0, &decoded);
+            ok &= r0 == expected;
+            printf("  %s %8.1f us (%llu decoded)", names[e], t * 1e6, (unsigned long long) decoded);
+        }
+        printf("\n");
+    }
+    printf("%6u KiB, %u steps:    ", 64, steps / 4);
+    uint32_t first = 0;
+    for (int e = 0; e < ENGINES; e++) {
+        uint32_t r0;
+        double t = run((enum engine) e, code, 64 << 10, steps / 4, &r0, &decoded);
+        if (e == 0) {
+            first = r0;
+        }
+        ok &= r0 == first;
+        printf("  %s %8.1f ms", names[e], t * 1e3);
+    }
+    printf("%s\n", ok ? "" : ", RESULTS DIFFER");
+    free(code);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,107 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include "vm.h"
+#include "block.h"
+
+// --------------------------------------------------
+// BENCHMARK
+// incremental retranslation of patched bytecode
+// --------------------------------------------------
+//
+// Generates a program of n blocks, each adding an immediate to r2 and ending in a branch, then
+// measures translating all of it against patching one immediate and one branch (which then skips
+// the next block), and checks that the patched translation computes the same as a fresh one. Then
+// the same with a loop in front whose head is in the middle of the first block, so that running
+// it splits the block: the patches must cost the same, a split is not an overlap.
+//
+// usage: bench_patch.out [blocks]
+
+// "I\x01 k" "A\x02\x01" "BE\x00\x00\x00\x00" (both successors are the next block)
+#define BLOCK_SIZE 12
+
+// "I\x00\x03" "I\x03\x01", loop: "A\x02\x03" "U\x00\x03" "BN -> loop", three times
+static const uint8_t loop[] = {'I', 0, 3, 'I', 3, 1, 'A', 2, 3, 'U', 0, 3, 'B', 'N', 0xf4, 0xff, 0xff, 0xff};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// the blocks after prefix
+static uint8_t *generate(uint32_t blocks, const uint8_t *prefix, uint32_t prefix_len, uint32_t *len) {
+    *len = prefix_len + blocks * BLOCK_SIZE + 1;
+    uint8_t *code = (uint8_t *) malloc(*len);
+    memcpy(code, prefix, prefix_len);
+    for (uint32_t i = 0; i < blocks; i++) {
+        uint8_t *b = code + prefix_len + i * BLOCK_SIZE;
+        const uint8_t insns[BLOCK_SIZE] = {'I', 1, (uint8_t) i, 'A', 2, 1, 'B', 'E', 0, 0, 0, 0};
+        memcpy(b, insns, BLOCK_SIZE);
+    }
+    code[*len - 1] = 'H';
+    return code;
+}
+
+static uint32_t run(struct vm_program *prog) {
+    static uint8_t data[0x100];
+    struct state st = {};
+    st.data = data;
+    if (prog_run(prog, &st) != VM_HALT) {
+        puts("program did not halt");
+        exit(1);
+    }
+    return st.regfile[2];
+}
+
+static bool measure(uint32_t blocks, const uint8_t *prefix, uint32_t prefix_len) {
+    uint32_t len;
+    uint8_t *code = generate(blocks, prefix, prefix_len, &len);
+
+    double t = now();
+    struct vm_program *prog = prog_translate(code, len);
+    run(prog);
+    double full = now() - t;
+    printf("translation of %u bytes: %.3f ms (%llu instructions decoded%s)\n", len, full * 1e3,
+           (unsigned long long) prog->decoded, prog->overlap ? ", overlapping" : "");
+
+    // patch the immediate in the middle block, and the branch after it
+    uint32_t mid = prefix_len + blocks / 2 * BLOCK_SIZE;
+    const int rounds = 1001;
+    uint64_t decoded = prog->decoded;
+    t = now();
+    for (int i = 0; i < rounds; i++) {
+        uint8_t imm = i;
+        uint8_t branch[5] = {'E', 0, 0, 0, 0};
+        if (i & 1) {
+            branch[0] = 'N';
+            branch[1] = BLOCK_SIZE;
+        }
+        prog_patch(prog, mid + 2, &imm, 1);
+        prog_patch(prog, mid + 7, branch, sizeof(branch));
+    }
+    double patch = (now() - t) / rounds;
+    printf("patch of an immediate and a branch: %.3f us (%.1f instructions decoded)\n", patch * 1e6,
+           (double) (prog->decoded - decoded) / rounds);
+
+    memcpy(code, prog->code, len);
+    struct vm_program *fresh = prog_translate(code, len);
+    uint32_t expect = run(fresh);
+    uint32_t got = run(prog);
+    printf("result after patching: %u, fresh translation: %u\n", got, expect);
+    prog_free(fresh);
+    prog_free(prog);
+    free(code);
+    return got == expect;
+}
+
+int main(int argc, char **argv) {
+    uint32_t blocks = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    bool ok = measure(blocks, nullptr, 0);
+    printf("with a loop into the middle of the first block:\n");
+    ok &= measure(blocks, loop, sizeof(loop));
+    return ok ? 0 : 1;
+}
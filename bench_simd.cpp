@@ -0,0 +1,104 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include "vm.h"
+#include "bytecode.h"
+#include "block.h"
+
+// --------------------------------------------------
+// BENCHMARK
+// the vector instructions against vectorization of scalar bytecode
+// --------------------------------------------------
+//
+// Runs vsum and vxform from bytecode.h, written with the scalar instructions, and simd_sum and
+// simd_xform, the same kernels written with the vector instructions: in block.cpp, and as
+// generated by cogen (the scalar kernels vectorized by cogen itself). Checks that all four leave
+// the same r0 and data.
+//
+// usage: bench_simd.out [runs]
+
+typedef int (*kernel)(struct state *st);
+
+extern "C" int vsum_simd(struct state *st);
+extern "C" int vxform_simd(struct state *st);
+extern "C" int simd_sum_run(struct state *st);
+extern "C" int simd_xform_run(struct state *st);
+
+static const struct {
+    const char *name;
+    const uint8_t *scalar_code, *vector_code;
+    uint32_t scalar_len, vector_len;
+    kernel scalar, vector;
+} kernels[] = {
+        {"sum",   vsum,   simd_sum,   sizeof(vsum) - 1,   sizeof(simd_sum) - 1,   vsum_simd,   simd_sum_run},
+        {"xform", vxform, simd_xform, sizeof(vxform) - 1, sizeof(simd_xform) - 1, vxform_simd, simd_xform_run},
+};
+
+struct result {
+    uint32_t r0;
+    uint8_t data[0x100];
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// run the kernel `runs` times, by k or else in block.cpp, on a copy of init; seconds per run
+static double run(kernel k, const uint8_t *code, uint32_t len, uint32_t runs, const uint8_t *init,
+                  struct result *res) {
+    struct vm_program *prog = k ? nullptr : prog_translate(code, len);
+    memcpy(res->data, init, 0x100);
+    struct state st;
+    double t = now();
+    for (uint32_t i = 0; i < runs; i++) {
+        st = {};
+        st.regfile[0] = 3;
+        st.data = res->data + 0x80;
+        if ((k ? k(&st) : prog_run(prog, &st)) != VM_HALT) {
+            puts("kernel did not halt");
+            exit(1);
+        }
+    }
+    t = now() - t;
+    res->r0 = st.regfile[0];
+    if (prog) {
+        prog_free(prog);
+    }
+    return t / runs;
+}
+
+int main(int argc, char **argv) {
+    uint32_t runs = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    uint8_t init[0x100];
+    for (int i = 0; i < 0x100; i++) {
+        init[i] = i * 37 + 11;
+    }
+    bool ok = true;
+    for (const auto &k: kernels) {
+        struct result res[4];
+        // (the interpreter a tenth of the runs)
+        double block_scalar = run(nullptr, k.scalar_code, k.scalar_len, runs / 10, init, &res[0]);
+        double block_vector = run(nullptr, k.vector_code, k.vector_len, runs / 10, init, &res[1]);
+        double cogen_scalar = run(k.scalar, nullptr, 0, runs, init, &res[2]);
+        double cogen_vector = run(k.vector, nullptr, 0, runs, init, &res[3]);
+        // xform works in place, the results are compared after one run
+        run(nullptr, k.scalar_code, k.scalar_len, 1, init, &res[0]);
+        run(nullptr, k.vector_code, k.vector_len, 1, init, &res[1]);
+        run(k.scalar, nullptr, 0, 1, init, &res[2]);
+        run(k.vector, nullptr, 0, 1, init, &res[3]);
+        bool same = true;
+        for (int i = 1; i < 4; i++) {
+            same &= res[i].r0 == res[0].r0 && !memcmp(res[i].data, res[0].data, sizeof(res[0].data));
+        }
+        printf("%-6s block.cpp: scalar %7.1f ns, vector %6.1f ns (%.1fx)   cogen: scalar %5.1f ns, vector %5.1f ns "
+               "(%.1fx)%s\n", k.name, block_scalar * 1e9, block_vector * 1e9, block_scalar / block_vector,
+               cogen_scalar * 1e9, cogen_vector * 1e9, cogen_scalar / cogen_vector, same ? "" : ", RESULTS DIFFER");
+        ok &= same;
+    }
+    return ok ? 0 : 1;
+}
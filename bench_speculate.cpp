@@ -0,0 +1,121 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include "vm.h"
+#include "bytecode.h"
+#include "block.h"
+#include "speculate.h"
+
+// --------------------------------------------------
+// BENCHMARK
+// speculation on the profiled input of fib
+// --------------------------------------------------
+//
+// Simulates traffic of fib calls with skewed r0 inputs. The first calls are interpreted with a
+// value profile on r0 at the entry, then fib is specialized to the profile and the remaining
+// calls are run both generic (block.cpp) and through the guard, checking that r0 agrees.
+//
+//   small     - 95% of the inputs below 32, the rest below 100000 (a dense range)
+//   constants - 95% of the inputs one of 5, 300 or 2000 (constants)
+//
+// usage: bench_speculate.out [calls]
+
+#define PROFILED_CALLS 1000
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint32_t rng = 1;
+
+static uint32_t next() {
+    rng = rng * 1103515245 + 12345;
+    return rng >> 8;
+}
+
+static uint32_t input(bool constants) {
+    static const uint32_t common[] = {5, 300, 2000};
+    if (next() % 100 >= 95) {
+        return next() % 100000;
+    }
+    return constants ? common[next() % 3] : next() % 32;
+}
+
+static uint8_t data[0x100];
+
+static uint32_t call(struct spec_program *sp, struct vm_program *generic, uint32_t r0) {
+    struct state st = {};
+    st.data = data;
+    st.code = fib;
+    st.regfile[0] = r0;
+    int res = sp ? spec_run(sp, &st) : prog_run(generic, &st);
+    if (res != VM_HALT) {
+        puts("program did not halt");
+        exit(1);
+    }
+    return st.regfile[0];
+}
+
+static bool scenario(const char *name, bool constants, uint32_t calls) {
+    printf("== %s\n", name);
+    const uint32_t len = sizeof(fib) - 1;
+    struct value_profile vp;
+    vp_init(&vp, 0, 0);
+    for (int i = 0; i < PROFILED_CALLS; i++) {
+        struct state st = {};
+        st.data = data;
+        st.regfile[0] = input(constants);
+        profile_run(fib, len, &st, &vp, 1, nullptr);
+    }
+
+    struct spec_policy policy = {.coverage = 0.9, .max_range = 64};
+    double t = now();
+    struct spec_program *sp = spec_new(fib, len, &vp, &policy);
+    printf("specialization: %.3f ms\n", (now() - t) * 1e3);
+    struct vm_program *generic = prog_translate(fib, len);
+
+    uint32_t *inputs = (uint32_t *) malloc(calls * sizeof(uint32_t));
+    for (uint32_t i = 0; i < calls; i++) {
+        inputs[i] = input(constants);
+    }
+    // timed apart, the uncovered inputs are larger and would dominate
+    uint64_t expect = 0, got = 0;
+    double time[2][2] = {}; // [speculative][covered]
+    uint32_t covered = 0;
+    for (uint32_t i = 0; i < calls; i++) {
+        bool c = spec_covers(sp, inputs[i]);
+        covered += c;
+        t = now();
+        expect += call(nullptr, generic, inputs[i]);
+        time[0][c] += now() - t;
+        t = now();
+        got += call(sp, nullptr, inputs[i]);
+        time[1][c] += now() - t;
+    }
+    spec_report(sp, stdout);
+    if (covered) {
+        printf("covered inputs:   generic %8.3f us per call, speculative %8.3f us per call\n",
+               time[0][1] / covered * 1e6, time[1][1] / covered * 1e6);
+    }
+    if (covered < calls) {
+        printf("uncovered inputs: generic %8.3f us per call, speculative %8.3f us per call\n",
+               time[0][0] / (calls - covered) * 1e6, time[1][0] / (calls - covered) * 1e6);
+    }
+    printf("checksum generic %llu, speculative %llu\n", (unsigned long long) expect, (unsigned long long) got);
+    free(inputs);
+    prog_free(generic);
+    spec_free(sp);
+    return got == expect;
+}
+
+int main(int argc, char **argv) {
+    uint32_t calls = argc > 1 ? strtoul(argv[1], NULL, 10) : 20000;
+    bool ok = scenario("small", false, calls);
+    ok = scenario("constants", true, calls) && ok;
+    return ok ? 0 : 1;
+}
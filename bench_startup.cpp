@@ -0,0 +1,100 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// --------------------------------------------------
+// BENCHMARK
+// exec to exit of one-shot invocations
+// --------------------------------------------------
+//
+// Launches each executable `launches` times with the input as its only argument, as a shell
+// pipeline running it per item would, and measures each from posix_spawn to the exit reaped by
+// waitpid. Checks that all executables print the same output.
+//
+// usage: bench_startup.out [launches] [input] [executables...]
+
+extern char **environ;
+
+static const char *default_executables[] = {"./vm.3.out", "./vm.3.oneshot.out"};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// launch once with stdout to fd, seconds from spawn to exit
+static double launch(const char *exe, const char *input, int fd) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fd, 1);
+    char *argv[] = {(char *) exe, (char *) input, nullptr};
+    pid_t pid;
+    int status;
+    double t = now();
+    if (posix_spawn(&pid, exe, &actions, nullptr, argv, environ) != 0) {
+        printf("can't launch %s\n", exe);
+        exit(1);
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("%s did not exit cleanly\n", exe);
+        exit(1);
+    }
+    t = now() - t;
+    posix_spawn_file_actions_destroy(&actions);
+    return t;
+}
+
+// the output of one launch into buf, its length
+static size_t output(const char *exe, const char *input, char *buf, size_t size) {
+    char path[] = "/tmp/bench_startup.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        puts("can't create a temporary file");
+        exit(1);
+    }
+    unlink(path);
+    launch(exe, input, fd);
+    ssize_t n = pread(fd, buf, size, 0);
+    close(fd);
+    return n < 0 ? 0 : n;
+}
+
+int main(int argc, char **argv) {
+    uint32_t launches = argc > 1 ? strtoul(argv[1], NULL, 10) : 5000;
+    const char *input = argc > 2 ? argv[2] : "30";
+    const char **executables = argc > 3 ? (const char **) argv + 3 : default_executables;
+    int count = argc > 3 ? argc - 3 : sizeof(default_executables) / sizeof(default_executables[0]);
+    int null = open("/dev/null", O_WRONLY);
+    double *times = (double *) calloc(launches, sizeof(double));
+    char first[4096], out[4096];
+    size_t first_len = 0;
+    bool ok = true;
+    for (int e = 0; e < count; e++) {
+        size_t len = output(executables[e], input, e ? out : first, sizeof(out));
+        bool same = !e || (len == first_len && !memcmp(out, first, len));
+        first_len = e ? first_len : len;
+        for (uint32_t i = 0; i < launches; i++) {
+            times[i] = launch(executables[e], input, null);
+        }
+        std::sort(times, times + launches);
+        double sum = 0;
+        for (uint32_t i = 0; i < launches; i++) {
+            sum += times[i];
+        }
+        printf("%-22s mean %6.1f us, median %6.1f us, p99 %6.1f us%s\n", executables[e], sum / launches * 1e6,
+               times[launches / 2] * 1e6, times[launches * 99 / 100] * 1e6, same ? "" : ", OUTPUT DIFFERS");
+        ok &= same;
+    }
+    free(times);
+    close(null);
+    return ok ? 0 : 1;
+}
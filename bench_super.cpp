@@ -0,0 +1,54 @@
+#include <cstdint>
+#include <cstdio>
+
+#include "vm.h"
+#include "bench.h"
+#include "super.h"
+
+// --------------------------------------------------
+// BENCHMARK
+// the mined superinstructions of super.gen.h
+// --------------------------------------------------
+//
+// Runs programs of bytecode.h on the pre-decoded interpreter of super.cpp, without and with the
+// superinstructions: the instructions run per dispatch (counted on one run each), the time, and
+// that both leave the same r0.
+//
+// usage: bench_super.out [steps]
+
+// seconds to run prog on r0 = input, its r0 into r0
+static double run(const struct super_program *prog, uint32_t input, struct super_stats *stats, uint32_t *r0) {
+    struct state st;
+    bench_init(&st, nullptr, input);
+    double t = bench_now();
+    int res = super_run(prog, &st, stats);
+    t = bench_now() - t;
+    bench_halted(res);
+    *r0 = st.regfile[0];
+    return t;
+}
+
+int main(int argc, char **argv) {
+    uint32_t steps = bench_steps(argc, argv);
+    bool ok = true;
+    for (const auto &p: bench_programs) {
+        uint32_t input = steps / p.divisor;
+        struct super_program *plain = super_translate(p.code, p.len, false);
+        struct super_program *supers = super_translate(p.code, p.len);
+        struct super_stats plain_stats = {}, super_stats = {};
+        uint32_t r0[2];
+        run(plain, input, &plain_stats, &r0[0]);
+        run(supers, input, &super_stats, &r0[1]);
+        bool same = r0[0] == r0[1];
+        double plain_t = run(plain, input, nullptr, &r0[0]);
+        double super_t = run(supers, input, nullptr, &r0[1]);
+        same &= r0[0] == r0[1] && plain_stats.insns == super_stats.insns;
+        printf("%-9s %2u pcs rewritten, %.2f instructions per dispatch, %7.1f ms -> %7.1f ms (%.2fx)%s\n", p.name,
+               supers->rewritten, (double) super_stats.insns / super_stats.dispatches, plain_t * 1e3, super_t * 1e3,
+               plain_t / super_t, same ? "" : ", RESULTS DIFFER");
+        ok &= same;
+        super_free(plain);
+        super_free(supers);
+    }
+    return ok ? 0 : 1;
+}
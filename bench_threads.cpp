@@ -0,0 +1,61 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include <unistd.h>
+
+#include "vm.h"
+#include "bytecode.h"
+#include "thread.h"
+
+// --------------------------------------------------
+// BENCHMARK
+// the VM threads of pxorshift on 1, 2, 4... host workers
+// --------------------------------------------------
+//
+// Runs pxorshift from bytecode.h, 16 VM threads of xorshift32, with the number of workers doubling
+// up to the number of cores (or the given maximum). Checks that every run leaves the same r0 and that
+// all 16 threads counted themselves.
+//
+// usage: bench_threads.out [steps per thread] [max workers]
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+    uint32_t steps = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000000;
+    long cores = argc > 2 ? strtol(argv[2], NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    bool ok = true;
+    uint32_t expected = 0;
+    double single = 0;
+    for (uint32_t workers = 1;; workers *= 2) {
+        if (workers > cores) {
+            workers = cores;
+        }
+        uint8_t data[0x100] = {};
+        struct state st = {};
+        st.regfile[0] = steps;
+        st.data = data;
+        st.code = pxorshift;
+        struct threads_stats stats;
+        double t = now();
+        int res = threads_run(pxorshift, sizeof(pxorshift) - 1, &st, workers, &stats);
+        t = now() - t;
+        if (workers == 1) {
+            expected = st.regfile[0];
+            single = t;
+        }
+        bool same = res == VM_HALT && st.regfile[0] == expected && st.regfile[0] >> 16 == 16;
+        printf("%3u workers: %7.1f ms (%.1fx), %u VM threads, %llu steals%s\n", stats.workers, t * 1e3,
+               single / t, stats.threads, (unsigned long long) stats.steals, same ? "" : ", RESULTS DIFFER");
+        ok &= same;
+        if (workers == cores) {
+            break;
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,293 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "block.h"
+
+// --------------------------------------------------
+// DECODING
+// --------------------------------------------------
+
+static struct vm_block *block_new(uint32_t start) {
+    struct vm_block *b = (struct vm_block *) calloc(1, sizeof(struct vm_block));
+    b->start = start;
+    return b;
+}
+
+static void own(struct vm_program *prog, struct vm_block *b) {
+    uint32_t pc = b->start;
+    for (uint32_t i = 0; i < b->ninsns; i++) {
+        for (uint32_t j = 0; j < b->insns[i].len; j++) {
+            if (prog->owner[pc + j] && prog->owner[pc + j] != b) {
+                prog->overlap = true;
+            }
+            prog->owner[pc + j] = b;
+        }
+        pc += b->insns[i].len;
+    }
+}
+
+static void disown(struct vm_program *prog, struct vm_block *b) {
+    for (uint32_t pc = b->start; pc < b->end; pc++) {
+        if (prog->owner[pc] == b) {
+            prog->owner[pc] = nullptr;
+        }
+    }
+}
+
+// pc is an instruction boundary inside b
+static bool boundary(const struct vm_block *b, uint32_t pc, uint32_t *index) {
+    uint32_t at = b->start;
+    for (uint32_t i = 0; i < b->ninsns; i++) {
+        if (at == pc) {
+            *index = i;
+            return true;
+        }
+        at += b->insns[i].len;
+    }
+    return false;
+}
+
+// split b so that a new block starts at pc, the i-th instruction of b
+static struct vm_block *split(struct vm_program *prog, struct vm_block *b, uint32_t pc, uint32_t i) {
+    struct vm_block *c = block_new(pc);
+    c->end = b->end;
+    c->ninsns = b->ninsns - i;
+    c->insns = (struct vm_insn *) malloc(c->ninsns * sizeof(struct vm_insn));
+    memcpy(c->insns, b->insns + i, c->ninsns * sizeof(struct vm_insn));
+    memcpy(c->succ_pc, b->succ_pc, sizeof(b->succ_pc));
+    memcpy(c->succ, b->succ, sizeof(b->succ));
+
+    b->end = pc;
+    b->ninsns = i;
+    b->succ_pc[0] = pc;
+    b->succ_pc[1] = pc;
+    b->succ[0] = c;
+    b->succ[1] = c;
+
+    prog->blocks[pc] = c;
+    // the bytes b decoded past pc are c's now (not an overlap, which own would take them for)
+    for (uint32_t at = pc; at < c->end; at++) {
+        if (prog->owner[at] == b) {
+            prog->owner[at] = c;
+        }
+    }
+    return c;
+}
+
+// (re)decode b from its start, up to the first control transfer or the start of another block
+static void fill(struct vm_program *prog, struct vm_block *b) {
+    uint32_t cap = 8;
+    struct vm_insn *insns = (struct vm_insn *) malloc(cap * sizeof(struct vm_insn));
+    uint32_t n = 0;
+    uint32_t pc = b->start;
+    while (1) {
+        if (n == cap) {
+            cap *= 2;
+            insns = (struct vm_insn *) realloc(insns, cap * sizeof(struct vm_insn));
+        }
+        struct vm_insn *in = &insns[n++];
+        decode_insn(prog->code, prog->len, pc, in);
+        prog->decoded++;
+        pc += in->len;
+        if (!in->opcode || in->opcode == 'B' || in->opcode == 'J' || in->opcode == 'H') {
+            break;
+        }
+        if (pc >= prog->len || prog->blocks[pc] || prog->owner[pc]) {
+            break;
+        }
+    }
+    free(b->insns);
+    b->insns = insns;
+    b->ninsns = n;
+    b->end = pc;
+
+    struct vm_insn *last = &insns[n - 1];
+    b->succ_pc[0] = pc;
+    b->succ_pc[1] = last->opcode == 'B' ? pc + last->off : pc;
+    b->succ[0] = nullptr;
+    b->succ[1] = nullptr;
+    own(prog, b);
+}
+
+// the block starting at pc, translating or splitting blocks as needed
+static struct vm_block *block_at(struct vm_program *prog, uint32_t pc) {
+    if (pc >= prog->len) {
+        return nullptr;
+    }
+    if (prog->blocks[pc]) {
+        return prog->blocks[pc];
+    }
+    struct vm_block *b = prog->owner[pc];
+    uint32_t i;
+    if (b && b->start != pc && boundary(b, pc, &i)) {
+        return split(prog, b, pc, i);
+    }
+    // (overlapping code starting in the middle of another block's instruction gets its own block)
+    b = block_new(pc);
+    prog->blocks[pc] = b;
+    fill(prog, b);
+    return b;
+}
+
+// --------------------------------------------------
+// TRANSLATION
+// --------------------------------------------------
+
+static void translate(struct vm_program *prog, const uint8_t *code, uint32_t len) {
+    prog->code = (uint8_t *) malloc(len ? len : 1);
+    memcpy(prog->code, code, len);
+    prog->len = len;
+    prog->blocks = (struct vm_block **) calloc(len ? len : 1, sizeof(struct vm_block *));
+    prog->owner = (struct vm_block **) calloc(len ? len : 1, sizeof(struct vm_block *));
+    prog->overlap = false;
+    // translate the entry, the other blocks are translated on first execution
+    block_at(prog, 0);
+}
+
+static void release(struct vm_program *prog) {
+    for (uint32_t pc = 0; pc < prog->len; pc++) {
+        if (prog->blocks[pc]) {
+            free(prog->blocks[pc]->insns);
+            free(prog->blocks[pc]);
+        }
+    }
+    free(prog->blocks);
+    free(prog->owner);
+    free(prog->code);
+}
+
+struct vm_program *prog_translate(const uint8_t *code, uint32_t len) {
+    struct vm_program *prog = (struct vm_program *) calloc(1, sizeof(struct vm_program));
+    translate(prog, code, len);
+    return prog;
+}
+
+void prog_free(struct vm_program *prog) {
+    release(prog);
+    free(prog);
+}
+
+static void retranslate(struct vm_program *prog, struct vm_block *b) {
+    disown(prog, b);
+    fill(prog, b);
+}
+
+void prog_patch(struct vm_program *prog, uint32_t pc, const uint8_t *bytes, uint32_t n) {
+    if (pc >= prog->len) {
+        return;
+    }
+    if (n > prog->len - pc) {
+        n = prog->len - pc;
+    }
+    memcpy(prog->code + pc, bytes, n);
+
+    if (prog->overlap) {
+        // any block decoding a patched byte, which owner may not record
+        for (uint32_t at = 0; at < prog->len; at++) {
+            struct vm_block *b = prog->blocks[at];
+            if (b && b->start < pc + n && b->end > pc) {
+                retranslate(prog, b);
+            }
+        }
+        return;
+    }
+    // blocks are split but never merged, so only the blocks decoding a patched byte change,
+    // each is retranslated from its own start
+    struct vm_block *last = nullptr;
+    for (uint32_t at = pc; at < pc + n; at++) {
+        struct vm_block *b = prog->owner[at] ? prog->owner[at] : prog->blocks[at];
+        if (b && b != last) {
+            retranslate(prog, b);
+            last = b;
+        }
+    }
+}
+
+void prog_update(struct vm_program *prog, const uint8_t *code, uint32_t len) {
+    if (len != prog->len) {
+        release(prog);
+        translate(prog, code, len);
+        return;
+    }
+    for (uint32_t pc = 0; pc < len;) {
+        if (prog->code[pc] == code[pc]) {
+            pc++;
+            continue;
+        }
+        uint32_t end = pc;
+        while (end < len && prog->code[end] != code[end]) {
+            end++;
+        }
+        prog_patch(prog, pc, code + pc, end - pc);
+        pc = end;
+    }
+}
+
+// --------------------------------------------------
+// VM INTERPRETER
+// runs the translated blocks
+// --------------------------------------------------
+
+#define OP1 (in->op1)
+#define OP2 (in->op2)
+#define OFF (in->off)
+
+int prog_run(struct vm_program *prog, struct state *st) {
+    return prog_run_for(prog, st, UINT64_MAX);
+}
+
+int prog_run_for(struct vm_program *prog, struct state *st, uint64_t budget) {
+    struct vm_block *b = block_at(prog, st->pc);
+    while (b) {
+        for (uint32_t i = 0; i < b->ninsns; i++) {
+            const struct vm_insn *in = &b->insns[i];
+            switch (in->opcode) {
+#define INSN(op, len, handler) \
+                case op:       \
+                    handler;   \
+                    break;
+                VM_INSNS(INSN)
+#undef INSN
+#define JUMP(op, len, handler) \
+                case op:       \
+                    handler;   \
+                    continue;
+                // (the last instruction of its block, its target is found in blocks)
+                VM_JUMPS(JUMP)
+#undef JUMP
+                case 'B':
+                    switch (in->op1) {
+#define BRANCH(cc, handler) \
+                        case cc:            \
+                            handler;        \
+                            break;
+                        VM_BRANCHES(BRANCH)
+#undef BRANCH
+                    }
+                    break;
+                case 'H':
+                    return VM_HALT;
+                default:
+                    return VM_ILLEGAL;
+            }
+            st->pc += in->len;
+        }
+        if (st->pc < b->end) {
+            prog->backedges++;
+            if (--budget == 0) {
+                return VM_CONTINUE;
+            }
+        }
+        // chain to the successor, translating it on first use
+        int s = st->pc == b->succ_pc[0] ? 0 : 1;
+        if (st->pc != b->succ_pc[s]) {
+            b = block_at(prog, st->pc);
+            continue;
+        }
+        if (!b->succ[s]) {
+            b->succ[s] = block_at(prog, st->pc);
+        }
+        b = b->succ[s];
+    }
+    return VM_BAD_PC;
+}
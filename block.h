@@ -0,0 +1,57 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include <cstdint>
+
+#include "vm.h"
+
+// --------------------------------------------------
+// BLOCK TRANSLATION
+// --------------------------------------------------
+//
+// Bytecode translated at run time into basic blocks of decoded instructions, chained directly to
+// their successor blocks. The translation keeps its CFG (which block starts at and owns each
+// byte), so patched bytecode is retranslated incrementally: only the blocks covering changed
+// bytes are decoded again. Blocks are retranslated in place, so the edges of their predecessors
+// stay valid and a one instruction patch costs one block, independent of the program size. An
+// indirect jump ends its block, and its target is looked up in the table of blocks by pc.
+
+struct vm_block {
+    uint32_t start; // pc of the first instruction
+    uint32_t end; // pc after the last instruction
+    uint32_t ninsns;
+    struct vm_insn *insns;
+    // [0] fallthrough, [1] branch target; the block is translated on first use
+    uint32_t succ_pc[2];
+    struct vm_block *succ[2];
+};
+
+struct vm_program {
+    uint8_t *code; // private copy, patched in place
+    uint32_t len;
+    struct vm_block **blocks; // the block starting at each pc
+    struct vm_block **owner; // a block decoding each byte
+    bool overlap; // some byte is decoded by more than one block, owner is not enough
+    uint64_t decoded; // instructions decoded so far
+    uint64_t backedges; // taken branches to the same or an earlier pc, so far
+};
+
+struct vm_program *prog_translate(const uint8_t *code, uint32_t len);
+
+// Replace n bytes at pc and retranslate the blocks decoding them.
+void prog_patch(struct vm_program *prog, uint32_t pc, const uint8_t *bytes, uint32_t n);
+
+// Diff code against the translated bytecode and patch every changed range. A different length
+// retranslates the whole program.
+void prog_update(struct vm_program *prog, const uint8_t *code, uint32_t len);
+
+// Run from st->pc, returns VM_HALT, VM_ILLEGAL or VM_BAD_PC.
+int prog_run(struct vm_program *prog, struct state *st);
+
+// Like prog_run, but returns VM_CONTINUE after taking `budget` back edges, with st->pc at the
+// loop header, so the caller can resume in this or another engine.
+int prog_run_for(struct vm_program *prog, struct state *st, uint64_t budget);
+
+void prog_free(struct vm_program *prog);
+
+#endif
@@ -0,0 +1,523 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include <cstdint>
+
+// --------------------------------------------------
+// VM BYTECODE
+// --------------------------------------------------
+
+// Compute the nth fibonacci number.
+// r0 is both the parameter and result uint8_t.
+//
+// f(0) = 1
+// f(1) = 1
+// f(2) = 2
+// f(3) = 3
+// f(4) = 5
+// f(5) = 8
+// ...
+//
+constexpr uint8_t
+fib[] =
+"M\x03\x00" // r3 := r0
+"I\x01\x01" // r1 := 1
+"I\x02\x01" // r2 := 1
+
+// if r3 < 2 -> halt
+"I\x04\x02" // r4 := 2
+"M\x05\x03" // r5 := r3
+"U\x05\x04" // r5 := r5 - r4
+"BL\x1b\x00\x00\x00"
+
+// loop begin
+
+"I\x05\x01" // r5 := 1
+"U\x03\x05" // r3 := r3 - r5
+"M\x04\x02" // r4 := r2
+"A\x02\x01" // r2 := r2 + r1
+"M\x01\x04" // r1 := r4
+"I\x06\x00" // r6 := 0
+"A\x06\x03" // r6 := r6 + r3
+"BN\xe5\xff\xff\xff" // if r3 != 0 -> loop entry
+
+// loop end (+0x1b bytes)
+
+"I\x00\x00" // r0 := 0
+"S\x00\x02" // *r0 := r2
+"L\x00\x00" // r0 := *r0
+"H" // halt
+;
+
+// A VM interpreter for the same instruction set, written in VM bytecode ("VM-in-VM").
+// The inner bytecode is read from the data segment, so the outer program is the dispatch loop
+// of a second, nested VM.
+//
+// data[0x00..0x3f] inner ".text" (read-only, see VMVM_CODE_SIZE)
+// data[0x40..0x6f] inner ".data"
+// data[0x70..0x7f] inner registers r0 ... r15
+//
+// The data segment is byte addressed, so inner registers are one byte wide and only the low byte
+// of an inner branch offset is used (sign extended). Inner flags are recomputed from the result
+// of the last inner A or U, which is kept in r14.
+// r0 is both the parameter and result of the inner program.
+//
+// r15 inner pc, r13 opcode, r12 operand 1, r11 operand 2, r7 the constant 1, r8 - r10 scratch
+#define VMVM_CODE_SIZE 0x40
+constexpr uint8_t
+vmvm[] =
+"I\x08\x70"             // r8 := &inner r0
+"S\x08\x00"             // inner r0 := r0
+"I\x0f\x00"             // ipc := 0
+"I\x0e\x01"             // r14 := 1 (no inner flags set)
+"I\x07\x01"             // r7 := 1
+
+// dispatch (+0x0f)
+"L\x0f\x0d"             // r13 := *ipc (opcode)
+"M\x0c\x0f"             // r12 := ipc
+"A\x0c\x07"             // r12 := r12 + 1
+"L\x0c\x0c"             // r12 := *r12 (operand 1)
+"M\x0b\x0f"             // r11 := ipc
+"A\x0b\x07"             // r11 := r11 + 1
+"A\x0b\x07"             // r11 := r11 + 1
+"L\x0b\x0b"             // r11 := *r11 (operand 2)
+"I\x08\x4d"             // r8 := 'M'
+"M\x09\x0d"             // r9 := r13
+"U\x09\x08"             // r9 := r9 - r8
+"BE\x6a\x00\x00\x00"    // if opcode == 'M' -> mov
+"I\x08\x49"             // r8 := 'I'
+"M\x09\x0d"             // r9 := r13
+"U\x09\x08"             // r9 := r9 - r8
+"BE\x7c\x00\x00\x00"    // if opcode == 'I' -> movi
+"I\x08\x41"             // r8 := 'A'
+"M\x09\x0d"             // r9 := r13
+"U\x09\x08"             // r9 := r9 - r8
+"BE\x88\x00\x00\x00"    // if opcode == 'A' -> add
+"I\x08\x55"             // r8 := 'U'
+"M\x09\x0d"             // r9 := r13
+"U\x09\x08"             // r9 := r9 - r8
+"BE\xa3\x00\x00\x00"    // if opcode == 'U' -> sub
+"I\x08\x4c"             // r8 := 'L'
+"M\x09\x0d"             // r9 := r13
+"U\x09\x08"             // r9 := r9 - r8
+"BE\xbe\x00\x00\x00"    // if opcode == 'L' -> load
+"I\x08\x53"             // r8 := 'S'
+"M\x09\x0d"             // r9 := r13
+"U\x09\x08"             // r9 := r9 - r8
+"BE\xd9\x00\x00\x00"    // if opcode == 'S' -> store
+"I\x08\x42"             // r8 := 'B'
+"M\x09\x0d"             // r9 := r13
+"U\x09\x08"             // r9 := r9 - r8
+"BE\xf4\x00\x00\x00"    // if opcode == 'B' -> branch
+"I\x08\x48"             // r8 := 'H'
+"M\x09\x0d"             // r9 := r13
+"U\x09\x08"             // r9 := r9 - r8
+"BE\xa6\x01\x00\x00"    // if opcode == 'H' -> halt
+"\xff"                  // illegal
+
+// mov (+0xa0): inner r[op1] := inner r[op2]
+"I\x08\x70"             // r8 := &inner r0
+"A\x0c\x08"             // r12 := &inner r[op1]
+"A\x0b\x08"             // r11 := &inner r[op2]
+"L\x0b\x0a"             // r10 := *r11
+"S\x0c\x0a"             // *r12 := r10
+"I\x08\x03"             // r8 := 3
+"A\x0f\x08"             // ipc := ipc + r8
+"BN\x54\xff\xff\xff"    // -> dispatch
+"BE\x4e\xff\xff\xff"    // -> dispatch
+
+// movi (+0xc1): inner r[op1] := op2
+"I\x08\x70"             // r8 := &inner r0
+"A\x0c\x08"             // r12 := &inner r[op1]
+"S\x0c\x0b"             // *r12 := r11
+"I\x08\x03"             // r8 := 3
+"A\x0f\x08"             // ipc := ipc + r8
+"BN\x39\xff\xff\xff"    // -> dispatch
+"BE\x33\xff\xff\xff"    // -> dispatch
+
+// add (+0xdc): inner r[op1] := inner r[op1] + inner r[op2]
+"I\x08\x70"             // r8 := &inner r0
+"A\x0c\x08"             // r12 := &inner r[op1]
+"A\x0b\x08"             // r11 := &inner r[op2]
+"L\x0c\x0a"             // r10 := *r12
+"L\x0b\x09"             // r9 := *r11
+"A\x0a\x09"             // r10 := r10 + r9
+"M\x0e\x0a"             // r14 := r10
+"S\x0c\x0a"             // *r12 := r10
+"I\x08\x03"             // r8 := 3
+"A\x0f\x08"             // ipc := ipc + r8
+"BN\x0f\xff\xff\xff"    // -> dispatch
+"BE\x09\xff\xff\xff"    // -> dispatch
+
+// sub (+0x106): inner r[op1] := inner r[op1] - inner r[op2]
+"I\x08\x70"             // r8 := &inner r0
+"A\x0c\x08"             // r12 := &inner r[op1]
+"A\x0b\x08"             // r11 := &inner r[op2]
+"L\x0c\x0a"             // r10 := *r12
+"L\x0b\x09"             // r9 := *r11
+"U\x0a\x09"             // r10 := r10 - r9
+"M\x0e\x0a"             // r14 := r10
+"S\x0c\x0a"             // *r12 := r10
+"I\x08\x03"             // r8 := 3
+"A\x0f\x08"             // ipc := ipc + r8
+"BN\xe5\xfe\xff\xff"    // -> dispatch
+"BE\xdf\xfe\xff\xff"    // -> dispatch
+
+// load (+0x130): inner r[op2] := inner data[inner r[op1]]
+"I\x08\x70"             // r8 := &inner r0
+"A\x0c\x08"             // r12 := &inner r[op1]
+"A\x0b\x08"             // r11 := &inner r[op2]
+"L\x0c\x0a"             // r10 := *r12
+"I\x08\x40"             // r8 := &inner data
+"A\x0a\x08"             // r10 := r10 + r8
+"L\x0a\x09"             // r9 := *r10
+"S\x0b\x09"             // *r11 := r9
+"I\x08\x03"             // r8 := 3
+"A\x0f\x08"             // ipc := ipc + r8
+"BN\xbb\xfe\xff\xff"    // -> dispatch
+"BE\xb5\xfe\xff\xff"    // -> dispatch
+
+// store (+0x15a): inner data[inner r[op1]] := inner r[op2]
+"I\x08\x70"             // r8 := &inner r0
+"A\x0c\x08"             // r12 := &inner r[op1]
+"A\x0b\x08"             // r11 := &inner r[op2]
+"L\x0c\x0a"             // r10 := *r12
+"L\x0b\x09"             // r9 := *r11
+"I\x08\x40"             // r8 := &inner data
+"A\x0a\x08"             // r10 := r10 + r8
+"S\x0a\x09"             // *r10 := r9
+"I\x08\x03"             // r8 := 3
+"A\x0f\x08"             // ipc := ipc + r8
+"BN\x91\xfe\xff\xff"    // -> dispatch
+"BE\x8b\xfe\xff\xff"    // -> dispatch
+
+// branch (+0x184): r12 is the condition, r11 the low byte of the offset
+"I\x08\x80"             // r8 := 0x80
+"M\x09\x0b"             // r9 := r11
+"U\x09\x08"             // r9 := r9 - r8
+"BL\x0c\x00\x00\x00"    // if r11 < 0x80 -> branch_cc
+"I\x08\xff"             // r8 := 0xff
+"U\x0b\x08"             // r11 := r11 - r8
+"I\x08\x01"             // r8 := 1
+"U\x0b\x08"             // r11 := r11 - r8 (sign extended)
+
+// branch_cc (+0x19f)
+"I\x08\x45"             // r8 := 'E'
+"M\x09\x0c"             // r9 := r12
+"U\x09\x08"             // r9 := r9 - r8
+"BE\x1f\x00\x00\x00"    // if cc == 'E' -> branch_eq
+"I\x08\x4e"             // r8 := 'N'
+"M\x09\x0c"             // r9 := r12
+"U\x09\x08"             // r9 := r9 - r8
+"BE\x31\x00\x00\x00"    // if cc == 'N' -> branch_ne
+"I\x08\x4c"             // r8 := 'L'
+"M\x09\x0c"             // r9 := r12
+"U\x09\x08"             // r9 := r9 - r8
+"BE\x43\x00\x00\x00"    // if cc == 'L' -> branch_lt
+"\xff"                  // illegal
+
+// branch_eq (+0x1cd)
+"M\x09\x0e"             // r9 := r14
+"I\x08\x00"             // r8 := 0
+"A\x09\x08"             // r9 := r9 + r8 (flags of the last inner result)
+"BE\x54\x00\x00\x00"    // if Z -> branch_taken
+"I\x08\x06"             // r8 := 6
+"A\x0f\x08"             // ipc := ipc + r8
+"BN\x27\xfe\xff\xff"    // -> dispatch
+"BE\x21\xfe\xff\xff"    // -> dispatch
+
+// branch_ne (+0x1ee)
+"M\x09\x0e"             // r9 := r14
+"I\x08\x00"             // r8 := 0
+"A\x09\x08"             // r9 := r9 + r8 (flags of the last inner result)
+"BN\x33\x00\x00\x00"    // if !Z -> branch_taken
+"I\x08\x06"             // r8 := 6
+"A\x0f\x08"             // ipc := ipc + r8
+"BN\x06\xfe\xff\xff"    // -> dispatch
+"BE\x00\xfe\xff\xff"    // -> dispatch
+
+// branch_lt (+0x20f)
+"M\x09\x0e"             // r9 := r14
+"I\x08\x00"             // r8 := 0
+"A\x09\x08"             // r9 := r9 + r8 (flags of the last inner result)
+"BL\x12\x00\x00\x00"    // if N != V -> branch_taken
+"I\x08\x06"             // r8 := 6
+"A\x0f\x08"             // ipc := ipc + r8
+"BN\xe5\xfd\xff\xff"    // -> dispatch
+"BE\xdf\xfd\xff\xff"    // -> dispatch
+
+// branch_taken (+0x230)
+"A\x0f\x0b"             // ipc := ipc + r11
+"I\x08\x06"             // r8 := 6
+"A\x0f\x08"             // ipc := ipc + r8
+"BN\xd0\xfd\xff\xff"    // -> dispatch
+"BE\xca\xfd\xff\xff"    // -> dispatch
+
+// halt (+0x245)
+"I\x08\x70"             // r8 := &inner r0
+"L\x08\x00"             // r0 := *r8
+"H"                     // halt
+;
+
+// Kernels over the data segment, for the vectorizer in cogen.cpp. Each walks 128 bytes with a
+// pointer register stepping by 1 and the counter r3.
+
+// r0 := the sum of data[0x00..0x7f]
+constexpr uint8_t
+vsum[] =
+"I\x01\x00"             // r1 := 0 (pointer)
+"I\x03\x80"             // r3 := 128 (counter)
+"I\x00\x00"             // r0 := 0
+
+// loop (+0x09)
+"L\x01\x04"             // r4 := *r1
+"A\x00\x04"             // r0 := r0 + r4
+"I\x05\x01"             // r5 := 1
+"A\x01\x05"             // r1 := r1 + r5
+"U\x03\x05"             // r3 := r3 - r5
+"BN\xeb\xff\xff\xff"    // if r3 != 0 -> loop
+"H"                     // halt
+;
+
+// data[-0x80..-0x01] := data[0x00..0x7f]
+constexpr uint8_t
+vcopy[] =
+"I\x01\x00"             // r1 := 0 (source)
+"I\x02\x80"             // r2 := -128 (destination)
+"I\x03\x80"             // r3 := 128 (counter)
+
+// loop (+0x09)
+"L\x01\x04"             // r4 := *r1
+"S\x02\x04"             // *r2 := r4
+"I\x05\x01"             // r5 := 1
+"A\x01\x05"             // r1 := r1 + r5
+"A\x02\x05"             // r2 := r2 + r5
+"U\x03\x05"             // r3 := r3 - r5
+"BN\xe8\xff\xff\xff"    // if r3 != 0 -> loop
+"H"                     // halt
+;
+
+// data[0x00..0x7f] += r0, in place
+constexpr uint8_t
+vxform[] =
+"I\x01\x00"             // r1 := 0 (pointer)
+"I\x03\x80"             // r3 := 128 (counter)
+
+// loop (+0x06)
+"L\x01\x04"             // r4 := *r1
+"A\x04\x00"             // r4 := r4 + r0
+"S\x01\x04"             // *r1 := r4
+"I\x05\x01"             // r5 := 1
+"A\x01\x05"             // r1 := r1 + r5
+"U\x03\x05"             // r3 := r3 - r5
+"BN\xe8\xff\xff\xff"    // if r3 != 0 -> loop
+"H"                     // halt
+;
+
+// vsum and vxform written with the vector instructions, 16 bytes at a time
+
+// r0 := data[0x00] + ... + data[0x7f]
+constexpr uint8_t
+simd_sum[] =
+"I\x01\x00"             // r1 := 0 (pointer)
+"I\x03\x08"             // r3 := 8 (counter)
+"I\x05\x10"             // r5 := 16
+"I\x06\x01"             // r6 := 1
+"I\x00\x00"             // r0 := 0
+
+// loop (+0x0f)
+"V\x01\x00"             // v0 := *r1
+"R\x04\x00"             // r4 := the sum of the lanes of v0
+"A\x00\x04"             // r0 := r0 + r4
+"A\x01\x05"             // r1 := r1 + r5
+"U\x03\x06"             // r3 := r3 - r6
+"BN\xeb\xff\xff\xff"    // if r3 != 0 -> loop
+"H"                     // halt
+;
+
+// data[0x00..0x7f] += r0, in place
+constexpr uint8_t
+simd_xform[] =
+"D\x01\x00"             // v1 := r0 in every lane
+"I\x01\x00"             // r1 := 0 (pointer)
+"I\x03\x08"             // r3 := 8 (counter)
+"I\x05\x10"             // r5 := 16
+"I\x06\x01"             // r6 := 1
+
+// loop (+0x0f)
+"V\x01\x00"             // v0 := *r1
+"+\x00\x01"             // v0 := v0 + v1
+"W\x01\x00"             // *r1 := v0
+"A\x01\x05"             // r1 := r1 + r5
+"U\x03\x06"             // r3 := r3 - r6
+"BN\xeb\xff\xff\xff"    // if r3 != 0 -> loop
+"H"                     // halt
+;
+
+// r0 := the number of bytes of data[0x00..0x7f] equal to the low byte of r0
+constexpr uint8_t
+simd_count[] =
+"D\x01\x00"             // v1 := r0 in every lane
+"I\x01\x00"             // r1 := 0 (pointer)
+"I\x03\x08"             // r3 := 8 (counter)
+"I\x05\x10"             // r5 := 16
+"I\x06\x01"             // r6 := 1
+"I\x00\x00"             // r0 := 0
+"D\x02\x00"             // v2 := 0 (the count in each lane)
+
+// loop (+0x15)
+"V\x01\x00"             // v0 := *r1
+"=\x00\x01"             // v0 := 0xff where v0 == v1, else 0
+"-\x02\x00"             // v2 := v2 - v0 (+1 where equal)
+"A\x01\x05"             // r1 := r1 + r5
+"U\x03\x06"             // r3 := r3 - r6
+"BN\xeb\xff\xff\xff"    // if r3 != 0 -> loop
+"R\x00\x02"             // r0 := the sum of the lanes of v2
+"H"                     // halt
+;
+
+// A state machine stepping through its states with register indirect jumps, like the dispatch of a
+// threaded interpreter: r1 holds the pc of the next state, and each state jumps back to the
+// dispatch, whose pc is held in r5. r0 is both the number of steps and the result.
+constexpr uint8_t
+jstates[] =
+"I\x01\x14"             // r1 := state_a
+"I\x03\x01"             // r3 := 1
+"I\x05\x09"             // r5 := dispatch
+
+// dispatch (+0x09)
+"U\x00\x03"             // r0 := r0 - r3
+"BE\x1a\x00\x00\x00"    // if r0 == 0 -> done
+"J\x01"                 // -> r1
+
+// state_a (+0x14)
+"A\x02\x03"             // r2 := r2 + r3
+"I\x01\x1c"             // r1 := state_b
+"J\x05"                 // -> dispatch
+
+// state_b (+0x1c)
+"A\x02\x02"             // r2 := r2 + r2
+"I\x01\x24"             // r1 := state_c
+"J\x05"                 // -> dispatch
+
+// state_c (+0x24)
+"U\x02\x03"             // r2 := r2 - r3
+"I\x01\x14"             // r1 := state_a
+"J\x05"                 // -> dispatch
+
+// done (+0x2c)
+"M\x00\x02"             // r0 := r2
+"H"                     // halt
+;
+
+// r0 steps of xorshift32 from 1, the result scrambled by a multiplication (like xorshift*), with the
+// shift amounts and multiplier loaded by I right before their use. r0 is both the number of steps
+// (at least 1) and the result.
+constexpr uint8_t
+xorshift[] =
+"I\x01\x01"             // r1 := 1 (state)
+"I\x03\x01"             // r3 := 1
+
+// loop (+0x06)
+"M\x02\x01"             // r2 := r1
+"I\x04\x0d"             // r4 := 13
+"<\x02\x04"             // r2 := r2 << r4
+"^\x01\x02"             // r1 := r1 ^ r2
+"M\x02\x01"             // r2 := r1
+"I\x04\x11"             // r4 := 17
+">\x02\x04"             // r2 := r2 >> r4
+"^\x01\x02"             // r1 := r1 ^ r2
+"M\x02\x01"             // r2 := r1
+"I\x04\x05"             // r4 := 5
+"<\x02\x04"             // r2 := r2 << r4
+"^\x01\x02"             // r1 := r1 ^ r2
+"U\x00\x03"             // r0 := r0 - r3
+"BN\xd3\xff\xff\xff"    // if r0 != 0 -> loop
+
+// (+0x33)
+"I\x04\x9d"             // r4 := 157
+"*\x01\x04"             // r1 := r1 * r4
+"M\x00\x01"             // r0 := r1
+"H"                     // halt
+;
+
+// r0 steps of xorshift32 in each of 16 VM threads, seeded by their index 1..16 (see VM_THREADS in
+// vm.h). Each thread stores its result at data[0x40 + index] and counts itself in data[0x7f] with a
+// compare and swap loop; r0 := the sum of the low bytes of the results + (the count << 16).
+// Runs in SPEC 9 only, every other engine stops at the first T.
+constexpr uint8_t
+pxorshift[] =
+"I\x08\x5a"             // r8 := child
+"I\x07\x10"             // r7 := 16 (index)
+"I\x06\x01"             // r6 := 1
+"I\x0a\x20"             // r10 := 0x20
+
+// spawn (+0x0c)
+"T\x0b\x08"             // r11 := spawn at r8, with the registers copied
+"M\x0c\x0a"             // r12 := r10
+"A\x0c\x07"             // r12 := r12 + r7
+"S\x0c\x0b"             // data[0x20 + index] := r11
+"U\x07\x06"             // r7 := r7 - r6
+"BN\xeb\xff\xff\xff"    // if r7 != 0 -> spawn
+
+// (+0x21)
+"I\x07\x10"             // r7 := 16
+"I\x0d\x00"             // r13 := 0 (sum)
+
+// join (+0x27)
+"M\x0c\x0a"             // r12 := r10
+"A\x0c\x07"             // r12 := r12 + r7
+"L\x0c\x0b"             // r11 := data[0x20 + index]
+"Y\x0b"                 // wait for thread r11
+"I\x0c\x40"             // r12 := 0x40
+"A\x0c\x07"             // r12 := r12 + r7
+"L\x0c\x0e"             // r14 := data[0x40 + index]
+"A\x0d\x0e"             // r13 := r13 + r14
+"U\x07\x06"             // r7 := r7 - r6
+"BN\xe0\xff\xff\xff"    // if r7 != 0 -> join
+
+// (+0x47)
+"I\x0c\x7f"             // r12 := 0x7f
+"L\x0c\x0e"             // r14 := data[0x7f] (count)
+"I\x0f\x10"             // r15 := 16
+"<\x0e\x0f"             // r14 := r14 << r15
+"A\x0d\x0e"             // r13 := r13 + r14
+"M\x00\x0d"             // r0 := r13
+"H"                     // halt
+
+// child (+0x5a)
+"M\x01\x07"             // r1 := r7 (state)
+"I\x03\x01"             // r3 := 1
+
+// loop (+0x60)
+"M\x02\x01"             // r2 := r1
+"I\x04\x0d"             // r4 := 13
+"<\x02\x04"             // r2 := r2 << r4
+"^\x01\x02"             // r1 := r1 ^ r2
+"M\x02\x01"             // r2 := r1
+"I\x04\x11"             // r4 := 17
+">\x02\x04"             // r2 := r2 >> r4
+"^\x01\x02"             // r1 := r1 ^ r2
+"M\x02\x01"             // r2 := r1
+"I\x04\x05"             // r4 := 5
+"<\x02\x04"             // r2 := r2 << r4
+"^\x01\x02"             // r1 := r1 ^ r2
+"U\x00\x03"             // r0 := r0 - r3
+"BN\xd3\xff\xff\xff"    // if r0 != 0 -> loop
+
+// (+0x8d)
+"I\x0c\x40"             // r12 := 0x40
+"A\x0c\x07"             // r12 := r12 + r7
+"S\x0c\x01"             // data[0x40 + index] := r1
+"I\x0c\x7f"             // r12 := 0x7f
+"K\x0c\x00"             // r0 := data[0x7f], atomically
+
+// count (+0x9c)
+"M\x05\x00"             // r5 := r0
+"A\x05\x03"             // r5 := r5 + r3
+"C\x0c\x05"             // if data[0x7f] == r0, data[0x7f] := r5, else r0 := data[0x7f]
+"BN\xf1\xff\xff\xff"    // if it was not swapped -> count
+"H"                     // halt
+;
+
+#endif
@@ -0,0 +1,134 @@
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+
+#include "vm.h"
+#include "checkpoint.h"
+
+// operands of the handlers in VM_INSNS and VM_BRANCHES
+#define OP1 (*op1)
+#define OP2 (*op2)
+#define OFF off
+
+// back edges between safe points that look at the fuel and the clock
+#define CKPT_CHECK_EVERY 65536
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+struct checkpointer {
+    const struct ckpt_policy *policy;
+    const uint8_t *code;
+    uint32_t len;
+    const uint8_t *data;
+    uint32_t size;
+    uint64_t fuel; // left, if the policy has a limit
+    uint32_t span; // back edges since the last safe point, when the countdown reaches 0
+    double last; // the last checkpoint
+    struct ckpt_stats stats;
+};
+
+static void save(struct checkpointer *c, const struct state *st) {
+    double t = now();
+    if (ckpt_save(c->policy->path, c->code, c->len, st, c->data, c->size)) {
+        c->stats.saves++;
+    } else {
+        c->stats.failed_saves++;
+    }
+    c->last = now();
+    c->stats.save_seconds += c->last - t;
+}
+
+// the countdown of back edges to the next safe point
+static uint32_t next_span(struct checkpointer *c) {
+    c->span = c->policy->fuel && c->fuel < CKPT_CHECK_EVERY ? c->fuel : CKPT_CHECK_EVERY;
+    return c->span;
+}
+
+// at a back edge, after span of them: VM_CONTINUE, or VM_OUT_OF_FUEL after the last checkpoint
+static int safe_point(struct checkpointer *c, const struct state *st) {
+    c->stats.back_edges += c->span;
+    if (c->policy->fuel && !(c->fuel -= c->span)) {
+        save(c, st);
+        return VM_OUT_OF_FUEL;
+    }
+    if (c->policy->interval > 0 && now() - c->last >= c->policy->interval) {
+        save(c, st);
+    }
+    return VM_CONTINUE;
+}
+
+// --------------------------------------------------
+// VM INTERPRETER
+// the regular interpreter, with a countdown on back edges
+// --------------------------------------------------
+
+int ckpt_run(const uint8_t *code, uint32_t len, struct state *st, const uint8_t *data, uint32_t size,
+             const struct ckpt_policy *policy, struct ckpt_stats *stats) {
+    struct checkpointer c = {policy, code, len, data, size, policy->fuel, 0, now(), {}};
+    uint32_t countdown = next_span(&c);
+    int res;
+    while (1) {
+        uint32_t pc = st->pc;
+        if (pc >= len) {
+            res = VM_BAD_PC;
+            break;
+        }
+        const uint8_t *op1 = &code[pc + 1];
+        const uint8_t *op2 = &code[pc + 2];
+        switch (code[pc]) {
+#define INSN(op, len, handler) \
+            case op:           \
+                handler;       \
+                st->pc += len; \
+                continue;
+            VM_INSNS(INSN)
+#undef INSN
+#define JUMP(op, len, handler) \
+            case op:           \
+                handler;       \
+                break;
+            VM_JUMPS(JUMP)
+#undef JUMP
+            case 'B': {
+                int32_t off = read32(&code[pc + 2]);
+                switch (code[pc + 1]) {
+#define BRANCH(cc, handler) \
+                    case cc:        \
+                        handler;    \
+                        break;
+                    VM_BRANCHES(BRANCH)
+#undef BRANCH
+                    default:
+                        res = VM_ILLEGAL;
+                        goto out;
+                }
+                st->pc += 6;
+                break;
+            }
+            case 'H':
+                res = VM_HALT;
+                goto out;
+            default:
+                res = VM_ILLEGAL;
+                goto out;
+        }
+        // a branch or jump, the safe point if it went back
+        if (st->pc <= pc && !--countdown) {
+            if ((res = safe_point(&c, st)) != VM_CONTINUE) {
+                countdown = c.span; // (counted)
+                break;
+            }
+            countdown = next_span(&c);
+        }
+    }
+    out:
+    if (stats) {
+        c.stats.back_edges += c.span - countdown;
+        *stats = c.stats;
+    }
+    return res;
+}
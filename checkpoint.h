@@ -0,0 +1,137 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "vm.h"
+
+// --------------------------------------------------
+// CHECKPOINTS
+// --------------------------------------------------
+//
+// The state of a VM and its data segment on disk, to resume a long run in another process. A
+// checkpoint is taken at a safe point, where the pc is the target of a back edge: the start of a
+// basic block in every engine, so that any engine that runs from st->pc can resume it. The format
+// is a struct ckpt_file (the registers, flags, pc, the program it belongs to by length and hash,
+// and where st->data points into the segment), then the segment, then an FNV-1a hash of both. It
+// is written under a temporary name, synced and renamed into place, so a checkpoint on disk is
+// always whole. Its fields are in host order, for the same build on hosts of one byte order.
+//
+// The saving and loading are inline here, so that every engine can resume (VM_RESUME in vm.cpp).
+// ckpt_run in checkpoint.cpp is the interpreter that takes checkpoints.
+
+#define CKPT_MAGIC "VMCKPT01"
+
+// the fuel ran out, the state is at a safe point
+#define VM_OUT_OF_FUEL 5
+
+struct ckpt_file {
+    char magic[8];
+    uint32_t code_len;
+    uint32_t data_size;
+    uint64_t code_hash;
+    uint32_t pc;
+    uint32_t flags;
+    uint32_t data_offset; // of st->data in the segment
+    uint32_t regfile[NUM_REGS];
+    uint8_t vregfile[NUM_VREGS][VREG_SIZE];
+};
+
+// Writes the state of code (len bytes) and its data segment (size bytes from data) to path,
+// returns false if it could not.
+inline bool ckpt_save(const char *path, const uint8_t *code, uint32_t len, const struct state *st,
+                      const uint8_t *data, uint32_t size) {
+    struct ckpt_file f;
+    memset(&f, 0, sizeof(f)); // (the padding is hashed too)
+    memcpy(f.magic, CKPT_MAGIC, 8);
+    f.code_len = len;
+    f.data_size = size;
+    f.code_hash = hash64(code, len);
+    f.pc = st->pc;
+    f.flags = st->flags;
+    f.data_offset = st->data - data;
+    memcpy(f.regfile, st->regfile, sizeof(f.regfile));
+    memcpy(f.vregfile, st->vregfile, sizeof(f.vregfile));
+    uint64_t sum = hash64(data, size, hash64((const uint8_t *) &f, sizeof(f)));
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = write(fd, &f, sizeof(f)) == sizeof(f) && write(fd, data, size) == (ssize_t) size &&
+              write(fd, &sum, sizeof(sum)) == sizeof(sum) && !fsync(fd);
+    ok = !close(fd) && ok && !rename(tmp, path);
+    if (!ok) {
+        unlink(tmp);
+    }
+    return ok;
+}
+
+// Reads the checkpoint at path into st and the data segment (size bytes from data), with st->code
+// set to code. Returns nullptr, or why it could not: the file is missing or damaged, or of another
+// program or segment size. Only st and data are changed, and only on success.
+inline const char *ckpt_load(const char *path, const uint8_t *code, uint32_t len, struct state *st, uint8_t *data,
+                             uint32_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return "no checkpoint";
+    }
+    struct ckpt_file f;
+    uint8_t *seg = new uint8_t[size];
+    uint64_t sum = 0;
+    bool whole = read(fd, &f, sizeof(f)) == sizeof(f) && !memcmp(f.magic, CKPT_MAGIC, 8) && f.data_size == size &&
+                 read(fd, seg, size) == (ssize_t) size && read(fd, &sum, sizeof(sum)) == sizeof(sum) &&
+                 sum == hash64(seg, size, hash64((const uint8_t *) &f, sizeof(f)));
+    close(fd);
+    const char *err = nullptr;
+    if (!whole) {
+        err = "damaged checkpoint, or of another segment size";
+    } else if (f.code_len != len || f.code_hash != hash64(code, len)) {
+        err = "checkpoint of another program";
+    } else if (f.pc >= len || f.data_offset >= size) {
+        err = "damaged checkpoint";
+    } else {
+        memcpy(data, seg, size);
+        memcpy(st->regfile, f.regfile, sizeof(f.regfile));
+        memcpy(st->vregfile, f.vregfile, sizeof(f.vregfile));
+        st->flags = f.flags;
+        st->pc = f.pc;
+        st->data = data + f.data_offset;
+        st->code = code;
+    }
+    delete[] seg;
+    return err;
+}
+
+// --------------------------------------------------
+// CHECKPOINTING INTERPRETER
+// --------------------------------------------------
+
+// where and how often to checkpoint, and for how long to run
+struct ckpt_policy {
+    const char *path;
+    double interval; // seconds between checkpoints, 0 for none but the last
+    uint64_t fuel; // back edges to run before checkpointing and stopping, 0 for no limit
+};
+
+struct ckpt_stats {
+    uint64_t back_edges;
+    uint32_t saves;
+    uint32_t failed_saves;
+    double save_seconds; // in ckpt_save, both kinds
+};
+
+// Run code (len bytes) from st->pc until it halts, checkpointing at back edges per policy; data
+// and size are the whole data segment st->data points into. Returns VM_HALT, VM_ILLEGAL,
+// VM_BAD_PC or VM_OUT_OF_FUEL, after which the last checkpoint is of st. stats may be nullptr.
+int ckpt_run(const uint8_t *code, uint32_t len, struct state *st, const uint8_t *data, uint32_t size,
+             const struct ckpt_policy *policy, struct ckpt_stats *stats);
+
+#endif
@@ -0,0 +1,436 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "closure.h"
+
+// the blocks tail call each other, without a guaranteed tail call a long run may overflow the stack
+// at -O0
+#if defined(__clang__)
+#define MUSTTAIL [[clang::musttail]]
+#else
+#define MUSTTAIL
+#endif
+
+// --------------------------------------------------
+// INSTRUCTION TEMPLATES
+// --------------------------------------------------
+
+static void movr_rr(struct state *, const struct cl_insn *in) {
+    *in->dst = *in->src;
+}
+
+static void movi_r(struct state *, const struct cl_insn *in) {
+    *in->dst = in->imm;
+}
+
+// the same computations as add and sub in vm.h, on the bound registers
+template<bool FLAGS>
+static void add_rr(struct state *st, const struct cl_insn *in) {
+    uint64_t res = *in->dst + *in->src;
+    *in->dst = (uint32_t) res;
+    if constexpr (FLAGS) {
+        setflags(st, res);
+    }
+}
+
+template<bool FLAGS>
+static void sub_rr(struct state *st, const struct cl_insn *in) {
+    uint64_t res = *in->dst - *in->src;
+    *in->dst = (uint32_t) res;
+    if constexpr (FLAGS) {
+        setflags(st, res);
+    }
+}
+
+// I src, imm fused with the instruction after it, which reads src as its source
+template<bool FLAGS>
+static void add_ri(struct state *st, const struct cl_insn *in) {
+    *in->src = in->imm;
+    uint64_t res = *in->dst + in->imm;
+    *in->dst = (uint32_t) res;
+    if constexpr (FLAGS) {
+        setflags(st, res);
+    }
+}
+
+template<bool FLAGS>
+static void sub_ri(struct state *st, const struct cl_insn *in) {
+    *in->src = in->imm;
+    uint64_t res = *in->dst - in->imm;
+    *in->dst = (uint32_t) res;
+    if constexpr (FLAGS) {
+        setflags(st, res);
+    }
+}
+
+#define OP1 (in->op1)
+#define OP2 (in->imm)
+
+template<uint8_t OPCODE>
+static void const_ri(struct state *st, const struct cl_insn *in) {
+    *in->src = in->imm;
+#define CONST_INSN(op, handler)    \
+    if constexpr (OPCODE == op) {  \
+        handler;                   \
+    }
+    VM_CONST_INSNS(CONST_INSN)
+#undef CONST_INSN
+}
+
+static cl_insn_fn const_ri_for(uint8_t opcode) {
+    switch (opcode) {
+#define CONST_RI_FOR(op, handler) \
+        case op:                  \
+            return const_ri<op>;
+        VM_CONST_INSNS(CONST_RI_FOR)
+#undef CONST_RI_FOR
+        default:
+            return nullptr;
+    }
+}
+
+#undef OP1
+#undef OP2
+#define OP1 (in->op1)
+#define OP2 (in->op2)
+
+// any instruction, through its handler
+template<uint8_t OPCODE>
+static void generic(struct state *st, const struct cl_insn *in) {
+#define GENERIC(op, len, handler)  \
+    if constexpr (OPCODE == op) {  \
+        handler;                   \
+    }
+    VM_INSNS(GENERIC)
+#undef GENERIC
+}
+
+static cl_insn_fn generic_for(uint8_t opcode) {
+    switch (opcode) {
+#define GENERIC_FOR(op, len, handler) \
+        case op:                      \
+            return generic<op>;
+        VM_INSNS(GENERIC_FOR)
+#undef GENERIC_FOR
+        default:
+            return nullptr;
+    }
+}
+
+#undef OP1
+#undef OP2
+
+// --------------------------------------------------
+// BLOCK TEMPLATES
+// --------------------------------------------------
+
+static struct cl_block *block_at(struct cl_program *prog, uint32_t pc);
+
+static inline void run_insns(struct state *st, const struct cl_block *b) {
+    for (const struct cl_insn *in = b->insns, *end = in + b->ninsns; in != end; in++) {
+        in->fn(st, in);
+    }
+}
+
+// (the blocks don't keep st->pc up to date, it is set when the program stops)
+static int run_fallthrough(struct state *st, const struct cl_block *b) {
+    run_insns(st, b);
+    if (!b->next) {
+        st->pc = b->next_pc;
+        return VM_BAD_PC;
+    }
+    MUSTTAIL return b->next->run(st, b->next);
+}
+
+template<uint8_t CC>
+static int run_branch(struct state *st, const struct cl_block *b) {
+    run_insns(st, b);
+    // the branch handler run from pc 0 with an offset of 1
+    st->pc = 0;
+#define OFF 1
+#define BRANCH(cc, handler)        \
+    if constexpr (CC == cc) {      \
+        handler;                   \
+    }
+    VM_BRANCHES(BRANCH)
+#undef BRANCH
+#undef OFF
+    const struct cl_block *succ = st->pc ? b->target : b->next;
+    if (!succ) {
+        st->pc = st->pc ? b->target_pc : b->next_pc;
+        return VM_BAD_PC;
+    }
+    MUSTTAIL return succ->run(st, succ);
+}
+
+static cl_block_fn run_branch_for(uint8_t cc) {
+    switch (cc) {
+#define RUN_BRANCH_FOR(cc, handler) \
+        case cc:                    \
+            return run_branch<cc>;
+        VM_BRANCHES(RUN_BRANCH_FOR)
+#undef RUN_BRANCH_FOR
+        default:
+            return nullptr;
+    }
+}
+
+#define OP1 (b->rtarget)
+
+static int run_jump(struct state *st, const struct cl_block *b) {
+    run_insns(st, b);
+#define JUMP(op, len, handler) handler;
+    VM_JUMPS(JUMP)
+#undef JUMP
+    const struct cl_block *succ = block_at(b->prog, st->pc);
+    if (!succ) {
+        return VM_BAD_PC;
+    }
+    MUSTTAIL return succ->run(st, succ);
+}
+
+#undef OP1
+
+static int run_halt(struct state *st, const struct cl_block *b) {
+    run_insns(st, b);
+    st->pc = b->end;
+    return VM_HALT;
+}
+
+static int run_illegal(struct state *st, const struct cl_block *b) {
+    run_insns(st, b);
+    st->pc = b->end;
+    return VM_ILLEGAL;
+}
+
+// --------------------------------------------------
+// COMPILATION
+// --------------------------------------------------
+
+// the instruction at pc, 0 if it is illegal or does not fit
+static uint8_t decode(const struct cl_program *prog, uint32_t pc) {
+    uint8_t opcode = prog->code[pc];
+    uint32_t n = insn_length(opcode);
+    if (n == 0 || pc + n > prog->len || (opcode == 'B' && !run_branch_for(prog->code[pc + 1]))) {
+        return 0;
+    }
+    return opcode;
+}
+
+// mark the leaders reachable from pc
+static void find_leaders(struct cl_program *prog, uint32_t pc, bool *seen, uint32_t *work) {
+    uint32_t nwork = 0;
+    prog->leader[pc] = true;
+    work[nwork++] = pc;
+    while (nwork) {
+        pc = work[--nwork];
+        while (pc < prog->len && !seen[pc]) {
+            seen[pc] = true;
+            uint8_t opcode = decode(prog, pc);
+            if (!opcode || opcode == 'H' || opcode == 'J') {
+                break;
+            }
+            uint32_t next = pc + insn_length(opcode);
+            if (opcode == 'B') {
+                uint32_t target = next + read32(&prog->code[pc + 2]);
+                uint32_t succs[] = {next, target};
+                for (uint32_t succ: succs) {
+                    if (succ < prog->len) {
+                        prog->leader[succ] = true;
+                        work[nwork++] = succ;
+                    }
+                }
+                break;
+            }
+            pc = next;
+        }
+    }
+}
+
+static struct cl_insn *compile_insns(struct cl_program *prog, const uint32_t *pcs, uint32_t n, uint32_t *ninsns) {
+    uint32_t *regs = prog->st->regfile;
+    const uint8_t *code = prog->code;
+    struct cl_insn *insns = (struct cl_insn *) calloc(n ? n : 1, sizeof(struct cl_insn));
+    // flags_live[i]: no later instruction of the block sets the flags before they are read
+    bool *flags_live = (bool *) malloc((n + 1) * sizeof(bool));
+    flags_live[n] = true;
+    for (uint32_t i = n; i > 0; i--) {
+        flags_live[i - 1] = flags_live[i] && !sets_flags(code[pcs[i - 1]]);
+    }
+    *ninsns = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        const uint8_t *at = &code[pcs[i]];
+        struct cl_insn *in = &insns[(*ninsns)++];
+        in->op1 = at[1];
+        in->op2 = at[2];
+        in->dst = &regs[at[1]];
+        in->src = &regs[at[2]];
+        const uint8_t *next = i + 1 < n ? &code[pcs[i + 1]] : nullptr;
+        if (at[0] == 'I' && next && next[2] == at[1] &&
+            (next[0] == 'A' || next[0] == 'U' || const_ri_for(next[0]))) {
+            bool live = flags_live[i + 2];
+            in->dst = &regs[next[1]];
+            in->src = &regs[at[1]];
+            in->imm = at[2];
+            in->op1 = next[1];
+            if (next[0] == 'A') {
+                in->fn = live ? add_ri<true> : add_ri<false>;
+            } else if (next[0] == 'U') {
+                in->fn = live ? sub_ri<true> : sub_ri<false>;
+            } else {
+                in->fn = const_ri_for(next[0]);
+            }
+            i++;
+            continue;
+        }
+        bool live = flags_live[i + 1];
+        switch (at[0]) {
+            case 'M':
+                in->fn = movr_rr;
+                break;
+            case 'I':
+                in->imm = at[2];
+                in->fn = movi_r;
+                break;
+            case 'A':
+                in->fn = live ? add_rr<true> : add_rr<false>;
+                break;
+            case 'U':
+                in->fn = live ? sub_rr<true> : sub_rr<false>;
+                break;
+            default:
+                in->fn = generic_for(at[0]);
+        }
+    }
+    free(flags_live);
+    return insns;
+}
+
+// the block starting at pc, up to its control transfer or the next leader
+static struct cl_block *compile_block(struct cl_program *prog, uint32_t start) {
+    struct cl_block *b = (struct cl_block *) calloc(1, sizeof(struct cl_block));
+    b->prog = prog;
+    b->start = start;
+    uint32_t cap = 8, n = 0;
+    uint32_t *pcs = (uint32_t *) malloc(cap * sizeof(uint32_t));
+    uint32_t pc = start;
+    while (1) {
+        if (pc >= prog->len || (pc != start && prog->leader[pc])) {
+            b->run = run_fallthrough;
+            b->next_pc = pc;
+            break;
+        }
+        uint8_t opcode = decode(prog, pc);
+        if (!opcode) {
+            b->run = run_illegal;
+            break;
+        }
+        if (opcode == 'H') {
+            b->run = run_halt;
+            break;
+        }
+        if (opcode == 'B') {
+            b->cc = prog->code[pc + 1];
+            b->run = run_branch_for(b->cc);
+            b->next_pc = pc + 6;
+            b->target_pc = pc + 6 + read32(&prog->code[pc + 2]);
+            break;
+        }
+        if (opcode == 'J') {
+            b->rtarget = prog->code[pc + 1];
+            b->run = run_jump;
+            break;
+        }
+        if (n == cap) {
+            cap *= 2;
+            pcs = (uint32_t *) realloc(pcs, cap * sizeof(uint32_t));
+        }
+        pcs[n++] = pc;
+        pc += insn_length(opcode);
+    }
+    b->end = pc;
+    b->insns = compile_insns(prog, pcs, n, &b->ninsns);
+    prog->ninsns += b->ninsns;
+    prog->nblocks++;
+    free(pcs);
+    return b;
+}
+
+// the block at pc, compiling it and the blocks it reaches on the first use
+static struct cl_block *block_at(struct cl_program *prog, uint32_t pc) {
+    if (pc >= prog->len) {
+        return nullptr;
+    }
+    if (prog->blocks[pc]) {
+        return prog->blocks[pc];
+    }
+    uint32_t len = prog->len;
+    bool *seen = (bool *) calloc(len, sizeof(bool));
+    uint32_t *work = (uint32_t *) malloc((2 * len + 1) * sizeof(uint32_t));
+    find_leaders(prog, pc, seen, work);
+    // the blocks compiled here, linked once they all exist
+    struct cl_block **fresh = (struct cl_block **) malloc(len * sizeof(struct cl_block *));
+    uint32_t nwork = 0, nfresh = 0;
+    work[nwork++] = pc;
+    while (nwork) {
+        uint32_t at = work[--nwork];
+        if (at >= len || prog->blocks[at]) {
+            continue;
+        }
+        struct cl_block *b = compile_block(prog, at);
+        prog->blocks[at] = b;
+        fresh[nfresh++] = b;
+        if (b->run == run_fallthrough || b->cc) {
+            work[nwork++] = b->next_pc;
+        }
+        if (b->cc) {
+            work[nwork++] = b->target_pc;
+        }
+    }
+    for (uint32_t i = 0; i < nfresh; i++) {
+        struct cl_block *b = fresh[i];
+        b->next = b->next_pc < len ? prog->blocks[b->next_pc] : nullptr;
+        b->target = b->target_pc < len ? prog->blocks[b->target_pc] : nullptr;
+    }
+    free(seen);
+    free(work);
+    free(fresh);
+    return prog->blocks[pc];
+}
+
+struct cl_program *cl_compile(const uint8_t *code, uint32_t len, struct state *st) {
+    struct cl_program *prog = (struct cl_program *) calloc(1, sizeof(struct cl_program));
+    prog->code = code;
+    prog->len = len;
+    prog->st = st;
+    prog->leader = (bool *) calloc(len ? len : 1, sizeof(bool));
+    prog->blocks = (struct cl_block **) calloc(len ? len : 1, sizeof(struct cl_block *));
+    block_at(prog, 0);
+    return prog;
+}
+
+// --------------------------------------------------
+// VM INTERPRETER
+// runs the compiled blocks
+// --------------------------------------------------
+
+int cl_run(struct cl_program *prog) {
+    struct state *st = prog->st;
+    const struct cl_block *b = block_at(prog, st->pc);
+    if (!b) {
+        return VM_BAD_PC;
+    }
+    return b->run(st, b);
+}
+
+void cl_free(struct cl_program *prog) {
+    for (uint32_t pc = 0; pc < prog->len; pc++) {
+        if (prog->blocks[pc]) {
+            free(prog->blocks[pc]->insns);
+            free(prog->blocks[pc]);
+        }
+    }
+    free(prog->blocks);
+    free(prog->leader);
+    free(prog);
+}
@@ -0,0 +1,69 @@
+#ifndef CLOSURE_H
+#define CLOSURE_H
+
+#include <cstdint>
+
+#include "vm.h"
+
+// --------------------------------------------------
+// CLOSURE COMPILATION
+// --------------------------------------------------
+//
+// Bytecode compiled at load time into closures over statically compiled code, so no memory is
+// ever executable that was not compiled with this program (unlike context.cpp or jitcache.cpp).
+// Each basic block is a closure: a function specialized on how the block ends, bound to the
+// block's instructions and successors. The function runs the instructions, then tail calls the
+// function of the next block. Each instruction is bound too, to the references of its registers
+// in the state the program is compiled for and to its immediates. Its function is a template
+// specialized on the operand pattern: a register, a constant (an I right before the instruction
+// setting its source register), and flags that are dead because a later instruction of the block
+// sets them. Instructions without a specialization run their handler from vm.h.
+
+struct cl_insn;
+struct cl_block;
+struct cl_program;
+
+typedef void (*cl_insn_fn)(struct state *st, const struct cl_insn *in);
+typedef int (*cl_block_fn)(struct state *st, const struct cl_block *b);
+
+struct cl_insn {
+    cl_insn_fn fn;
+    uint32_t *dst; // bound register references
+    uint32_t *src;
+    uint32_t imm;
+    uint8_t op1, op2; // for the handlers of vm.h
+};
+
+struct cl_block {
+    cl_block_fn run;
+    struct cl_program *prog;
+    uint32_t start;
+    uint32_t end; // pc of the instruction ending the block, or after its last instruction
+    uint32_t ninsns; // not counting the branch, jump or halt ending it
+    struct cl_insn *insns;
+    uint8_t cc; // of the branch ending the block
+    uint8_t rtarget; // of the jump ending the block
+    // the fallthrough and the branch target, nullptr if their pc is out of the code
+    uint32_t next_pc, target_pc;
+    struct cl_block *next, *target;
+};
+
+struct cl_program {
+    const uint8_t *code; // not copied, must outlive the program
+    uint32_t len;
+    struct state *st; // the state the registers are bound to
+    bool *leader; // the pcs blocks end before: the entry, branch targets and the pcs after branches
+    struct cl_block **blocks; // by start pc, compiled on first reach for the targets of jumps
+    uint32_t nblocks;
+    uint32_t ninsns; // compiled, fused instructions count once
+};
+
+// compile for st, which the program then runs on
+struct cl_program *cl_compile(const uint8_t *code, uint32_t len, struct state *st);
+
+// Run the bound state from its pc, returns VM_HALT, VM_ILLEGAL or VM_BAD_PC.
+int cl_run(struct cl_program *prog);
+
+void cl_free(struct cl_program *prog);
+
+#endif
@@ -0,0 +1,1049 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "cogen.h"
+#include "pe.h"
+
+// --------------------------------------------------
+// COGEN
+// the generating extension of the interpreter (second Futamura projection)
+// --------------------------------------------------
+//
+// SPEC=2 and SPEC=3 obtain the residual program by instantiating `interp_body` for every PC and
+// letting the compiler fold it, which has to be repeated for every program. cogen is the compiler
+// that specialization would produce: it turns bytecode directly into the residual C++ in one pass
+// over the reachable instructions. The code of each instruction is the handler from VM_INSNS and
+// VM_BRANCHES in vm.h with the operands substituted, so the interpreter remains the only
+// definition of the instruction semantics.
+//
+// Without a profile the instructions are emitted in pc order, which is the layout clang starts from.
+// With one, they are emitted as traces: each starts at the hottest instruction not yet emitted and
+// follows the likelier successor, so the common path of a loop is contiguous and falls through,
+// and instructions that never ran are emitted last. Branches are wrapped in
+// __builtin_expect_with_probability with the profiled probability.
+//
+// Counted loops are unrolled: a straight-line body ending in a BN back edge, whose flags come from
+// a counter that the body decrements by a constant. The unrolled loop runs while the counter is
+// large enough that none of the copies but the last can exit, so the copies have no branch, no pc
+// update and (with the FLAGS=false handlers) no flag update. The remainder runs the original
+// loop, one iteration at a time.
+//
+// Counted loops over the data segment are also vectorized, see VECTORIZATION below.
+//
+// An I followed by an instruction of VM_CONST_INSNS on the same register is emitted as one step,
+// with the constant substituted into the second handler, so that a shift or multiplication by a
+// constant is a single host instruction.
+//
+// An indirect jump can go to any instruction, so the entry dispatch over every reachable pc is also
+// the jump table it falls back to (a perfect hash when the pcs are sparse, see SPARSE DISPATCH).
+// With a profile, the most frequent targets of each jump are compared against first and jumped to
+// directly, which the compiler can lay out and predict like the successors of a branch.
+//
+// The driver is cogen_main.cpp; jitcache.cpp calls cogen at run time.
+
+// A hash of the source of the generator (cogen.cpp, cogen.h), passed in by the build, so that any
+// change to it changes cogen_version. A build that does not pass it falls back to the time of the
+// compilation, which changes with every build.
+#ifndef COGEN_SOURCE_HASH
+#define COGEN_SOURCE_HASH __DATE__ " " __TIME__
+#endif
+
+struct insn_template {
+    uint8_t opcode;
+    uint32_t length;
+    const char *handler;
+};
+
+static const insn_template insns[] = {
+#define INSN_TEMPLATE(op, len, handler) {op, len, #handler},
+        VM_INSNS(INSN_TEMPLATE)
+};
+
+static const insn_template branches[] = {
+#define BRANCH_TEMPLATE(cc, handler) {cc, 6, #handler},
+        VM_BRANCHES(BRANCH_TEMPLATE)
+#undef BRANCH_TEMPLATE
+};
+
+static const insn_template jumps[] = {
+        VM_JUMPS(INSN_TEMPLATE)
+};
+#undef INSN_TEMPLATE
+
+static const insn_template const_insns[] = {
+#define CONST_TEMPLATE(op, handler) {op, 3, #handler},
+        VM_CONST_INSNS(CONST_TEMPLATE)
+#undef CONST_TEMPLATE
+};
+
+// targets of an indirect jump compared against before the jump table, at most
+#define COGEN_JUMP_TARGETS 4
+
+// print a handler, replacing the operand placeholders with their values. Without flags, the
+// handler of an opcode that sets them is instantiated with FLAGS=false.
+static void emit_handler(FILE *out, const char *handler, uint32_t op1, uint32_t op2, int32_t off,
+                         bool flags = true) {
+    for (const char *p = handler; *p;) {
+        if (!flags && *p == '(') {
+            fprintf(out, "<false>");
+            flags = true;
+        }
+        if (!strncmp(p, "OP1", 3)) {
+            fprintf(out, "%u", op1);
+            p += 3;
+        } else if (!strncmp(p, "OP2", 3)) {
+            fprintf(out, "%u", op2);
+            p += 3;
+        } else if (!strncmp(p, "OFF", 3)) {
+            fprintf(out, "%d", off);
+            p += 3;
+        } else {
+            fputc(*p++, out);
+        }
+    }
+}
+
+static const insn_template *find(const insn_template *table, size_t n, uint8_t opcode) {
+    for (size_t i = 0; i < n; i++) {
+        if (table[i].opcode == opcode) {
+            return &table[i];
+        }
+    }
+    return nullptr;
+}
+
+// residual code for the transition to `next`, a counted loop is entered at its unrolled copy
+static void emit_goto(FILE *out, const bool *insn, const bool *loop, uint32_t len, uint32_t next) {
+    if (next < len && loop[next]) {
+        fprintf(out, "    goto loop_%u;\n", next);
+    } else if (next < len && insn[next]) {
+        fprintf(out, "    goto pc_%u;\n", next);
+    } else {
+        fprintf(out, "    st->pc = %u;\n    return VM_BAD_PC;\n", next);
+    }
+}
+
+// the PCs reachable from pc 0, following fallthrough and branch targets. An indirect jump may go
+// to any instruction decoded from pc 0 on, so once one is reachable all of them are, except for
+// illegal bytes (padding between code), which a jump to fails with VM_BAD_PC rather than VM_ILLEGAL.
+static void reachable(const uint8_t *code, uint32_t len, bool *insn) {
+    // every instruction is pushed by at most its fallthrough, one branch and the first jump
+    uint32_t *work = (uint32_t *) malloc((3 * len + 1) * sizeof(uint32_t));
+    uint32_t nwork = 0;
+    bool jumps = false;
+    work[nwork++] = 0;
+    while (nwork) {
+        uint32_t pc = work[--nwork];
+        if (pc >= len || insn[pc]) {
+            continue;
+        }
+        insn[pc] = true;
+        uint32_t n = insn_length(code[pc]);
+        if (n == 0 || code[pc] == 'H' || pc + n > len) {
+            continue;
+        }
+        if (code[pc] == 'J') {
+            for (uint32_t at = 0; !jumps && at < len; at += n ? n : 1) {
+                n = insn_length(code[at]);
+                if (n && at + n <= len) {
+                    work[nwork++] = at;
+                }
+            }
+            jumps = true;
+            continue;
+        }
+        work[nwork++] = pc + n;
+        if (code[pc] == 'B') {
+            work[nwork++] = pc + n + read32(&code[pc + 2]);
+        }
+    }
+    free(work);
+}
+
+// the profiled targets of the jump at pc, most frequent first, returns how many
+static uint32_t jump_targets(const struct branch_profile *profile, uint32_t pc, uint32_t *targets,
+                             uint64_t *counts) {
+    const struct value_profile *vp = profile ? profile->targets[pc] : nullptr;
+    uint32_t n = 0;
+    for (int i = 0; vp && i < VP_MAX_VALUES; i++) {
+        if (vp->counts[i]) {
+            targets[n] = vp->values[i];
+            counts[n++] = vp->counts[i];
+        }
+    }
+    for (uint32_t i = 1; i < n; i++) {
+        for (uint32_t j = i; j > 0 && counts[j] > counts[j - 1]; j--) {
+            std::swap(targets[j], targets[j - 1]);
+            std::swap(counts[j], counts[j - 1]);
+        }
+    }
+    return n;
+}
+
+// the likelier successor of the instruction at pc
+static uint32_t likely_next(const uint8_t *code, uint32_t pc, const struct branch_profile *profile) {
+    uint32_t next = pc + insn_length(code[pc]);
+    if (code[pc] == 'B' && 2 * profile->taken[pc] > profile->count[pc]) {
+        return next + read32(&code[pc + 2]);
+    }
+    uint32_t targets[VP_MAX_VALUES];
+    uint64_t counts[VP_MAX_VALUES];
+    if (code[pc] == 'J' && jump_targets(profile, pc, targets, counts)) {
+        return targets[0];
+    }
+    return next;
+}
+
+// the reachable pcs in the order they are emitted, returns how many
+static uint32_t layout(const uint8_t *code, uint32_t len, const bool *insn, const struct branch_profile *profile,
+                       uint32_t *order) {
+    uint32_t n = 0;
+    for (uint32_t pc = 0; pc < len; pc++) {
+        if (insn[pc]) {
+            order[n++] = pc;
+        }
+    }
+    if (!profile) {
+        return n;
+    }
+    // trace heads, hottest first, pc 0 before anything
+    uint32_t *heads = (uint32_t *) malloc((n ? n : 1) * sizeof(uint32_t));
+    memcpy(heads, order, n * sizeof(uint32_t));
+    std::stable_sort(heads + 1, heads + n, [&](uint32_t a, uint32_t b) {
+        return profile->count[a] > profile->count[b];
+    });
+    bool *placed = (bool *) calloc(len ? len : 1, sizeof(bool));
+    uint32_t m = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        for (uint32_t pc = heads[i]; pc < len && insn[pc] && !placed[pc];) {
+            placed[pc] = true;
+            order[m++] = pc;
+            uint8_t opcode = code[pc];
+            uint32_t size = insn_length(opcode);
+            if (size == 0 || opcode == 'H' || pc + size > len) {
+                break;
+            }
+            // the trace stops at cold code, which gets its own trace
+            uint32_t next = likely_next(code, pc, profile);
+            if (next < len && profile->count[pc] && !profile->count[next]) {
+                break;
+            }
+            pc = next;
+        }
+    }
+    free(placed);
+    free(heads);
+    return m;
+}
+
+// --------------------------------------------------
+// LOOP UNROLLING
+// --------------------------------------------------
+
+struct counted_loop {
+    uint32_t head; // the first instruction of the body, the branch target
+    uint32_t branch; // the BN back edge, the last instruction
+    uint8_t counter;
+    uint32_t step; // subtracted from the counter once per iteration
+};
+
+// whether the branch at pc closes a counted loop: a BN back edge over a body of straight-line
+// instructions without other entries, the last of them to set the flags computing a value equal to
+// the counter, which the body only changes with U counter, r where r holds a constant
+static bool find_counted_loop(const uint8_t *code, uint32_t len, const bool *insn, const bool *target, uint32_t pc,
+                              struct counted_loop *loop) {
+    if (code[pc] != 'B' || code[pc + 1] != 'N' || pc + 6 > len) {
+        return false;
+    }
+    uint32_t head = pc + 6 + read32(&code[pc + 2]);
+    if (head >= pc || !insn[head]) {
+        return false;
+    }
+    bool known[NUM_REGS] = {};
+    uint32_t val[NUM_REGS] = {};
+    uint32_t writes[NUM_REGS] = {};
+    int flags_reg = -1; // holds the result the flags were set from
+    int counter = -1;
+    uint32_t step = 0;
+    uint32_t at = head;
+    while (at < pc) {
+        uint8_t opcode = code[at];
+        uint32_t n = insn_length(opcode);
+        if (n != 3 || !find(insns, sizeof(insns) / sizeof(insns[0]), opcode) || at + n > pc) {
+            return false;
+        }
+        if (at != head && target[at]) {
+            return false;
+        }
+        uint8_t op1 = code[at + 1], op2 = code[at + 2];
+        if (op1 >= NUM_REGS || (opcode != 'I' && op2 >= NUM_REGS)) {
+            return false;
+        }
+        uint32_t use, def;
+        pe_usedef(code, at, 0, use, def);
+        int dst = -1;
+        for (int r = 0; r < NUM_REGS; r++) {
+            if (def & (1u << r)) {
+                dst = r;
+                writes[r]++;
+            }
+        }
+        if (dst >= 0 && flags_reg == dst) {
+            flags_reg = -1;
+        }
+        if (opcode == 'U' && known[op2] && val[op2] && op1 != op2) {
+            // a decrement by a constant
+            if (counter < 0) {
+                counter = op1;
+                step = val[op2];
+            }
+        }
+        if (sets_flags(opcode)) {
+            flags_reg = dst;
+            if (opcode == 'A' && known[op1] && val[op1] == 0) {
+                // 0 + r, the result is still held by r
+                flags_reg = op2;
+            }
+        }
+        if (dst >= 0) {
+            known[dst] = opcode == 'I';
+            val[dst] = op2;
+        }
+        at += n;
+    }
+    if (at != pc || counter < 0 || flags_reg != counter || writes[counter] != 1) {
+        return false;
+    }
+    *loop = {head, pc, (uint8_t) counter, step};
+    return true;
+}
+
+// --------------------------------------------------
+// VECTORIZATION
+// --------------------------------------------------
+//
+// A counted loop runs VEC_LANES iterations at once when every register in its body is one of
+//   uniform:   not written in the body, or only from uniform values, the same in every iteration
+//   induction: written once, by adding or subtracting a constant (the counter is one)
+//   reduction: written once, by adding or subtracting to itself, and read nowhere else
+//   varying:   written before it is read in each iteration, from a load or another varying or
+//              induction register (no other value is carried from one iteration to the next)
+// and every L and S addresses the data segment through an induction register that steps by 1.
+// Lane l of a varying register holds its value in the l-th iteration of the group, an induction
+// register is kept as its value in lane 0. Every group is guarded: the counter must not reach 0
+// before the last lane, the addresses of each access must not wrap around the int8_t offset, and
+// two accesses of which one is a store must use the same address in the same iteration or be at
+// least VEC_LANES bytes apart, so that running the body instruction by instruction across the
+// lanes does not reorder a load and a store of the same byte.
+
+#define VEC_LANES 16
+#define VEC_MAX_ACCESSES 16
+
+#define VEC_UNIFORM 0
+#define VEC_INDUCTION 1
+#define VEC_REDUCTION 2
+#define VEC_VARYING 3
+
+struct vec_access {
+    uint8_t reg; // an induction register
+    uint32_t offset; // added to the register in the body before the access
+    bool store;
+};
+
+struct vec_loop {
+    uint8_t kind[NUM_REGS]; // VEC_INDUCTION and VEC_REDUCTION registers, the others are uniform or varying
+    uint32_t step[NUM_REGS]; // of an induction register
+    uint32_t naccesses;
+    struct vec_access accesses[VEC_MAX_ACCESSES];
+};
+
+static bool find_vector_loop(const uint8_t *code, const struct counted_loop *loop, struct vec_loop *vl) {
+    *vl = {};
+    // the registers written once by adding a constant, or accumulating
+    uint32_t writes[NUM_REGS] = {};
+    uint32_t uses[NUM_REGS] = {};
+    bool known[NUM_REGS] = {};
+    uint32_t val[NUM_REGS] = {};
+    for (uint32_t pc = loop->head; pc < loop->branch; pc += 3) {
+        uint8_t opcode = code[pc], op1 = code[pc + 1], op2 = code[pc + 2];
+        uint32_t use, def;
+        pe_usedef(code, pc, 0, use, def);
+        for (int r = 0; r < NUM_REGS; r++) {
+            uses[r] += !!(use & (1u << r));
+            writes[r] += !!(def & (1u << r));
+        }
+        if ((opcode == 'A' || opcode == 'U') && op1 != op2 && known[op2]) {
+            vl->kind[op1] = VEC_INDUCTION;
+            vl->step[op1] = opcode == 'A' ? val[op2] : -val[op2];
+        } else if ((opcode == 'A' || opcode == 'U') && op1 != op2) {
+            vl->kind[op1] = VEC_REDUCTION;
+        }
+        for (int r = 0; r < NUM_REGS; r++) {
+            if (def & (1u << r)) {
+                known[r] = opcode == 'I';
+                val[r] = op2;
+            }
+        }
+    }
+    for (int r = 0; r < NUM_REGS; r++) {
+        if (writes[r] != 1 || (vl->kind[r] == VEC_REDUCTION && uses[r] != 1)) {
+            vl->kind[r] = VEC_UNIFORM;
+        }
+    }
+    if (vl->kind[loop->counter] != VEC_INDUCTION) {
+        return false;
+    }
+
+    // the class of each register through the body
+    uint8_t cls[NUM_REGS];
+    uint32_t offset[NUM_REGS] = {};
+    bool written[NUM_REGS] = {};
+    for (int r = 0; r < NUM_REGS; r++) {
+        cls[r] = vl->kind[r];
+    }
+    for (uint32_t pc = loop->head; pc < loop->branch; pc += 3) {
+        uint8_t opcode = code[pc], op1 = code[pc + 1], op2 = code[pc + 2];
+        uint32_t use, def;
+        pe_usedef(code, pc, 0, use, def);
+        for (int r = 0; r < NUM_REGS; r++) {
+            // a value carried from the last iteration
+            if ((use & (1u << r)) && !written[r] && writes[r] && vl->kind[r] == VEC_UNIFORM) {
+                return false;
+            }
+        }
+        switch (opcode) {
+            case 'I':
+                cls[op1] = VEC_UNIFORM;
+                break;
+            case 'M':
+                if (cls[op2] == VEC_REDUCTION || vl->kind[op1] != VEC_UNIFORM) {
+                    return false;
+                }
+                cls[op1] = cls[op2] == VEC_UNIFORM ? VEC_UNIFORM : VEC_VARYING;
+                break;
+            case 'A':
+            case 'U':
+                if (vl->kind[op1] == VEC_INDUCTION) {
+                    offset[op1] = vl->step[op1];
+                } else if (vl->kind[op1] == VEC_REDUCTION) {
+                    // accumulated per lane
+                } else if (cls[op1] == VEC_REDUCTION || cls[op2] == VEC_REDUCTION) {
+                    return false;
+                } else {
+                    cls[op1] = cls[op1] == VEC_UNIFORM && cls[op2] == VEC_UNIFORM ? VEC_UNIFORM : VEC_VARYING;
+                }
+                break;
+            case '&':
+            case '|':
+            case '^':
+            case '<':
+            case '>':
+            case '*':
+                // (induction and reduction registers are only written by A and U)
+                if (cls[op1] == VEC_REDUCTION || cls[op2] == VEC_REDUCTION) {
+                    return false;
+                }
+                cls[op1] = cls[op1] == VEC_UNIFORM && cls[op2] == VEC_UNIFORM ? VEC_UNIFORM : VEC_VARYING;
+                break;
+            case 'L':
+            case 'S': {
+                uint8_t ptr = op1;
+                if (vl->kind[ptr] != VEC_INDUCTION || vl->step[ptr] != 1 || vl->naccesses == VEC_MAX_ACCESSES) {
+                    return false;
+                }
+                if (opcode == 'S' && cls[op2] == VEC_REDUCTION) {
+                    return false;
+                }
+                vl->accesses[vl->naccesses++] = {ptr, offset[ptr], opcode == 'S'};
+                if (opcode == 'L') {
+                    if (vl->kind[op2] != VEC_UNIFORM) {
+                        return false;
+                    }
+                    cls[op2] = VEC_VARYING;
+                }
+                break;
+            }
+            default:
+                // the vector instructions, already data parallel
+                return false;
+        }
+        for (int r = 0; r < NUM_REGS; r++) {
+            written[r] |= !!(def & (1u << r));
+        }
+    }
+    return vl->naccesses > 0;
+}
+
+// the operator of an arithmetic opcode, on lanes
+static const char *vec_operator(uint8_t opcode) {
+    switch (opcode) {
+        case 'A':
+            return "+";
+        case 'U':
+            return "-";
+        case '&':
+            return "&";
+        case '|':
+            return "|";
+        case '^':
+            return "^";
+        case '<':
+            return "<<";
+        case '>':
+            return ">>";
+        default:
+            return "*";
+    }
+}
+
+// the lanes of register r, of class cls
+static void emit_lanes(FILE *out, const struct vec_loop *vl, uint8_t cls, uint8_t r) {
+    if (cls == VEC_VARYING) {
+        fprintf(out, "v%u", r);
+    } else if (cls == VEC_INDUCTION) {
+        fprintf(out, "(st->regfile[%u] + vm_lane * %uu)", r, vl->step[r]);
+    } else {
+        fprintf(out, "(vm_lanes{} + st->regfile[%u])", r);
+    }
+}
+
+static void emit_vector_loop(FILE *out, const uint8_t *code, const bool *insn, const bool *loop_head, uint32_t len,
+                             const struct counted_loop *loop, const struct vec_loop *vl) {
+    fprintf(out, "    // r%u -= %u until 0, %u iterations at a time\n", loop->counter, loop->step, VEC_LANES);
+    fprintf(out, "    while (st->regfile[%u] >= %uu", loop->counter, loop->step * VEC_LANES);
+    for (uint32_t i = 0; i < vl->naccesses; i++) {
+        const struct vec_access *a = &vl->accesses[i];
+        fprintf(out, " &&\n           (int8_t) (st->regfile[%u] + %uu) <= %d", a->reg, a->offset, 127 - (VEC_LANES - 1));
+    }
+    for (uint32_t i = 0; i < vl->naccesses; i++) {
+        for (uint32_t j = i + 1; j < vl->naccesses; j++) {
+            const struct vec_access *a = &vl->accesses[i], *b = &vl->accesses[j];
+            if (!a->store && !b->store) {
+                continue;
+            }
+            fprintf(out, " &&\n           vm_disjoint((int8_t) (st->regfile[%u] + %uu), (int8_t) (st->regfile[%u] + %uu))",
+                    a->reg, a->offset, b->reg, b->offset);
+        }
+    }
+    fprintf(out, ") {\n");
+
+    // the body goes to a buffer first, to declare the lanes of the registers it makes varying
+    char *body;
+    size_t body_len;
+    FILE *buf = open_memstream(&body, &body_len);
+    bool lanes[NUM_REGS] = {};
+    uint8_t cls[NUM_REGS];
+    memcpy(cls, vl->kind, sizeof(cls));
+    for (uint32_t pc = loop->head; pc < loop->branch; pc += 3) {
+        uint8_t opcode = code[pc], op1 = code[pc + 1], op2 = code[pc + 2];
+        const insn_template *t = find(insns, sizeof(insns) / sizeof(insns[0]), opcode);
+        bool arith = opcode != 'I' && opcode != 'M' && opcode != 'L' && opcode != 'S';
+        bool scalar = opcode == 'I' || vl->kind[op1] == VEC_INDUCTION ||
+                      (opcode == 'M' && cls[op2] == VEC_UNIFORM) ||
+                      (arith && vl->kind[op1] == VEC_UNIFORM && cls[op1] == VEC_UNIFORM && cls[op2] == VEC_UNIFORM);
+        if (opcode == 'L' || opcode == 'S') {
+            scalar = false;
+        }
+        if (scalar) {
+            // the same in every lane (an induction register in lane 0), the flags are dead
+            fprintf(buf, "        ");
+            emit_handler(buf, t->handler, op1, op2, 0, !sets_flags(opcode));
+            fprintf(buf, ";\n");
+            if (vl->kind[op1] != VEC_INDUCTION) {
+                cls[op1] = VEC_UNIFORM;
+            }
+            continue;
+        }
+        switch (opcode) {
+            case 'L':
+                fprintf(buf, "        v%u = vm_load(st->data + (int8_t) st->regfile[%u]);\n", op2, op1);
+                cls[op2] = VEC_VARYING;
+                lanes[op2] = true;
+                break;
+            case 'S':
+                fprintf(buf, "        vm_store(st->data + (int8_t) st->regfile[%u], ", op1);
+                emit_lanes(buf, vl, cls[op2], op2);
+                fprintf(buf, ");\n");
+                break;
+            case 'M':
+                fprintf(buf, "        v%u = ", op1);
+                emit_lanes(buf, vl, cls[op2], op2);
+                fprintf(buf, ";\n");
+                cls[op1] = VEC_VARYING;
+                lanes[op1] = true;
+                break;
+            default:
+                if (vl->kind[op1] == VEC_REDUCTION) {
+                    fprintf(buf, "        v%u %s ", op1, opcode == 'A' ? "+=" : "-=");
+                } else {
+                    fprintf(buf, "        v%u = ", op1);
+                    emit_lanes(buf, vl, cls[op1], op1);
+                    fprintf(buf, " %s ", vec_operator(opcode));
+                    cls[op1] = VEC_VARYING;
+                    lanes[op1] = true;
+                }
+                if (opcode == '<' || opcode == '>') {
+                    // the shift amount is taken mod 32, like shli and shri
+                    fprintf(buf, "(");
+                    emit_lanes(buf, vl, cls[op2], op2);
+                    fprintf(buf, " & 31u);\n");
+                    break;
+                }
+                emit_lanes(buf, vl, cls[op2], op2);
+                fprintf(buf, ";\n");
+                break;
+        }
+    }
+    fclose(buf);
+    for (int r = 0; r < NUM_REGS; r++) {
+        if (vl->kind[r] == VEC_REDUCTION) {
+            fprintf(out, "        vm_lanes v%u = {};\n", r);
+        } else if (lanes[r]) {
+            fprintf(out, "        vm_lanes v%u;\n", r);
+        }
+    }
+    fputs(body, out);
+    free(body);
+
+    // lane 0 to the last lane, and the results
+    for (int r = 0; r < NUM_REGS; r++) {
+        if (vl->kind[r] == VEC_INDUCTION) {
+            fprintf(out, "        st->regfile[%u] += %uu;\n", r, vl->step[r] * (VEC_LANES - 1));
+        } else if (vl->kind[r] == VEC_REDUCTION) {
+            fprintf(out, "        st->regfile[%u] += vm_sum(v%u);\n", r, r);
+        } else if (cls[r] == VEC_VARYING) {
+            fprintf(out, "        st->regfile[%u] = v%u[%u];\n", r, r, VEC_LANES - 1);
+        }
+    }
+    const insn_template *t = find(branches, sizeof(branches) / sizeof(branches[0]), 'N');
+    int32_t off = read32(&code[loop->branch + 2]);
+    fprintf(out, "        setflags(st, st->regfile[%u]);\n", loop->counter);
+    fprintf(out, "        st->pc = %u;\n        ", loop->branch);
+    emit_handler(out, t->handler, 0, 0, off);
+    fprintf(out, ";\n        st->pc += 6;\n");
+    fprintf(out, "        if (st->pc != %u) {\n        ", loop->head);
+    emit_goto(out, insn, loop_head, len, loop->branch + 6);
+    fprintf(out, "        }\n    }\n");
+}
+
+// lane types and helpers for the vectorized loops
+static const char *vector_prelude =
+        "// the helpers are static, so passing vectors wider than the target's registers is no ABI concern\n"
+        "#pragma GCC diagnostic ignored \"-Wpsabi\"\n"
+        "typedef uint32_t vm_lanes __attribute__((vector_size(4 * 16)));\n"
+        "typedef uint8_t vm_bytes __attribute__((vector_size(16)));\n"
+        "static const vm_lanes vm_lane = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};\n\n"
+        "static inline vm_lanes vm_load(const uint8_t *p) {\n"
+        "    vm_bytes b;\n"
+        "    __builtin_memcpy(&b, p, sizeof(b));\n"
+        "    return __builtin_convertvector(b, vm_lanes);\n"
+        "}\n\n"
+        "static inline void vm_store(uint8_t *p, vm_lanes v) {\n"
+        "    vm_bytes b = __builtin_convertvector(v, vm_bytes);\n"
+        "    __builtin_memcpy(p, &b, sizeof(b));\n"
+        "}\n\n"
+        "static inline uint32_t vm_sum(vm_lanes v) {\n"
+        "    uint32_t sum = 0;\n"
+        "    for (int i = 0; i < 16; i++) {\n"
+        "        sum += v[i];\n"
+        "    }\n"
+        "    return sum;\n"
+        "}\n\n"
+        "// the same address in the same iteration, or none in the same group\n"
+        "static inline bool vm_disjoint(int a, int b) {\n"
+        "    return a == b || a - b >= 16 || b - a >= 16;\n"
+        "}\n\n";
+
+// the entry of a counted loop: the vectorized groups, then the body `factor` times (only the
+// last copy sets the flags and branches), then the original loop
+static void emit_loop(FILE *out, const uint8_t *code, const bool *insn, const bool *loop_head, uint32_t len,
+                      const struct counted_loop *loop, uint32_t factor, const struct vec_loop *vl) {
+    fprintf(out, "loop_%u:\n", loop->head);
+    if (vl) {
+        emit_vector_loop(out, code, insn, loop_head, len, loop, vl);
+    }
+    if (factor <= 1) {
+        fprintf(out, "    goto pc_%u;\n", loop->head);
+        return;
+    }
+    fprintf(out, "    // r%u -= %u until 0, unrolled %u times while no copy but the last can exit\n",
+            loop->counter, loop->step, factor);
+    fprintf(out, "    while (st->regfile[%u] >= %uu) {\n", loop->counter, loop->step * factor);
+    for (uint32_t copy = 0; copy < factor; copy++) {
+        bool last = copy == factor - 1;
+        for (uint32_t pc = loop->head; pc < loop->branch; pc += 3) {
+            const insn_template *t = find(insns, sizeof(insns) / sizeof(insns[0]), code[pc]);
+            fprintf(out, "        ");
+            emit_handler(out, t->handler, code[pc + 1], code[pc + 2], 0, last || !sets_flags(code[pc]));
+            fprintf(out, ";\n");
+        }
+    }
+    const insn_template *t = find(branches, sizeof(branches) / sizeof(branches[0]), 'N');
+    int32_t off = read32(&code[loop->branch + 2]);
+    fprintf(out, "        st->pc = %u;\n        ", loop->branch);
+    emit_handler(out, t->handler, 0, 0, off);
+    fprintf(out, ";\n        st->pc += 6;\n");
+    fprintf(out, "        if (st->pc != %u) {\n        ", loop->head);
+    emit_goto(out, insn, loop_head, len, loop->branch + 6);
+    fprintf(out, "        }\n    }\n");
+    // the remainder, whose back edge comes back here
+    fprintf(out, "    goto pc_%u;\n", loop->head);
+}
+
+// --------------------------------------------------
+// SPARSE DISPATCH
+// --------------------------------------------------
+//
+// Dispatch on st->pc (on entry, and for the targets of indirect jumps) is a switch over every
+// reachable pc, which compilers lower to a jump table over the whole range of pcs when the cases
+// are dense and to a binary search when they are not. When the pcs are sparse, cogen emits a
+// minimal perfect hash instead (hash and displace): the n pcs are hashed into buckets, and each
+// bucket, largest first, gets the seed of a second hash that sends its pcs to free slots of
+// [0, n). Dispatch is then two hashes, one compare against the pc held in the slot, and a switch
+// over the dense slots, with tables of 4 bytes per pc and per bucket whatever the program size.
+
+// pcs per bucket, on average
+#define MPH_LOAD 4
+// seeds tried for a bucket before retrying with twice the buckets
+#define MPH_MAX_SEED (1u << 16)
+
+// the hash in the generated code, see mph_hash
+static const char *mph_prelude =
+        "static inline uint32_t mph_hash(uint32_t seed, uint32_t pc, uint32_t n) {\n"
+        "    uint32_t x = pc ^ (seed * 0x9e3779b9u);\n"
+        "    x ^= x >> 16;\n"
+        "    x *= 0x85ebca6bu;\n"
+        "    x ^= x >> 13;\n"
+        "    x *= 0xc2b2ae35u;\n"
+        "    x ^= x >> 16;\n"
+        "    return (uint32_t) (((uint64_t) x * n) >> 32);\n"
+        "}\n\n";
+
+// a hash of pc into [0, n), the same as mph_prelude
+static uint32_t mph_hash(uint32_t seed, uint32_t pc, uint32_t n) {
+    uint32_t x = pc ^ (seed * 0x9e3779b9u);
+    x ^= x >> 16;
+    x *= 0x85ebca6bu;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35u;
+    x ^= x >> 16;
+    return (uint32_t) (((uint64_t) x * n) >> 32);
+}
+
+struct mph {
+    uint32_t n;
+    uint32_t nbuckets;
+    uint32_t *seeds; // of each bucket
+    uint32_t *keys; // the pc in each slot
+};
+
+// whether every pc of a bucket has a free slot of its own under seed, which are then taken
+static bool mph_place(struct mph *h, const uint32_t *pcs, uint32_t npcs, uint32_t seed, bool *taken,
+                      uint32_t *slots) {
+    for (uint32_t i = 0; i < npcs; i++) {
+        slots[i] = mph_hash(seed, pcs[i], h->n);
+        if (taken[slots[i]]) {
+            return false;
+        }
+        for (uint32_t j = 0; j < i; j++) {
+            if (slots[j] == slots[i]) {
+                return false;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < npcs; i++) {
+        taken[slots[i]] = true;
+        h->keys[slots[i]] = pcs[i];
+    }
+    return true;
+}
+
+// the minimal perfect hash of the n distinct pcs
+static void mph_build(struct mph *h, const uint32_t *pcs, uint32_t n) {
+    h->n = n;
+    h->keys = (uint32_t *) calloc(n ? n : 1, sizeof(uint32_t));
+    bool *taken = (bool *) calloc(n ? n : 1, sizeof(bool));
+    uint32_t *order = (uint32_t *) malloc((n ? n : 1) * sizeof(uint32_t));
+    uint32_t *slots = (uint32_t *) malloc((n ? n : 1) * sizeof(uint32_t));
+    for (h->nbuckets = (n + MPH_LOAD - 1) / MPH_LOAD + 1;; h->nbuckets *= 2) {
+        h->seeds = (uint32_t *) calloc(h->nbuckets, sizeof(uint32_t));
+        memset(taken, 0, n * sizeof(bool));
+        // the pcs sorted by the size of their bucket, largest first, then by bucket
+        uint32_t *size = (uint32_t *) calloc(h->nbuckets, sizeof(uint32_t));
+        for (uint32_t i = 0; i < n; i++) {
+            order[i] = pcs[i];
+            size[mph_hash(0, pcs[i], h->nbuckets)]++;
+        }
+        std::stable_sort(order, order + n, [&](uint32_t a, uint32_t b) {
+            uint32_t ba = mph_hash(0, a, h->nbuckets), bb = mph_hash(0, b, h->nbuckets);
+            return size[ba] != size[bb] ? size[ba] > size[bb] : ba < bb;
+        });
+        bool ok = true;
+        for (uint32_t i = 0; i < n && ok;) {
+            uint32_t bucket = mph_hash(0, order[i], h->nbuckets);
+            uint32_t npcs = size[bucket];
+            uint32_t seed = 1;
+            while (seed < MPH_MAX_SEED && !mph_place(h, order + i, npcs, seed, taken, slots)) {
+                seed++;
+            }
+            ok = seed < MPH_MAX_SEED;
+            h->seeds[bucket] = seed;
+            i += npcs;
+        }
+        free(size);
+        if (ok) {
+            break;
+        }
+        free(h->seeds);
+    }
+    free(slots);
+    free(order);
+    free(taken);
+}
+
+static void mph_free(struct mph *h) {
+    free(h->seeds);
+    free(h->keys);
+}
+
+static void emit_table(FILE *out, const char *name, const uint32_t *values, uint32_t n) {
+    fprintf(out, "static const uint32_t %s[%u] = {", name, n ? n : 1);
+    for (uint32_t i = 0; i < n; i++) {
+        fprintf(out, "%s%u,", i % 16 ? " " : "\n        ", values[i]);
+    }
+    fprintf(out, "\n};\n\n");
+}
+
+// the dispatch on st->pc to the reachable instruction, through a switch or the perfect hash h
+static void emit_dispatch(FILE *out, const bool *insn, const bool *loop_head, uint32_t len, const struct mph *h) {
+    if (!h) {
+        fprintf(out, "    switch (st->pc) {\n");
+        for (uint32_t pc = 0; pc < len; pc++) {
+            if (insn[pc]) {
+                fprintf(out, "        case %u: goto %s_%u;\n", pc, loop_head[pc] ? "loop" : "pc", pc);
+            }
+        }
+        fprintf(out, "        default: return VM_BAD_PC;\n    }\n");
+        return;
+    }
+    fprintf(out, "    {\n");
+    fprintf(out, "        uint32_t slot = mph_hash(mph_seed[mph_hash(0, st->pc, %u)], st->pc, %u);\n", h->nbuckets,
+            h->n);
+    fprintf(out, "        if (mph_pc[slot] != st->pc) {\n            return VM_BAD_PC;\n        }\n");
+    fprintf(out, "        switch (slot) {\n");
+    for (uint32_t slot = 0; slot < h->n; slot++) {
+        uint32_t pc = h->keys[slot];
+        fprintf(out, "            case %u: goto %s_%u;\n", slot, loop_head[pc] ? "loop" : "pc", pc);
+    }
+    fprintf(out, "            default: return VM_BAD_PC;\n        }\n    }\n");
+}
+
+// the jump at pc: its most frequent targets, then the entry dispatch
+static void emit_jump(FILE *out, const insn_template *t, const uint8_t *code, const bool *insn, const bool *loop_head,
+                      uint32_t len, uint32_t pc, const struct branch_profile *profile) {
+    fprintf(out, "    ");
+    emit_handler(out, t->handler, code[pc + 1], 0, 0);
+    fprintf(out, ";\n");
+    uint32_t targets[VP_MAX_VALUES];
+    uint64_t counts[VP_MAX_VALUES];
+    uint32_t n = jump_targets(profile, pc, targets, counts);
+    for (uint32_t i = 0; i < n && i < COGEN_JUMP_TARGETS; i++) {
+        if (targets[i] >= len || !insn[targets[i]]) {
+            continue;
+        }
+        double p = (double) counts[i] / profile->targets[pc]->samples;
+        fprintf(out, "    if (__builtin_expect_with_probability(st->pc == %u, 1, %.4f)) {\n    ", targets[i], p);
+        emit_goto(out, insn, loop_head, len, targets[i]);
+        fprintf(out, "    }\n");
+    }
+    fprintf(out, "    goto dispatch;\n");
+}
+
+// the template for the instruction after the I at pc, when it is 3 bytes long and can take the
+// constant as its source operand; its own label still runs the generic handler, for the other
+// ways to reach it
+static const insn_template *fused_const(const uint8_t *code, uint32_t len, const bool *insn, const bool *loop_head,
+                                        uint32_t pc) {
+    uint32_t next = pc + 3;
+    if (code[pc] != 'I' || next + 3 > len || !insn[next] || loop_head[next]) {
+        return nullptr;
+    }
+    if (code[next + 1] >= NUM_REGS || code[next + 2] != code[pc + 1]) {
+        return nullptr;
+    }
+    return find(const_insns, sizeof(const_insns) / sizeof(const_insns[0]), code[next]);
+}
+
+uint64_t cogen_version() {
+    const char *source = COGEN_SOURCE_HASH;
+    uint64_t h = hash64((const uint8_t *) source, strlen(source));
+    for (const insn_template &t: insns) {
+        h = hash64(&t.opcode, 1, h);
+        h = hash64((const uint8_t *) t.handler, strlen(t.handler), h);
+    }
+    for (const insn_template &t: branches) {
+        h = hash64(&t.opcode, 1, h);
+        h = hash64((const uint8_t *) t.handler, strlen(t.handler), h);
+    }
+    for (const insn_template &t: jumps) {
+        h = hash64(&t.opcode, 1, h);
+        h = hash64((const uint8_t *) t.handler, strlen(t.handler), h);
+    }
+    for (const insn_template &t: const_insns) {
+        h = hash64(&t.opcode, 1, h);
+        h = hash64((const uint8_t *) t.handler, strlen(t.handler), h);
+    }
+    return h;
+}
+
+void cogen(FILE *out, const char *source, const char *name, const uint8_t *code, uint32_t len,
+           const struct cogen_options *options) {
+    const struct branch_profile *profile = options ? options->profile : nullptr;
+    uint32_t unroll = options ? options->unroll : COGEN_UNROLL;
+    bool vectorize = options ? options->vectorize : true;
+    enum cogen_dispatch dispatch = options ? options->dispatch : COGEN_DISPATCH_AUTO;
+    bool *insn = (bool *) calloc(len ? len : 1, sizeof(bool));
+    reachable(code, len, insn);
+    if (profile && profile->len != len) {
+        profile = nullptr;
+    }
+    uint32_t *order = (uint32_t *) malloc((len ? len : 1) * sizeof(uint32_t));
+    uint32_t norder = layout(code, len, insn, profile, order);
+
+    // counted loops, by their head
+    bool *target = (bool *) calloc(len ? len : 1, sizeof(bool));
+    bool *loop_head = (bool *) calloc(len ? len : 1, sizeof(bool));
+    struct counted_loop *loops = (struct counted_loop *) calloc(len ? len : 1, sizeof(struct counted_loop));
+    struct vec_loop *vec_loops = (struct vec_loop *) calloc(len ? len : 1, sizeof(struct vec_loop));
+    bool *vectorized = (bool *) calloc(len ? len : 1, sizeof(bool));
+    bool any_vectorized = false;
+    for (uint32_t pc = 0; pc + 6 <= len; pc++) {
+        if (insn[pc] && code[pc] == 'B') {
+            uint32_t to = pc + 6 + read32(&code[pc + 2]);
+            if (to < len) {
+                target[to] = true;
+            }
+        }
+    }
+    for (uint32_t pc = 0; (unroll > 1 || vectorize) && pc + 6 <= len; pc++) {
+        struct counted_loop loop;
+        if (insn[pc] && find_counted_loop(code, len, insn, target, pc, &loop) &&
+            (uint64_t) loop.step * (unroll > VEC_LANES ? unroll : VEC_LANES) <= UINT32_MAX && !loop_head[loop.head]) {
+            loop_head[loop.head] = true;
+            loops[loop.head] = loop;
+            vectorized[loop.head] = vectorize && find_vector_loop(code, &loop, &vec_loops[loop.head]);
+            any_vectorized |= vectorized[loop.head];
+        }
+    }
+
+    fprintf(out, "// generated by cogen from %s, do not edit\n", source);
+    fprintf(out, "#include \"vm.h\"\n\n");
+    if (any_vectorized) {
+        fputs(vector_prelude, out);
+    }
+    bool any_jump = false;
+    for (uint32_t pc = 0; pc < len; pc++) {
+        any_jump |= insn[pc] && find(jumps, sizeof(jumps) / sizeof(jumps[0]), code[pc]);
+    }
+    struct mph hash = {};
+    if (dispatch == COGEN_DISPATCH_HASH || (dispatch == COGEN_DISPATCH_AUTO && (uint64_t) norder * COGEN_SPARSE < len)) {
+        uint32_t *pcs = (uint32_t *) malloc((len ? len : 1) * sizeof(uint32_t));
+        uint32_t n = 0;
+        for (uint32_t pc = 0; pc < len; pc++) {
+            if (insn[pc]) {
+                pcs[n++] = pc;
+            }
+        }
+        mph_build(&hash, pcs, n);
+        free(pcs);
+        fputs(mph_prelude, out);
+        emit_table(out, "mph_seed", hash.seeds, hash.nbuckets);
+        emit_table(out, "mph_pc", hash.keys, hash.n);
+    }
+    fprintf(out, "extern \"C\" int %s(struct state *st) {\n", name);
+    if (any_jump) {
+        fprintf(out, "dispatch:\n");
+    }
+    emit_dispatch(out, insn, loop_head, len, hash.keys ? &hash : nullptr);
+
+    for (uint32_t i = 0; i < norder; i++) {
+        uint32_t pc = order[i];
+        uint8_t opcode = code[pc];
+        uint32_t n = insn_length(opcode);
+        if (loop_head[pc]) {
+            emit_loop(out, code, insn, loop_head, len, &loops[pc], unroll, vectorized[pc] ? &vec_loops[pc] : nullptr);
+        }
+        if (profile) {
+            fprintf(out, "    // executed %llu times\n", (unsigned long long) profile->count[pc]);
+        }
+        fprintf(out, "pc_%u:\n    st->pc = %u;\n", pc, pc);
+        if (n == 0 || pc + n > len) {
+            fprintf(out, "    return VM_ILLEGAL;\n");
+            continue;
+        }
+        if (opcode == 'H') {
+            fprintf(out, "    return VM_HALT;\n");
+            continue;
+        }
+        if (opcode == 'B') {
+            const insn_template *t = find(branches, sizeof(branches) / sizeof(branches[0]), code[pc + 1]);
+            if (!t) {
+                fprintf(out, "    return VM_ILLEGAL;\n");
+                continue;
+            }
+            int32_t off = read32(&code[pc + 2]);
+            uint32_t target = pc + n + off;
+            fprintf(out, "    ");
+            emit_handler(out, t->handler, 0, 0, off);
+            fprintf(out, ";\n    st->pc += %u;\n", n);
+            if (target != pc + n && profile) {
+                double p = profile->count[pc] ? (double) profile->taken[pc] / profile->count[pc] : 0.5;
+                fprintf(out, "    if (__builtin_expect_with_probability(st->pc == %u, 1, %.4f)) {\n    ", target, p);
+                emit_goto(out, insn, loop_head, len, target);
+                fprintf(out, "    }\n");
+            } else if (target != pc + n) {
+                fprintf(out, "    if (st->pc == %u) {\n    ", target);
+                emit_goto(out, insn, loop_head, len, target);
+                fprintf(out, "    }\n");
+            }
+            emit_goto(out, insn, loop_head, len, pc + n);
+            continue;
+        }
+        if (const insn_template *t = find(jumps, sizeof(jumps) / sizeof(jumps[0]), opcode)) {
+            emit_jump(out, t, code, insn, loop_head, len, pc, profile);
+            continue;
+        }
+        const insn_template *t = find(insns, sizeof(insns) / sizeof(insns[0]), opcode);
+        fprintf(out, "    ");
+        emit_handler(out, t->handler, code[pc + 1], code[pc + 2], 0);
+        fprintf(out, ";\n");
+        if (const insn_template *c = fused_const(code, len, insn, loop_head, pc)) {
+            // the next instruction, with the constant this one loads as its operand
+            fprintf(out, "    st->pc = %u;\n    ", pc + n);
+            emit_handler(out, c->handler, code[pc + n + 1], code[pc + 2], 0);
+            fprintf(out, ";\n");
+            n += 3;
+        }
+        emit_goto(out, insn, loop_head, len, pc + n);
+    }
+    fprintf(out, "}\n\n");
+
+    // the bytecode, so that a loaded residual program can be checked against the one requested
+    fprintf(out, "extern \"C\" const uint32_t %s_code_len = %u;\n", name, len);
+    fprintf(out, "extern \"C\" const uint8_t %s_code[] = {", name);
+    for (uint32_t pc = 0; pc < len; pc++) {
+        fprintf(out, "%s%u,", pc % 16 ? " " : "\n        ", code[pc]);
+    }
+    fprintf(out, "\n};\n");
+    mph_free(&hash);
+    free(vectorized);
+    free(vec_loops);
+    free(loops);
+    free(loop_head);
+    free(target);
+    free(order);
+    free(insn);
+}
@@ -0,0 +1,47 @@
+#ifndef COGEN_H
+#define COGEN_H
+
+#include <cstdint>
+#include <cstdio>
+
+#include "vm.h"
+#include "profile.h"
+
+// Write the residual C++ for `code` to out (see cogen.cpp). It defines
+//   extern "C" int <name>(struct state *st);        runs from st->pc, returns VM_HALT, VM_ILLEGAL or VM_BAD_PC
+//   extern "C" const uint8_t <name>_code[];         the bytecode it was generated from
+//   extern "C" const uint32_t <name>_code_len;
+// and only needs vm.h to compile. `source` names the bytecode in a comment.
+
+// unroll factor of counted loops by default
+#define COGEN_UNROLL 4
+
+// COGEN_DISPATCH_AUTO hashes the pcs when fewer than 1 byte in COGEN_SPARSE starts an instruction
+#define COGEN_SPARSE 8
+
+// how the generated code dispatches on st->pc, on entry and for indirect jumps
+enum cogen_dispatch {
+    COGEN_DISPATCH_AUTO,
+    COGEN_DISPATCH_SWITCH, // a switch over the pcs, which the compiler lowers
+    COGEN_DISPATCH_HASH, // a minimal perfect hash of the pcs, then a switch over the dense slots
+};
+
+struct cogen_options {
+    // With a branch profile, the instructions are laid out along their hottest paths, so that loop
+    // bodies fall through and cold code is emitted last, and every branch carries its probability.
+    const struct branch_profile *profile;
+    // counted loops are unrolled by this factor, 1 or less does not unroll
+    uint32_t unroll;
+    // counted loops over the data segment run 16 iterations at a time in SIMD lanes
+    bool vectorize;
+    enum cogen_dispatch dispatch;
+};
+
+// options nullptr is no profile, COGEN_UNROLL, vectorization and COGEN_DISPATCH_AUTO
+void cogen(FILE *out, const char *source, const char *name, const uint8_t *code, uint32_t len,
+           const struct cogen_options *options = nullptr);
+
+// changes whenever the generated code for a program would
+uint64_t cogen_version();
+
+#endif
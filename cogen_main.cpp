@@ -0,0 +1,131 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "bytecode.h"
+#include "cogen.h"
+
+// --------------------------------------------------
+// COGEN
+// --------------------------------------------------
+//
+// usage: cogen.out [-n name] [-t input] [-p profile] [-u factor] [-v 0|1] [-d auto|switch|hash] program > residual.cpp
+//        program is the name of a program in bytecode.h, or a file of raw bytecode
+//        -t runs the program on r0 = input through the instrumented interpreter first
+//        -p reads a branch profile saved by bp_save
+// Either profile guides the layout and branch weights of the output.
+//        -u unrolls counted loops by factor (default COGEN_UNROLL, 1 does not unroll)
+//        -v 0 does not vectorize loops over the data segment
+//        -d chooses the dispatch on st->pc, see cogen_dispatch (by default a hash for sparse pcs)
+//
+// The output defines `extern "C" int <name>(struct state *st)` (default vm_run), see cogen.h.
+
+#define MAX_CODE (1 << 20)
+
+struct builtin {
+    const char *name;
+    const uint8_t *code;
+    uint32_t len;
+    const uint8_t *data; // the initial data segment, for training
+    uint32_t data_len;
+};
+
+static const builtin builtins[] = {
+        {"fib",  fib,  sizeof(fib) - 1,   nullptr, 0},
+        {"vmvm", vmvm, sizeof(vmvm) - 1, fib,     sizeof(fib) - 1},
+        {"vsum", vsum, sizeof(vsum) - 1, nullptr, 0},
+        {"vcopy", vcopy, sizeof(vcopy) - 1, nullptr, 0},
+        {"vxform", vxform, sizeof(vxform) - 1, nullptr, 0},
+        {"jstates", jstates, sizeof(jstates) - 1, nullptr, 0},
+        {"xorshift", xorshift, sizeof(xorshift) - 1, nullptr, 0},
+        {"simd_sum", simd_sum, sizeof(simd_sum) - 1, nullptr, 0},
+        {"simd_xform", simd_xform, sizeof(simd_xform) - 1, nullptr, 0},
+        {"simd_count", simd_count, sizeof(simd_count) - 1, nullptr, 0},
+};
+
+static void usage() {
+    puts("usage: cogen.out [-n name] [-t input] [-p profile] [-u factor] [-v 0|1] [-d auto|switch|hash] program");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    const char *name = "vm_run";
+    const char *train = nullptr;
+    const char *profile_path = nullptr;
+    uint32_t unroll = COGEN_UNROLL;
+    bool vectorize = true;
+    enum cogen_dispatch dispatch = COGEN_DISPATCH_AUTO;
+    int arg = 1;
+    for (; arg + 2 < argc && argv[arg][0] == '-'; arg += 2) {
+        if (!strcmp(argv[arg], "-n")) {
+            name = argv[arg + 1];
+        } else if (!strcmp(argv[arg], "-t")) {
+            train = argv[arg + 1];
+        } else if (!strcmp(argv[arg], "-p")) {
+            profile_path = argv[arg + 1];
+        } else if (!strcmp(argv[arg], "-u")) {
+            unroll = strtoul(argv[arg + 1], NULL, 10);
+        } else if (!strcmp(argv[arg], "-v")) {
+            vectorize = strcmp(argv[arg + 1], "0");
+        } else if (!strcmp(argv[arg], "-d") && !strcmp(argv[arg + 1], "auto")) {
+            dispatch = COGEN_DISPATCH_AUTO;
+        } else if (!strcmp(argv[arg], "-d") && !strcmp(argv[arg + 1], "switch")) {
+            dispatch = COGEN_DISPATCH_SWITCH;
+        } else if (!strcmp(argv[arg], "-d") && !strcmp(argv[arg + 1], "hash")) {
+            dispatch = COGEN_DISPATCH_HASH;
+        } else {
+            usage();
+        }
+    }
+    if (arg + 1 != argc) {
+        usage();
+    }
+    const char *source = argv[arg];
+
+    static uint8_t buf[MAX_CODE];
+    const uint8_t *code = nullptr;
+    uint32_t len = 0;
+    static uint8_t data[0x100];
+    for (const builtin &b: builtins) {
+        if (!strcmp(source, b.name)) {
+            code = b.code;
+            len = b.len;
+            memcpy(data, b.data, b.data_len);
+        }
+    }
+    if (!code) {
+        FILE *f = fopen(source, "rb");
+        if (!f) {
+            perror(source);
+            exit(1);
+        }
+        len = fread(buf, 1, MAX_CODE, f);
+        fclose(f);
+        code = buf;
+    }
+
+    struct branch_profile profile;
+    bp_init(&profile, len);
+    if (profile_path) {
+        FILE *f = fopen(profile_path, "r");
+        if (!f) {
+            perror(profile_path);
+            exit(1);
+        }
+        if (!bp_load(&profile, f)) {
+            printf("%s: invalid profile\n", profile_path);
+            exit(1);
+        }
+        fclose(f);
+    }
+    if (train) {
+        struct state st = {};
+        st.data = data;
+        st.regfile[0] = strtoul(train, NULL, 10);
+        profile_run(code, len, &st, nullptr, 0, &profile);
+    }
+    struct cogen_options options = {train || profile_path ? &profile : nullptr, unroll, vectorize, dispatch};
+    cogen(stdout, source, name, code, len, &options);
+    bp_free(&profile);
+}
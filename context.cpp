@@ -0,0 +1,370 @@
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "context.h"
+
+// the code of each pc is at most this long, with the exit of a branch to a bad pc
+#define CTX_MAX_BYTES 64
+
+// the jump went to a pc not translated yet, st->pc is set
+#define CTX_UNTRANSLATED (-1)
+
+// the translated code starts with the entry, then the exits the code shares
+#define ENTRY 0
+#define EPILOGUE 16
+#define EXIT_BAD_PC 32
+#define EXIT_UNTRANSLATED 48
+#define STUBS_SIZE 64
+
+// the translated code of a program at most, so that a rel32 reaches all of it from anywhere in it
+#define CTX_MAX_TEXT ((size_t) 1 << 30)
+
+typedef int (*ctx_entry)(struct state *st, void **native, void *target);
+
+// --------------------------------------------------
+// HANDLERS
+// called from the translated code, the operands are passed as immediates
+// --------------------------------------------------
+
+typedef void (*ctx_handler)(struct state *st, uint32_t op1, uint32_t op2);
+
+#define OP1 op1
+#define OP2 op2
+#define OFF off
+
+template<uint8_t OPCODE>
+static void insn_handler(struct state *st, uint32_t op1, uint32_t op2) {
+#define HANDLER(op, len, handler) \
+    if constexpr (OPCODE == op) { \
+        handler;                  \
+    }
+    VM_INSNS(HANDLER)
+    VM_JUMPS(HANDLER)
+#undef HANDLER
+}
+
+static ctx_handler handler_for(uint8_t opcode) {
+    switch (opcode) {
+#define HANDLER_FOR(op, len, handler) \
+        case op:                      \
+            return insn_handler<op>;
+        VM_INSNS(HANDLER_FOR)
+        VM_JUMPS(HANDLER_FOR)
+#undef HANDLER_FOR
+        default:
+            return nullptr;
+    }
+}
+
+// whether the branch with condition CC is taken, for the conditions not tested inline (st->pc is
+// not kept up to date by the translated code, so it is free to clobber)
+template<uint8_t CC>
+static bool taken(struct state *st) {
+    int32_t off = 1;
+    st->pc = 0;
+#define TAKEN(cc, handler)          \
+    if constexpr (CC == cc) {       \
+        handler;                    \
+    }
+    VM_BRANCHES(TAKEN)
+#undef TAKEN
+    return st->pc != 0;
+}
+
+typedef bool (*ctx_condition)(struct state *st);
+
+static ctx_condition condition_for(uint8_t cc) {
+    switch (cc) {
+#define CONDITION_FOR(cc, handler) \
+        case cc:                   \
+            return taken<cc>;
+        VM_BRANCHES(CONDITION_FOR)
+#undef CONDITION_FOR
+        default:
+            return nullptr;
+    }
+}
+
+#undef OP1
+#undef OP2
+#undef OFF
+
+// --------------------------------------------------
+// X86-64 ENCODING
+// rbx holds st and r12 the table of translated code by pc, both callee saved
+// --------------------------------------------------
+
+struct emitter {
+    uint8_t *text;
+    uint32_t at;
+};
+
+static void emit8(struct emitter *e, uint8_t b) {
+    e->text[e->at++] = b;
+}
+
+static void emit32(struct emitter *e, uint32_t v) {
+    memcpy(e->text + e->at, &v, 4);
+    e->at += 4;
+}
+
+static void emit64(struct emitter *e, uint64_t v) {
+    memcpy(e->text + e->at, &v, 8);
+    e->at += 8;
+}
+
+static void emit(struct emitter *e, const char *bytes, uint32_t n) {
+    memcpy(e->text + e->at, bytes, n);
+    e->at += n;
+}
+
+// the rel32 of the instruction ending 4 bytes after `at`, to target
+static void patch_rel32(uint8_t *text, uint32_t at, const void *target) {
+    int32_t rel = (int32_t) ((const uint8_t *) target - (text + at + 4));
+    memcpy(text + at, &rel, 4);
+}
+
+static bool in_rel32(const uint8_t *from, const void *target) {
+    int64_t rel = (const uint8_t *) target - from;
+    return rel == (int32_t) rel;
+}
+
+// call fn, directly if it is in reach
+static void emit_call(struct emitter *e, const void *fn) {
+    if (in_rel32(e->text + e->at + 5, fn)) {
+        emit8(e, 0xe8); // call rel32
+        patch_rel32(e->text, e->at, fn);
+        e->at += 4;
+    } else {
+        emit(e, "\x48\xb8", 2); // mov rax, imm64
+        emit64(e, (uint64_t) fn);
+        emit(e, "\xff\xd0", 2); // call rax
+    }
+}
+
+static void emit_jmp(struct emitter *e, const void *target) {
+    emit8(e, 0xe9); // jmp rel32
+    patch_rel32(e->text, e->at, target);
+    e->at += 4;
+}
+
+// return result from the translated code, with st->pc := pc
+static void emit_exit(struct emitter *e, uint32_t pc, int result) {
+    emit(e, "\xc7\x83", 2); // mov dword [rbx + pc], imm32
+    emit32(e, offsetof(struct state, pc));
+    emit32(e, pc);
+    emit8(e, 0xb8); // mov eax, imm32
+    emit32(e, result);
+    emit_jmp(e, e->text + EPILOGUE);
+}
+
+static void emit_stubs(struct emitter *e) {
+    e->at = ENTRY;
+    emit(e, "\x53\x41\x54", 3); // push rbx; push r12
+    emit(e, "\x48\x83\xec\x08", 4); // sub rsp, 8 (so that the calls are aligned)
+    emit(e, "\x48\x89\xfb\x49\x89\xf4", 6); // mov rbx, rdi; mov r12, rsi
+    emit(e, "\xff\xe2", 2); // jmp rdx
+    e->at = EPILOGUE;
+    emit(e, "\x48\x83\xc4\x08", 4); // add rsp, 8
+    emit(e, "\x41\x5c\x5b\xc3", 4); // pop r12; pop rbx; ret
+    e->at = EXIT_BAD_PC;
+    emit8(e, 0xb8); // mov eax, VM_BAD_PC
+    emit32(e, VM_BAD_PC);
+    emit_jmp(e, e->text + EPILOGUE);
+    e->at = EXIT_UNTRANSLATED;
+    emit8(e, 0xb8); // mov eax, CTX_UNTRANSLATED
+    emit32(e, (uint32_t) CTX_UNTRANSLATED);
+    emit_jmp(e, e->text + EPILOGUE);
+    e->at = STUBS_SIZE;
+}
+
+// handler(st, op1, op2)
+static void emit_handler(struct emitter *e, ctx_handler fn, uint8_t op1, uint8_t op2) {
+    emit(e, "\x48\x89\xdf", 3); // mov rdi, rbx
+    emit8(e, 0xbe); // mov esi, imm32
+    emit32(e, op1);
+    emit8(e, 0xba); // mov edx, imm32
+    emit32(e, op2);
+    emit_call(e, (const void *) fn);
+}
+
+// a conditional branch if the VM branch with condition cc is taken, returns where its rel32 is
+static uint32_t emit_branch(struct emitter *e, uint8_t cc) {
+    if (cc == 'E' || cc == 'N') {
+        emit(e, "\xf6\x83", 2); // test byte [rbx + flags], FLAG_Z
+        emit32(e, offsetof(struct state, flags));
+        emit8(e, FLAG_Z);
+        emit(e, cc == 'E' ? "\x0f\x85" : "\x0f\x84", 2); // jnz / jz rel32
+    } else {
+        emit(e, "\x48\x89\xdf", 3); // mov rdi, rbx
+        emit_call(e, (const void *) condition_for(cc));
+        emit(e, "\x84\xc0", 2); // test al, al
+        emit(e, "\x0f\x85", 2); // jnz rel32
+    }
+    e->at += 4;
+    return e->at - 4;
+}
+
+// after the handler set st->pc, go to its translated code
+static void emit_dispatch(struct emitter *e, uint32_t len) {
+    emit(e, "\x8b\x83", 2); // mov eax, [rbx + pc]
+    emit32(e, offsetof(struct state, pc));
+    emit8(e, 0x3d); // cmp eax, len
+    emit32(e, len);
+    emit(e, "\x0f\x83", 2); // jae EXIT_BAD_PC
+    patch_rel32(e->text, e->at, e->text + EXIT_BAD_PC);
+    e->at += 4;
+    emit(e, "\x49\x8b\x04\xc4", 4); // mov rax, [r12 + rax * 8]
+    emit(e, "\x48\x85\xc0", 3); // test rax, rax
+    emit(e, "\x0f\x84", 2); // jz EXIT_UNTRANSLATED
+    patch_rel32(e->text, e->at, e->text + EXIT_UNTRANSLATED);
+    e->at += 4;
+    emit(e, "\xff\xe0", 2); // jmp rax
+}
+
+// --------------------------------------------------
+// TRANSLATION
+// --------------------------------------------------
+
+struct fixup {
+    uint32_t at; // of the rel32
+    uint32_t target; // pc
+};
+
+// translate the code reachable from pc that is not translated yet
+static void translate(struct ctx_program *prog, uint32_t start) {
+    const uint8_t *code = prog->code;
+    uint32_t len = prog->len;
+    struct emitter e = {prog->text, prog->text_used};
+    uint32_t *work = (uint32_t *) malloc((len + 1) * sizeof(uint32_t));
+    struct fixup *fixups = (struct fixup *) malloc((len + 1) * sizeof(struct fixup));
+    uint32_t nwork = 0, nfixups = 0;
+    work[nwork++] = start;
+    while (nwork) {
+        uint32_t pc = work[--nwork];
+        if (prog->native[pc]) {
+            continue;
+        }
+        // a straight line of instructions from pc, until one ends it or is translated already
+        while (1) {
+            if (pc >= len) {
+                emit_exit(&e, pc, VM_BAD_PC);
+                break;
+            }
+            if (prog->native[pc]) {
+                emit_jmp(&e, prog->native[pc]);
+                break;
+            }
+            prog->native[pc] = e.text + e.at;
+            prog->translated++;
+            uint8_t opcode = code[pc];
+            uint32_t n = insn_length(opcode);
+            if (opcode == 'H') {
+                emit_exit(&e, pc, VM_HALT);
+                break;
+            }
+            if (n == 0 || pc + n > len || (opcode == 'B' && !condition_for(code[pc + 1]))) {
+                emit_exit(&e, pc, VM_ILLEGAL);
+                break;
+            }
+            if (opcode == 'B') {
+                uint32_t target = pc + 6 + read32(&code[pc + 2]);
+                fixups[nfixups++] = {emit_branch(&e, code[pc + 1]), target};
+                if (target < len && !prog->native[target]) {
+                    work[nwork++] = target;
+                }
+                pc += n;
+                continue;
+            }
+            emit_handler(&e, handler_for(opcode), code[pc + 1], n > 2 ? code[pc + 2] : 0);
+            if (opcode == 'J') {
+                emit_dispatch(&e, len);
+                break;
+            }
+            pc += n;
+        }
+    }
+    // every branch target in the code was translated, or is out of the code
+    for (uint32_t i = 0; i < nfixups; i++) {
+        uint32_t target = fixups[i].target;
+        if (target < len) {
+            patch_rel32(e.text, fixups[i].at, prog->native[target]);
+        } else {
+            patch_rel32(e.text, fixups[i].at, e.text + e.at);
+            emit_exit(&e, target, VM_BAD_PC);
+        }
+    }
+    prog->text_used = e.at;
+    free(work);
+    free(fixups);
+}
+
+// --------------------------------------------------
+// VM INTERPRETER
+// enters the translated code
+// --------------------------------------------------
+
+#if defined(__x86_64__)
+
+struct ctx_program *ctx_translate(const uint8_t *code, uint32_t len) {
+    long page = sysconf(_SC_PAGESIZE);
+    size_t size = (STUBS_SIZE + ((size_t) len + 1) * CTX_MAX_BYTES + page - 1) / page * page;
+    if (size > CTX_MAX_TEXT) {
+        return nullptr;
+    }
+    // (a hint, below the handlers in the text of this program; anywhere else, the calls are indirect)
+    uintptr_t near = ((uintptr_t) &ctx_run & ~(uintptr_t) (page - 1)) - ((uintptr_t) 64 << 20) - size;
+    void *text = mmap((void *) near, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (text == MAP_FAILED) {
+        return nullptr;
+    }
+    struct ctx_program *prog = (struct ctx_program *) calloc(1, sizeof(struct ctx_program));
+    prog->code = code;
+    prog->len = len;
+    prog->text = (uint8_t *) text;
+    prog->text_size = size;
+    prog->native = (void **) calloc(len ? len : 1, sizeof(void *));
+    struct emitter e = {prog->text, 0};
+    emit_stubs(&e);
+    prog->text_used = e.at;
+    if (len) {
+        translate(prog, 0);
+    }
+    mprotect(prog->text, size, PROT_READ | PROT_EXEC);
+    return prog;
+}
+
+#else
+
+struct ctx_program *ctx_translate(const uint8_t *, uint32_t) {
+    return nullptr;
+}
+
+#endif
+
+int ctx_run(struct ctx_program *prog, struct state *st) {
+    while (1) {
+        if (st->pc >= prog->len) {
+            return VM_BAD_PC;
+        }
+        if (!prog->native[st->pc]) {
+            mprotect(prog->text, prog->text_size, PROT_READ | PROT_WRITE);
+            translate(prog, st->pc);
+            mprotect(prog->text, prog->text_size, PROT_READ | PROT_EXEC);
+        }
+        int res = ((ctx_entry) (void *) (prog->text + ENTRY))(st, prog->native, prog->native[st->pc]);
+        if (res != CTX_UNTRANSLATED) {
+            return res;
+        }
+    }
+}
+
+void ctx_free(struct ctx_program *prog) {
+    munmap(prog->text, prog->text_size);
+    free(prog->native);
+    free(prog);
+}
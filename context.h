@@ -0,0 +1,43 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "vm.h"
+
+// --------------------------------------------------
+// CONTEXT THREADING
+// --------------------------------------------------
+//
+// Bytecode translated at load time into x86-64 code that calls the handler of each instruction in
+// turn (call threading), with every branch of the bytecode replicated as a native conditional
+// branch to the code of its target. The calls return to the next call and the VM branches are
+// predicted as branches at their own addresses, so the return address stack and branch predictor
+// of the host follow the control flow of the VM instead of one shared dispatch. Only an indirect
+// jump looks its target up, in a table of the translated code by pc.
+//
+// Translation starts at the entry pc and follows both edges of every branch. A jump to a pc not
+// translated yet returns to ctx_run, which translates from there and resumes. The code is mapped
+// writable only while it is being written.
+
+struct ctx_program {
+    const uint8_t *code; // not copied, must outlive the translation
+    uint32_t len;
+    uint8_t *text; // the native code, mapped near the handlers so that they are in reach of a call
+    size_t text_size;
+    uint32_t text_used;
+    void **native; // the translated code by pc, nullptr if not translated
+    uint32_t translated; // instructions
+};
+
+// nullptr if the host is not x86-64, or the code is too long to translate (about 16 MiB) or
+// can't be mapped
+struct ctx_program *ctx_translate(const uint8_t *code, uint32_t len);
+
+// Run from st->pc, returns VM_HALT, VM_ILLEGAL or VM_BAD_PC.
+int ctx_run(struct ctx_program *prog, struct state *st);
+
+void ctx_free(struct ctx_program *prog);
+
+#endif
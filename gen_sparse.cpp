@@ -0,0 +1,94 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "vm.h"
+
+// --------------------------------------------------
+// SPARSE PROGRAM
+// --------------------------------------------------
+//
+// Writes the bytecode of a state machine whose states are scattered over the code with padding
+// between them, for bench_dispatch.cpp. The states are visited 5 apart (mod the number of states)
+// through an indirect jump, so every step dispatches on a pc that is not in the profile's fast
+// path. r0 is both the number of steps and the result.
+//
+// usage: gen_sparse.out [states] [stride] > sparse.bin
+//        states a power of 2 (default 256), stride the bytes between states (default 1024)
+
+#define BASE 0x80
+
+static uint8_t *code;
+static uint32_t at;
+
+static void emit3(uint8_t opcode, uint8_t op1, uint8_t op2) {
+    code[at++] = opcode;
+    code[at++] = op1;
+    code[at++] = op2;
+}
+
+static void emit_branch(uint8_t cc, uint32_t target) {
+    int32_t off = target - (at + 6);
+    code[at++] = 'B';
+    code[at++] = cc;
+    for (int i = 0; i < 4; i++) {
+        code[at++] = (uint32_t) off >> (8 * i);
+    }
+}
+
+// r := 2^k times its current value
+static void shift(uint8_t r, int k) {
+    for (int i = 0; i < k; i++) {
+        emit3('A', r, r);
+    }
+}
+
+int main(int argc, char **argv) {
+    uint32_t states = argc > 1 ? strtoul(argv[1], NULL, 10) : 256;
+    uint32_t stride = argc > 2 ? strtoul(argv[2], NULL, 10) : 1024;
+    int log_states = __builtin_ctz(states ? states : 1);
+    int log_stride = __builtin_ctz(stride ? stride : 1);
+    if (!states || states & (states - 1) || !stride || stride & (stride - 1) || stride < 64 ||
+        log_states + log_stride > 30) {
+        puts("states and stride must be powers of 2, stride at least 64");
+        return 1;
+    }
+    uint32_t exit = BASE + states * stride;
+    uint32_t len = exit + 4;
+    code = (uint8_t *) calloc(len, 1);
+
+    // r3 := 1, r10 := the size of the states, r7 := 5 states, r9 := the end of the states
+    emit3('I', 3, 1);
+    emit3('I', 10, 1);
+    shift(10, log_states + log_stride);
+    emit3('I', 7, 5);
+    shift(7, log_stride);
+    emit3('I', 11, BASE);
+    emit3('M', 9, 10);
+    emit3('A', 9, 11);
+    emit3('M', 1, 11);
+    code[at++] = 'J';
+    code[at++] = 1;
+
+    for (uint32_t k = 0; k < states; k++) {
+        at = BASE + k * stride;
+        emit3('I', 12, k);
+        emit3('A', 2, 12); // r2 := r2 + k mod 256
+        emit3('A', 1, 7); // r1 := the state 5 on
+        emit3('M', 8, 1);
+        emit3('U', 8, 9);
+        emit_branch('L', at + 6 + 3); // if r1 is past the states
+        emit3('U', 1, 10); // wrap around
+        emit3('U', 0, 3); // r0 := r0 - 1
+        emit_branch('E', exit);
+        code[at++] = 'J';
+        code[at++] = 1;
+    }
+
+    at = exit;
+    emit3('M', 0, 2);
+    code[at++] = 'H';
+    fwrite(code, 1, len, stdout);
+    free(code);
+}
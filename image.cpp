@@ -0,0 +1,138 @@
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+
+// pagemap entries read at a time
+#define PAGEMAP_CHUNK 512
+
+// bits of a /proc/self/pagemap entry
+#define PM_PRESENT (1ull << 63)
+#define PM_SWAPPED (1ull << 62)
+#define PM_FILE (1ull << 61) // a page of the file (or shared), not a private copy
+
+struct vm_image {
+    int fd; // the sealed memfd
+    int pagemap; // -1 if it can't be read
+    size_t size;
+    size_t mapped; // rounded up to pages
+    size_t page;
+};
+
+struct vm_image *image_create(const uint8_t *data, size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t mapped = (size + page - 1) / page * page;
+    if (!mapped) {
+        return nullptr;
+    }
+    int fd = memfd_create("vm-image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return nullptr;
+    }
+    // the file covers the whole mapping, so that no access within it is past its end
+    bool ok = !ftruncate(fd, mapped);
+    for (size_t done = 0; ok && done < size;) {
+        ssize_t n = pwrite(fd, data + done, size - done, done);
+        ok = n > 0;
+        done += ok ? n : 0;
+    }
+    // no one changes it under the instances
+    if (!ok || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)) {
+        close(fd);
+        return nullptr;
+    }
+    struct vm_image *img = (struct vm_image *) calloc(1, sizeof(struct vm_image));
+    img->fd = fd;
+    img->pagemap = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    img->size = size;
+    img->mapped = mapped;
+    img->page = page;
+    return img;
+}
+
+struct vm_image *image_load(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat sb;
+    void *p = MAP_FAILED;
+    if (!fstat(fd, &sb) && sb.st_size > 0) {
+        p = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (p == MAP_FAILED) {
+        return nullptr;
+    }
+    struct vm_image *img = image_create((const uint8_t *) p, sb.st_size);
+    munmap(p, sb.st_size);
+    return img;
+}
+
+void image_free(struct vm_image *img) {
+    close(img->fd);
+    if (img->pagemap >= 0) {
+        close(img->pagemap);
+    }
+    free(img);
+}
+
+size_t image_size(const struct vm_image *img) {
+    return img->size;
+}
+
+uint8_t *image_map(const struct vm_image *img) {
+    void *p = mmap(nullptr, img->mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE, img->fd, 0);
+    return p == MAP_FAILED ? nullptr : (uint8_t *) p;
+}
+
+void image_unmap(const struct vm_image *img, uint8_t *seg) {
+    munmap(seg, img->mapped);
+}
+
+// The private pages of seg, dropped if drop; every page if pagemap can't be read.
+static size_t scan(const struct vm_image *img, uint8_t *seg, bool drop) {
+    size_t npages = img->mapped / img->page;
+    uint64_t entries[PAGEMAP_CHUNK];
+    size_t dirty = 0;
+    size_t run = 0; // consecutive private pages before i, dropped together
+    for (size_t i = 0; i < npages;) {
+        size_t n = npages - i < PAGEMAP_CHUNK ? npages - i : PAGEMAP_CHUNK;
+        off_t at = (uintptr_t) (seg + i * img->page) / img->page * sizeof(uint64_t);
+        ssize_t want = n * sizeof(uint64_t);
+        if (img->pagemap < 0 || pread(img->pagemap, entries, want, at) != want) {
+            if (drop) {
+                madvise(seg, img->mapped, MADV_DONTNEED);
+            }
+            return npages;
+        }
+        for (size_t k = 0; k < n; k++, i++) {
+            uint64_t e = entries[k];
+            if (((e & PM_PRESENT) && !(e & PM_FILE)) || (e & PM_SWAPPED)) {
+                dirty++;
+                run++;
+            } else if (run) {
+                if (drop) {
+                    madvise(seg + (i - run) * img->page, run * img->page, MADV_DONTNEED);
+                }
+                run = 0;
+            }
+        }
+    }
+    if (drop && run) {
+        madvise(seg + (npages - run) * img->page, run * img->page, MADV_DONTNEED);
+    }
+    return dirty;
+}
+
+size_t image_reset(const struct vm_image *img, uint8_t *seg) {
+    return scan(img, seg, true);
+}
+
+size_t image_dirty(const struct vm_image *img, const uint8_t *seg) {
+    return scan(img, (uint8_t *) seg, false);
+}
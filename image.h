@@ -0,0 +1,44 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <cstddef>
+#include <cstdint>
+
+// --------------------------------------------------
+// DATA IMAGES
+// --------------------------------------------------
+//
+// An initial data segment (lookup tables, constants) loaded once and shared by every instance that
+// starts from it. The image is kept in a sealed memfd, and each instance's segment is a private
+// mapping of it: the instances share its pages in the page cache until they write to one, which
+// then becomes a private copy of that instance. Creating an instance is one mmap, and an idle
+// instance costs only the pages it wrote.
+//
+// Resetting an instance to the image drops just its private pages, found in /proc/self/pagemap, so
+// that the next access maps the image's page again. Without pagemap the whole segment is dropped,
+// which is as correct and only slower on the next accesses.
+//
+// The VM addresses the data segment with signed 8-bit offsets from st->data, so an image larger
+// than 0x100 bytes is a table st->data can point anywhere into (at least 0x80 bytes from its ends,
+// 0x90 for the vector instructions).
+
+struct vm_image;
+
+// An image of size bytes from data, or of the file at path; nullptr if it could not be made.
+struct vm_image *image_create(const uint8_t *data, size_t size);
+struct vm_image *image_load(const char *path);
+// Frees the image; its instances stay valid until they are unmapped.
+void image_free(struct vm_image *img);
+
+size_t image_size(const struct vm_image *img);
+
+// A segment of image_size bytes that starts as a copy of the image, nullptr if it could not be mapped.
+uint8_t *image_map(const struct vm_image *img);
+void image_unmap(const struct vm_image *img, uint8_t *seg);
+
+// Returns seg to the image and the number of its pages that had been written and were dropped.
+size_t image_reset(const struct vm_image *img, uint8_t *seg);
+// The number of pages of seg written since it was mapped or reset.
+size_t image_dirty(const struct vm_image *img, const uint8_t *seg);
+
+#endif
@@ -0,0 +1,143 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "vm.h"
+#include "isa.h"
+
+// operands of the handlers in VM_INSNS and VM_BRANCHES
+#define OP1 (*op1)
+#define OP2 (*op2)
+#define OFF off
+
+// --------------------------------------------------
+// INTERPRETER
+// inlined into a function per level, the handlers of vm.h with it
+// --------------------------------------------------
+
+__attribute__((always_inline)) static inline int interp_body(struct state *st) {
+    const uint8_t *code = st->code;
+    while (1) {
+        uint32_t pc = st->pc;
+        const uint8_t *op1 = &code[pc + 1];
+        const uint8_t *op2 = &code[pc + 2];
+        switch (code[pc]) {
+#define INSN(op, len, handler) \
+            case op:           \
+                handler;       \
+                st->pc += len; \
+                break;
+            VM_INSNS(INSN)
+#undef INSN
+#define JUMP(op, len, handler) \
+            case op:           \
+                handler;       \
+                break;
+            VM_JUMPS(JUMP)
+#undef JUMP
+            case 'B': {
+                int32_t off = read32(&code[pc + 2]);
+                switch (code[pc + 1]) {
+#define BRANCH(cc, handler) \
+                    case cc:        \
+                        handler;    \
+                        break;
+                    VM_BRANCHES(BRANCH)
+#undef BRANCH
+                    default:
+                        return VM_ILLEGAL;
+                }
+                st->pc += 6;
+                break;
+            }
+            case 'H':
+                return VM_HALT;
+            default:
+                return VM_ILLEGAL;
+        }
+    }
+}
+
+#if defined(__x86_64__)
+
+#define LEVEL_INTERP(name, features, supported) \
+    __attribute__((target(features))) static int interp_##name(struct state *st) { return interp_body(st); }
+ISA_LEVELS(LEVEL_INTERP)
+#undef LEVEL_INTERP
+
+// CPUID is read by the first call, which may come before the constructor of libgcc that does it
+static bool cpu_init() {
+    __builtin_cpu_init();
+    return true;
+}
+
+#define CPU(feature) (cpu_init() && __builtin_cpu_supports(feature))
+
+#endif
+
+static int interp_baseline(struct state *st) {
+    return interp_body(st);
+}
+
+// --------------------------------------------------
+// SELECTION
+// --------------------------------------------------
+
+const struct isa_level isa_levels[] = {
+#if defined(__x86_64__)
+#define LEVEL(name, features, supported) {#name, supported, interp_##name},
+        ISA_LEVELS(LEVEL)
+#undef LEVEL
+#endif
+        {"baseline", true, interp_baseline},
+};
+
+const uint32_t isa_nlevels = sizeof(isa_levels) / sizeof(isa_levels[0]);
+
+// why the level was chosen, for the report
+static const char *reason;
+
+static const struct isa_level *choose() {
+    const char *cap = getenv("VM_ISA");
+    uint32_t first = 0;
+    reason = "the best the host supports";
+    if (cap && *cap) {
+        reason = "VM_ISA is not a level, the best the host supports";
+        for (uint32_t i = 0; i < isa_nlevels; i++) {
+            if (!strcmp(cap, isa_levels[i].name)) {
+                first = i;
+                reason = isa_levels[i].supported ? "VM_ISA" : "VM_ISA is not supported, the best the host supports";
+                break;
+            }
+        }
+    }
+    // the baseline is always supported
+    for (uint32_t i = first; i < isa_nlevels; i++) {
+        if (isa_levels[i].supported) {
+            return &isa_levels[i];
+        }
+    }
+    return &isa_levels[isa_nlevels - 1];
+}
+
+// chosen at startup, after isa_levels (same translation unit, initialized in order)
+static const struct isa_level *selected = choose();
+
+const struct isa_level *isa_selected() {
+    return selected;
+}
+
+int isa_interp(struct state *st) {
+    return selected->interp(st);
+}
+
+void isa_report(FILE *f) {
+    fprintf(f, "isa: %s (%s), host supports", selected->name, reason);
+    for (uint32_t i = 0; i < isa_nlevels; i++) {
+        if (isa_levels[i].supported) {
+            fprintf(f, " %s", isa_levels[i].name);
+        }
+    }
+    fputc('\n', f);
+}
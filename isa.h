@@ -0,0 +1,54 @@
+#ifndef ISA_H
+#define ISA_H
+
+#include <cstdint>
+#include <cstdio>
+
+#include "vm.h"
+
+// --------------------------------------------------
+// ISA DISPATCH
+// --------------------------------------------------
+//
+// One binary for hosts of different x86-64 instruction set extensions: the interpreter is compiled
+// once for each ISA level below (with the target attribute, so the rest of the binary stays at the
+// baseline of the build), and the best level the host supports is chosen from CPUID once at startup.
+// VM_ISA in the environment caps the level by name, a level above what the host supports falls back
+// to the best one it does support. On other hosts there is only the baseline.
+//
+// The handlers of vm.h are inlined into each level and compiled with its instructions: BMI2 shifts,
+// VEX encoded SIMD for the vector handlers. Their 16 byte lanes already fit SSE2, so the levels
+// matter for now mostly to the scalar handlers, and are the place for wider kernels to go.
+
+// name, target attribute, whether the host supports it (CPU(feature) as __builtin_cpu_supports); best
+// first
+#define ISA_LEVELS(X)                                                                              \
+    X(avx512, "avx512f,avx512bw,avx512vl,avx2,bmi,bmi2,popcnt",                                    \
+      CPU("avx512f") && CPU("avx512bw") && CPU("avx512vl") && CPU("avx2") && CPU("bmi") &&         \
+      CPU("bmi2") && CPU("popcnt"))                                                                \
+    X(avx2, "avx2,bmi,bmi2,popcnt", CPU("avx2") && CPU("bmi") && CPU("bmi2") && CPU("popcnt"))     \
+    X(sse42, "sse4.2,popcnt", CPU("sse4.2") && CPU("popcnt"))
+
+typedef int (*isa_interp_fn)(struct state *st);
+
+struct isa_level {
+    const char *name;
+    bool supported; // by the host
+    isa_interp_fn interp;
+};
+
+// the levels of ISA_LEVELS, then the baseline
+extern const struct isa_level isa_levels[];
+extern const uint32_t isa_nlevels;
+
+// the level chosen at startup
+const struct isa_level *isa_selected();
+
+// Run from st->pc in the interpreter of the selected level, returns VM_HALT or VM_ILLEGAL. Like
+// interp in vm.cpp, the code must not run past its end.
+int isa_interp(struct state *st);
+
+// the selected level, what the host supports and why the level was chosen, one line
+void isa_report(FILE *f);
+
+#endif
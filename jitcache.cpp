@@ -0,0 +1,190 @@
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "cogen.h"
+#include "jitcache.h"
+
+// the compiler run on a miss, overridden by the VM_CXX environment variable
+#ifndef VM_CXX
+#define VM_CXX "c++"
+#endif
+
+// where vm.h is found by the compiler
+#ifndef VM_INCLUDE_DIR
+#define VM_INCLUDE_DIR "."
+#endif
+
+#define ENTRY "vm_run"
+
+static const char *compiler() {
+    const char *cxx = getenv("VM_CXX");
+    return cxx && *cxx ? cxx : VM_CXX;
+}
+
+// identifies the compiler binary: its resolved path, size and modification time
+static uint64_t compiler_id(const char *cxx) {
+    char path[4096];
+    struct stat sb = {};
+    bool found = false;
+    if (strchr(cxx, '/')) {
+        snprintf(path, sizeof(path), "%s", cxx);
+        found = !stat(path, &sb);
+    } else if (const char *env = getenv("PATH")) {
+        for (const char *dir = env; !found; dir++) {
+            const char *end = strchrnul(dir, ':');
+            snprintf(path, sizeof(path), "%.*s/%s", (int) (end - dir), dir, cxx);
+            found = !stat(path, &sb) && S_ISREG(sb.st_mode);
+            if (!*end) {
+                break;
+            }
+            dir = end;
+        }
+    }
+    uint64_t h = hash64((const uint8_t *) cxx, strlen(cxx));
+    if (found) {
+        char real[4096];
+        if (realpath(path, real)) {
+            h = hash64((const uint8_t *) real, strlen(real), h);
+        }
+        h = hash64((const uint8_t *) &sb.st_size, sizeof(sb.st_size), h);
+        h = hash64((const uint8_t *) &sb.st_mtim, sizeof(sb.st_mtim), h);
+    }
+    return h;
+}
+
+// identifies what the object is compiled against: the text of the vm.h it includes (the helpers
+// the handlers call, struct state), and the layout of struct state in this process
+static uint64_t header_id() {
+    const size_t layout[] = {sizeof(struct state), offsetof(struct state, regfile), offsetof(struct state, vregfile),
+                             offsetof(struct state, flags), offsetof(struct state, pc),
+                             offsetof(struct state, data), offsetof(struct state, code)};
+    uint64_t h = hash64((const uint8_t *) layout, sizeof(layout));
+    FILE *f = fopen(VM_INCLUDE_DIR "/vm.h", "rb");
+    if (f) {
+        uint8_t buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+            h = hash64(buf, n, h);
+        }
+        fclose(f);
+    }
+    return h;
+}
+
+static void object_path(char *path, size_t size, const char *dir, const uint8_t *code, uint32_t len) {
+    snprintf(path, size, "%s/%016llx-%016llx-%016llx-%016llx.so", dir,
+             (unsigned long long) cogen_version(),
+             (unsigned long long) header_id(),
+             (unsigned long long) compiler_id(compiler()),
+             (unsigned long long) hash64(code, len));
+}
+
+// Only a directory of this user alone is used: dlopen runs the constructors of an object before
+// it can be checked, so anyone else who could write to it could run code in this process.
+static bool private_dir(const char *dir) {
+    struct stat sb;
+    return !lstat(dir, &sb) && S_ISDIR(sb.st_mode) && sb.st_uid == getuid() && (sb.st_mode & 0777) == 0700;
+}
+
+// dlopen the object and check that it was compiled from code, not just a colliding hash
+static vm_entry open_object(const char *path, const uint8_t *code, uint32_t len) {
+    void *lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!lib) {
+        return nullptr;
+    }
+    vm_entry entry = (vm_entry) dlsym(lib, ENTRY);
+    const uint8_t *lib_code = (const uint8_t *) dlsym(lib, ENTRY "_code");
+    const uint32_t *lib_len = (const uint32_t *) dlsym(lib, ENTRY "_code_len");
+    if (!entry || !lib_code || !lib_len || *lib_len != len || memcmp(lib_code, code, len)) {
+        dlclose(lib);
+        return nullptr;
+    }
+    return entry;
+}
+
+static bool run(const char *const argv[]) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+    if (pid == 0) {
+        execvp(argv[0], (char *const *) argv);
+        _exit(127);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// compile code to path, under a temporary name that is renamed into place
+static bool compile(const char *path, const uint8_t *code, uint32_t len) {
+    char source[4096 + 64], object[4096 + 64];
+    snprintf(source, sizeof(source), "%s.%d.cpp", path, (int) getpid());
+    snprintf(object, sizeof(object), "%s.%d.tmp", path, (int) getpid());
+    FILE *out = fopen(source, "w");
+    if (!out) {
+        return false;
+    }
+    cogen(out, "the specialization cache", ENTRY, code, len);
+    bool ok = !fclose(out);
+    const char *argv[] = {compiler(), "-O2", "-std=c++20", "-shared", "-fPIC", "-I", VM_INCLUDE_DIR,
+                          "-o", object, source, nullptr};
+    ok = ok && run(argv) && !rename(object, path);
+    unlink(source);
+    unlink(object);
+    return ok;
+}
+
+vm_entry jit_lookup(const char *dir, const uint8_t *code, uint32_t len) {
+    if (!private_dir(dir)) {
+        return nullptr;
+    }
+    char path[4096];
+    object_path(path, sizeof(path), dir, code, len);
+    return open_object(path, code, len);
+}
+
+vm_entry jit_load(const char *dir, const uint8_t *code, uint32_t len) {
+    mkdir(dir, 0700);
+    if (!private_dir(dir)) {
+        return nullptr;
+    }
+    char path[4096];
+    object_path(path, sizeof(path), dir, code, len);
+    if (vm_entry entry = open_object(path, code, len)) {
+        return entry;
+    }
+
+    // one process compiles, the others wait for it and then find the object
+    char lock[4096 + 8];
+    snprintf(lock, sizeof(lock), "%s.lock", path);
+    int fd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return nullptr;
+    }
+    vm_entry entry = nullptr;
+    if (!flock(fd, LOCK_EX)) {
+        entry = open_object(path, code, len);
+        if (!entry && compile(path, code, len)) {
+            entry = open_object(path, code, len);
+        }
+    }
+    // the lock file is left behind, removing it would race with a process about to lock it
+    close(fd);
+    return entry;
+}
@@ -0,0 +1,29 @@
+#ifndef JITCACHE_H
+#define JITCACHE_H
+
+#include <cstdint>
+
+#include "vm.h"
+
+// --------------------------------------------------
+// SPECIALIZATION CACHE
+// --------------------------------------------------
+//
+// Residual programs from cogen, compiled to shared objects and kept in a directory across runs.
+// An object is named after everything its code depends on, the bytecode, the cogen version (the
+// handlers), the vm.h it is compiled against and the compiler, so a stale object is never loaded,
+// it is just not found. The directory must be of this user only, with mode 0700, or it is not used. Objects
+// are compiled to a temporary name and renamed into place, so a reader sees either no object or
+// a complete one, and a lock file keeps concurrent misses from compiling the same program twice.
+
+// runs from st->pc, returns VM_HALT, VM_ILLEGAL or VM_BAD_PC
+typedef int (*vm_entry)(struct state *st);
+
+// The compiled program for code, from the cache in dir (created if missing), or compiled into it
+// on a miss. Returns nullptr if it can't be compiled or loaded, or dir is not private. The object stays loaded for the life of the process.
+vm_entry jit_load(const char *dir, const uint8_t *code, uint32_t len);
+
+// Only look the program up, nullptr on a miss.
+vm_entry jit_lookup(const char *dir, const uint8_t *code, uint32_t len);
+
+#endif
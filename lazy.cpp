@@ -0,0 +1,99 @@
+#include <cstdlib>
+
+#include <sys/mman.h>
+
+#include "lazy.h"
+
+// --------------------------------------------------
+// DECODING
+// --------------------------------------------------
+
+// decode the block from pc, up to the first control transfer or an instruction decoded before
+static void decode_block(struct lazy_program *prog, uint32_t pc) {
+    prog->blocks++;
+    while (pc < prog->len && !prog->insns[pc].len) {
+        struct vm_insn *in = &prog->insns[pc];
+        decode_insn(prog->code, prog->len, pc, in);
+        prog->decoded++;
+        if (!in->opcode || in->opcode == 'B' || in->opcode == 'J' || in->opcode == 'H') {
+            break;
+        }
+        pc += in->len;
+    }
+}
+
+static size_t table_size(uint32_t len) {
+    return (len ? len : 1) * sizeof(struct vm_insn);
+}
+
+struct lazy_program *lazy_open(const uint8_t *code, uint32_t len) {
+    struct lazy_program *prog = (struct lazy_program *) calloc(1, sizeof(struct lazy_program));
+    prog->code = code;
+    prog->len = len;
+    // (not calloc, which clears memory it reuses from the heap: all of it, as large as the program)
+    void *p = mmap(nullptr, table_size(len), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        free(prog);
+        return nullptr;
+    }
+    prog->insns = (struct vm_insn *) p;
+    return prog;
+}
+
+void lazy_free(struct lazy_program *prog) {
+    munmap(prog->insns, table_size(prog->len));
+    free(prog);
+}
+
+// --------------------------------------------------
+// VM INTERPRETER
+// runs the decoded instructions, decoding them on first execution
+// --------------------------------------------------
+
+#define OP1 (in->op1)
+#define OP2 (in->op2)
+#define OFF (in->off)
+
+int lazy_run(struct lazy_program *prog, struct state *st) {
+    const struct vm_insn *insns = prog->insns;
+    while (1) {
+        uint32_t pc = st->pc;
+        if (pc >= prog->len) {
+            return VM_BAD_PC;
+        }
+        const struct vm_insn *in = &insns[pc];
+        if (__builtin_expect(!in->len, 0)) {
+            decode_block(prog, pc);
+        }
+        switch (in->opcode) {
+#define INSN(op, len, handler) \
+            case op:           \
+                handler;       \
+                st->pc += len; \
+                break;
+            VM_INSNS(INSN)
+#undef INSN
+#define JUMP(op, len, handler) \
+            case op:           \
+                handler;       \
+                break;
+            VM_JUMPS(JUMP)
+#undef JUMP
+            case 'B':
+                switch (in->op1) {
+#define BRANCH(cc, handler) \
+                    case cc:        \
+                        handler;    \
+                        break;
+                    VM_BRANCHES(BRANCH)
+#undef BRANCH
+                }
+                st->pc += 6;
+                break;
+            case 'H':
+                return VM_HALT;
+            default:
+                return VM_ILLEGAL;
+        }
+    }
+}
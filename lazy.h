@@ -0,0 +1,40 @@
+#ifndef LAZY_H
+#define LAZY_H
+
+#include <cstdint>
+
+#include "vm.h"
+
+// --------------------------------------------------
+// LAZY DECODING
+// --------------------------------------------------
+//
+// An interpreter over decoded instructions, each decoded the first time the pc reaches it. The
+// instructions are decoded into a table by pc, as in super.cpp, but the table starts empty. It is an
+// anonymous mapping, whose zero pages are only mapped on first touch, so opening a program costs
+// the same at any size. When the pc reaches an instruction that is not decoded yet, the rest of its
+// basic block is decoded with it, up to the first control transfer or an instruction decoded
+// before, since all of it will run. Code that never runs is never decoded.
+//
+// Otherwise it runs like interp in vm.cpp. The pc may land anywhere, including the middle of
+// another instruction, whose bytes are then decoded at that pc in their own right. An illegal
+// instruction is an error only when it is reached. The code is read in place, not copied, and must
+// not change while the program is open.
+
+struct lazy_program {
+    const uint8_t *code;
+    uint32_t len;
+    struct vm_insn *insns; // by pc, of length 0 until decoded
+    uint64_t decoded; // instructions decoded so far
+    uint64_t blocks; // decoded so far
+};
+
+// nullptr if the table could not be mapped
+struct lazy_program *lazy_open(const uint8_t *code, uint32_t len);
+
+void lazy_free(struct lazy_program *prog);
+
+// Run from st->pc, returns VM_HALT, VM_ILLEGAL or VM_BAD_PC.
+int lazy_run(struct lazy_program *prog, struct state *st);
+
+#endif
@@ -0,0 +1,272 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "bytecode.h"
+#include "profile.h"
+#include "super.h"
+
+// --------------------------------------------------
+// SUPERINSTRUCTION MINING
+// --------------------------------------------------
+//
+// usage: mine.out [-k count] > super.gen.h
+//        -k the number of superinstructions (default MINE_SUPERS, at most 0x80)
+//
+// Runs every program of the corpus through the instrumented interpreter (profile.cpp) and mines
+// the straight-line instruction sequences of 2 to SUPER_MAX_INSNS instructions, only the last of
+// which may be a branch or an indirect jump, that would save the most dispatches as one
+// superinstruction. A sequence starting at pc saves (its length - 1) dispatches each time pc runs.
+// They are picked greedily: each pick covers the pcs of its occurrences, and later picks are only
+// credited with occurrences that do not overlap covered pcs, so a sequence nested in a better one
+// is not picked for the same dispatches twice. The output defines VM_SUPERS for super.cpp.
+
+#define MINE_SUPERS 16
+
+struct corpus_program {
+    const char *name;
+    const uint8_t *code;
+    uint32_t len;
+    uint32_t input; // r0
+    const uint8_t *data; // the initial data segment, from data[0]
+    uint32_t data_len;
+};
+
+// the programs of bytecode.h, except pxorshift whose threads only run in thread.cpp
+static const corpus_program corpus[] = {
+        {"fib",        fib,        sizeof(fib) - 1,        30,   nullptr, 0},
+        {"vmvm",       vmvm,       sizeof(vmvm) - 1,       20,   fib,     sizeof(fib) - 1},
+        {"vsum",       vsum,       sizeof(vsum) - 1,       3,    nullptr, 0},
+        {"vcopy",      vcopy,      sizeof(vcopy) - 1,      3,    nullptr, 0},
+        {"vxform",     vxform,     sizeof(vxform) - 1,     3,    nullptr, 0},
+        {"simd_sum",   simd_sum,   sizeof(simd_sum) - 1,   3,    nullptr, 0},
+        {"simd_xform", simd_xform, sizeof(simd_xform) - 1, 3,    nullptr, 0},
+        {"simd_count", simd_count, sizeof(simd_count) - 1, 3,    nullptr, 0},
+        {"jstates",    jstates,    sizeof(jstates) - 1,    1000, nullptr, 0},
+        {"xorshift",   xorshift,   sizeof(xorshift) - 1,   1000, nullptr, 0},
+};
+
+#define NPROGRAMS (sizeof(corpus) / sizeof(corpus[0]))
+
+// an instruction of a sequence, as in VM_SUPERS: the opcode, or 'B' | cc << 8
+static uint16_t insn_at(const uint8_t *code, uint32_t pc) {
+    return code[pc] == 'B' ? 'B' | code[pc + 1] << 8 : code[pc];
+}
+
+struct candidate {
+    uint16_t insns[SUPER_MAX_INSNS]; // 0 past the end
+    uint32_t n;
+    uint64_t saved;
+};
+
+struct profiled {
+    const corpus_program *prog;
+    uint64_t *count;
+    bool *covered;
+};
+
+// the pcs of the n instructions from pc, false unless they all ran and only the last may transfer
+// control (and none halts)
+static bool sequence(const struct profiled *p, uint32_t pc, uint32_t n, uint32_t *pcs) {
+    const corpus_program *prog = p->prog;
+    for (uint32_t i = 0; i < n; i++) {
+        if (pc >= prog->len || !p->count[pc]) {
+            return false;
+        }
+        uint8_t opcode = prog->code[pc];
+        uint32_t len = insn_length(opcode);
+        if (len == 0 || pc + len > prog->len || opcode == 'H' || (i + 1 < n && (opcode == 'B' || opcode == 'J'))) {
+            return false;
+        }
+        pcs[i] = pc;
+        pc += len;
+    }
+    return true;
+}
+
+static bool covered(const struct profiled *p, const uint32_t *pcs, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        if (p->covered[pcs[i]]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool same(const struct candidate *c, const uint8_t *code, const uint32_t *pcs, uint32_t n) {
+    if (c->n != n) {
+        return false;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        if (c->insns[i] != insn_at(code, pcs[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the candidates credited with their occurrences on uncovered pcs, into cands (of capacity cap)
+static uint32_t collect(const struct profiled *ps, struct candidate *cands, uint32_t cap) {
+    uint32_t ncands = 0;
+    for (uint32_t i = 0; i < NPROGRAMS; i++) {
+        const struct profiled *p = &ps[i];
+        for (uint32_t pc = 0; pc < p->prog->len; pc++) {
+            uint32_t pcs[SUPER_MAX_INSNS];
+            for (uint32_t n = 2; n <= SUPER_MAX_INSNS; n++) {
+                if (!sequence(p, pc, n, pcs) || covered(p, pcs, n)) {
+                    continue;
+                }
+                uint32_t c = 0;
+                while (c < ncands && !same(&cands[c], p->prog->code, pcs, n)) {
+                    c++;
+                }
+                if (c == ncands) {
+                    if (ncands == cap) {
+                        continue;
+                    }
+                    cands[ncands] = {};
+                    cands[ncands].n = n;
+                    for (uint32_t k = 0; k < n; k++) {
+                        cands[ncands].insns[k] = insn_at(p->prog->code, pcs[k]);
+                    }
+                    ncands++;
+                }
+                cands[c].saved += p->count[pc] * (n - 1);
+            }
+        }
+    }
+    return ncands;
+}
+
+// cover the occurrences of c, first come first served where they overlap each other
+static void cover(struct profiled *ps, const struct candidate *c) {
+    for (uint32_t i = 0; i < NPROGRAMS; i++) {
+        struct profiled *p = &ps[i];
+        for (uint32_t pc = 0; pc < p->prog->len; pc++) {
+            uint32_t pcs[SUPER_MAX_INSNS];
+            if (!sequence(p, pc, c->n, pcs) || covered(p, pcs, c->n) || !same(c, p->prog->code, pcs, c->n)) {
+                continue;
+            }
+            for (uint32_t k = 0; k < c->n; k++) {
+                p->covered[pcs[k]] = true;
+            }
+        }
+    }
+}
+
+static void print_insn(FILE *out, uint16_t insn) {
+    if ((insn & 0xff) == 'B') {
+        fprintf(out, "('B' | '%c' << 8)", insn >> 8);
+    } else if (insn) {
+        fprintf(out, "'%c'", insn);
+    } else {
+        fprintf(out, "0");
+    }
+}
+
+static void usage() {
+    puts("usage: mine.out [-k count]");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    uint32_t k = MINE_SUPERS;
+    if (argc == 3 && !strcmp(argv[1], "-k")) {
+        k = strtoul(argv[2], NULL, 10);
+    } else if (argc != 1) {
+        usage();
+    }
+    if (k > 0x100 - SUPER_OPCODE) {
+        usage();
+    }
+
+    struct profiled ps[NPROGRAMS];
+    uint64_t dispatches = 0;
+    for (uint32_t i = 0; i < NPROGRAMS; i++) {
+        const corpus_program *prog = &corpus[i];
+        static uint8_t data[0x100];
+        memset(data, 0, sizeof(data));
+        // (data[-0x80..0x7f], the range of a register pointer)
+        memcpy(data + 0x80, prog->data, prog->data_len);
+        struct state st = {};
+        st.data = data + 0x80;
+        st.regfile[0] = prog->input;
+        struct branch_profile bp;
+        bp_init(&bp, prog->len);
+        if (profile_run(prog->code, prog->len, &st, nullptr, 0, &bp) != VM_HALT) {
+            fprintf(stderr, "%s did not halt\n", prog->name);
+            exit(1);
+        }
+        ps[i] = {prog, bp.count, (bool *) calloc(prog->len, sizeof(bool))};
+        bp.count = nullptr;
+        bp_free(&bp);
+        for (uint32_t pc = 0; pc < prog->len; pc++) {
+            dispatches += ps[i].count[pc];
+        }
+    }
+
+    // (every sequence of every program fits)
+    uint32_t cap = 0;
+    for (uint32_t i = 0; i < NPROGRAMS; i++) {
+        cap += corpus[i].len * (SUPER_MAX_INSNS - 1);
+    }
+    struct candidate *cands = (struct candidate *) calloc(cap, sizeof(struct candidate));
+    struct candidate *picked = (struct candidate *) calloc(k ? k : 1, sizeof(struct candidate));
+    uint32_t npicked = 0;
+    uint64_t saved = 0;
+    while (npicked < k) {
+        uint32_t ncands = collect(ps, cands, cap);
+        struct candidate *best = nullptr;
+        for (uint32_t c = 0; c < ncands; c++) {
+            if (!best || cands[c].saved > best->saved) {
+                best = &cands[c];
+            }
+        }
+        if (!best) {
+            break;
+        }
+        picked[npicked++] = *best;
+        saved += best->saved;
+        cover(ps, best);
+    }
+
+    printf("// generated by mine.out from the execution counts of");
+    for (uint32_t i = 0; i < NPROGRAMS; i++) {
+        printf(" %s(%u)", corpus[i].name, corpus[i].input);
+    }
+    printf(", do not edit\n//\n");
+    for (uint32_t s = 0; s < npicked; s++) {
+        printf("// 0x%02x ", SUPER_OPCODE + s);
+        for (uint32_t i = 0; i < picked[s].n; i++) {
+            uint16_t insn = picked[s].insns[i];
+            if ((insn & 0xff) == 'B') {
+                printf(" B%c", insn >> 8);
+            } else {
+                printf(" %c ", insn);
+            }
+        }
+        printf("%*s %llu dispatches saved\n", 3 * (SUPER_MAX_INSNS - picked[s].n), "",
+               (unsigned long long) picked[s].saved);
+    }
+    printf("//\n// %llu instructions in %llu dispatches, %.2f instructions per dispatch\n\n",
+           (unsigned long long) dispatches, (unsigned long long) (dispatches - saved),
+           (double) dispatches / (dispatches - saved));
+    printf("#define VM_SUPERS(X) \\\n");
+    for (uint32_t s = 0; s < npicked; s++) {
+        printf("    X(0x%02x", SUPER_OPCODE + s);
+        for (uint32_t i = 0; i < SUPER_MAX_INSNS; i++) {
+            printf(", ");
+            print_insn(stdout, picked[s].insns[i]);
+        }
+        printf(") \\\n");
+    }
+    printf("\n");
+
+    for (uint32_t i = 0; i < NPROGRAMS; i++) {
+        free(ps[i].count);
+        free(ps[i].covered);
+    }
+    free(cands);
+    free(picked);
+}
@@ -0,0 +1,680 @@
+#ifndef PE_H
+#define PE_H
+
+#include <cstdint>
+
+#include "vm.h"
+
+// --------------------------------------------------
+// BYTECODE PARTIAL EVALUATOR
+// --------------------------------------------------
+//
+// Specializes VM bytecode with respect to a static, read-only prefix of its data segment and
+// (optionally) known register values, producing residual bytecode for the same instruction set.
+//
+// This is the first Futamura projection done at the bytecode level instead of by the C++
+// compiler. When the bytecode is itself an interpreter (see `vmvm`) and the static data is the
+// program it interprets, the residual bytecode no longer contains the inner dispatch loop, and
+// can be fed to the SPEC levels of `interp` to remove the outer one as well.
+//
+// Everything is constexpr so the specialization happens while compiling vm.cpp.
+//
+// The evaluation is online and polyvariant: every register is either known (static) or unknown
+// (dynamic). Instructions on known values are executed by the handlers in vm.h and leave no
+// residual code, everything else is emitted (vector registers are always unknown). Each residual
+// label is a (pc, knowledge) pair; knowledge of registers that are dead at the pc is dropped so
+// that labels are shared, and a pc that is specialized more than PE_MAX_VARIANTS times is
+// generalized to unknown registers.
+
+#define PE_MAX_CODE 1024
+#define PE_MAX_LABELS 512
+#define PE_MAX_FIXUPS 512
+#define PE_MAX_VARIANTS 64
+#define PE_MAX_IMAGE 0x80
+
+// liveness bit for the flags, after the bits of r0 ... r15
+#define PE_FLAGS (1u << NUM_REGS)
+#define PE_NONE 0xffffffffu
+
+struct pe_value {
+    bool known;
+    uint32_t val;
+};
+
+struct pe_state {
+    pe_value regs[NUM_REGS];
+    pe_value flags;
+};
+
+struct pe_result {
+    uint8_t code[PE_MAX_CODE];
+    uint32_t len;
+    const char *error; // nullptr on success
+};
+
+struct pe_label {
+    uint32_t pc;
+    pe_state st;
+    uint32_t out; // offset of the residual code, PE_NONE while pending
+};
+
+constexpr bool pe_same(const pe_state &a, const pe_state &b) {
+    for (int i = 0; i < NUM_REGS; i++) {
+        if (a.regs[i].known != b.regs[i].known || a.regs[i].val != b.regs[i].val) {
+            return false;
+        }
+    }
+    return a.flags.known == b.flags.known && a.flags.val == b.flags.val;
+}
+
+// registers read (use) and written (def) by the instruction at pc, as liveness bits
+constexpr void pe_usedef(const uint8_t *code, uint32_t pc, uint32_t halt_live, uint32_t &use, uint32_t &def) {
+    if (insn_length(code[pc]) == 1) {
+        use = code[pc] == 'H' ? halt_live : 0;
+        def = 0;
+        return;
+    }
+    uint8_t op1 = code[pc + 1];
+    uint8_t op2 = insn_length(code[pc]) > 2 ? code[pc + 2] : 0;
+    use = 0;
+    def = 0;
+    if (insn_length(code[pc]) == 2 && op1 >= NUM_REGS) {
+        return;
+    }
+    if (insn_length(code[pc]) == 3 && (op1 >= NUM_REGS || (op2 >= NUM_REGS && code[pc] != 'I'))) {
+        // illegal, traps
+        return;
+    }
+    switch (code[pc]) {
+        case 'S':
+            use = (1u << op1) | (1u << op2);
+            break;
+        case 'L':
+            use = 1u << op1;
+            def = 1u << op2;
+            break;
+        case 'A':
+        case 'U':
+        case '&':
+        case '|':
+        case '^':
+        case '<':
+        case '>':
+        case '*':
+            use = (1u << op1) | (1u << op2);
+            def = (1u << op1) | PE_FLAGS;
+            break;
+        case 'M':
+            use = 1u << op2;
+            def = 1u << op1;
+            break;
+        case 'I':
+            def = 1u << op1;
+            break;
+        case 'B':
+            use = PE_FLAGS;
+            break;
+        case 'J':
+            use = 1u << op1;
+            break;
+        case 'V':
+        case 'W':
+            use = 1u << op1;
+            break;
+        case 'D':
+            use = 1u << op2;
+            break;
+        case 'R':
+            def = (1u << op1) | PE_FLAGS;
+            break;
+        case 'K':
+            use = 1u << op1;
+            def = 1u << op2;
+            break;
+        case 'P':
+            use = (1u << op1) | (1u << op2);
+            break;
+        case 'C':
+            use = (1u << op1) | (1u << op2) | 1u;
+            def = 1u | PE_FLAGS;
+            break;
+    }
+}
+
+// run the arithmetic instruction `opcode op1, op2` on known values
+constexpr void pe_alu(struct state *st, uint8_t opcode, uint8_t op1, uint8_t op2) {
+    switch (opcode) {
+        case 'A':
+            add(st, op1, op2);
+            break;
+        case 'U':
+            sub(st, op1, op2);
+            break;
+        case '&':
+            band(st, op1, op2);
+            break;
+        case '|':
+            bor(st, op1, op2);
+            break;
+        case '^':
+            bxor(st, op1, op2);
+            break;
+        case '<':
+            shl(st, op1, op2);
+            break;
+        case '>':
+            shr(st, op1, op2);
+            break;
+        case '*':
+            mul(st, op1, op2);
+            break;
+    }
+}
+
+struct pe_specializer {
+    const uint8_t *code;
+    uint32_t len;
+    uint8_t image[PE_MAX_IMAGE];
+    uint32_t image_len;
+    uint32_t halt_live;
+
+    uint32_t live[PE_MAX_CODE]; // live-in registers, per instruction
+    bool memo[PE_MAX_CODE]; // branch targets, where labels are looked up
+
+    pe_label labels[PE_MAX_LABELS];
+    uint32_t nlabels;
+    uint32_t fixups[PE_MAX_FIXUPS][2]; // residual branch offset, label
+    uint32_t nfixups;
+
+    // knowledge while specializing a block, and whether a known register also holds its value in
+    // the residual code (it only has to once the value is needed by a residual instruction)
+    pe_state cur;
+    bool mat[NUM_REGS];
+
+    pe_result res;
+
+    constexpr void fail(const char *msg) {
+        if (!res.error) {
+            res.error = msg;
+        }
+    }
+
+    constexpr void emit(uint8_t byte) {
+        if (res.len >= PE_MAX_CODE) {
+            fail("residual code too large");
+            return;
+        }
+        res.code[res.len++] = byte;
+    }
+
+    constexpr void emit3(uint8_t opcode, uint8_t op1, uint8_t op2) {
+        emit(opcode);
+        emit(op1);
+        emit(op2);
+    }
+
+    constexpr void emit_branch(uint8_t cc, uint32_t label) {
+        if (nfixups >= PE_MAX_FIXUPS) {
+            fail("too many residual branches");
+            return;
+        }
+        fixups[nfixups][0] = res.len;
+        fixups[nfixups][1] = label;
+        nfixups++;
+        emit('B');
+        emit(cc);
+        for (int i = 0; i < 4; i++) {
+            emit(0);
+        }
+    }
+
+    // ----------------------------------------------
+
+    constexpr void analyze() {
+        for (uint32_t pc = 0; pc < len; pc++) {
+            live[pc] = 0;
+            memo[pc] = false;
+        }
+        for (uint32_t pc = 0; pc < len;) {
+            uint32_t n = insn_length(code[pc]);
+            if (n == 0) {
+                // illegal instructions are skipped byte by byte
+                pc++;
+                continue;
+            }
+            if (pc + n > len) {
+                break;
+            }
+            if (code[pc] == 'B') {
+                uint32_t target = pc + 6 + read32(&code[pc + 2]);
+                if (target < len) {
+                    memo[target] = true;
+                }
+            }
+            pc += n;
+        }
+        // backwards liveness, iterated to a fixed point
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (uint32_t pc = 0; pc < len;) {
+                uint32_t n = insn_length(code[pc]);
+                if (n == 0) {
+                    pc++;
+                    continue;
+                }
+                if (pc + n > len) {
+                    break;
+                }
+                uint32_t out = 0;
+                if (code[pc] == 'B') {
+                    uint32_t target = pc + 6 + read32(&code[pc + 2]);
+                    out |= target < len ? live[target] : ~0u;
+                }
+                if (code[pc] == 'J') {
+                    // any instruction may be the target
+                    out = ~0u;
+                } else if (code[pc] != 'H') {
+                    out |= pc + n < len ? live[pc + n] : 0;
+                }
+                uint32_t use = 0;
+                uint32_t def = 0;
+                pe_usedef(code, pc, halt_live, use, def);
+                uint32_t in = use | (out & ~def);
+                if (in != live[pc]) {
+                    live[pc] = in;
+                    changed = true;
+                }
+                pc += n;
+            }
+        }
+    }
+
+    // ----------------------------------------------
+
+    constexpr bool flags_clobberable(uint32_t pc) {
+        return cur.flags.known || !(live[pc] & PE_FLAGS);
+    }
+
+    // emit code so that the residual register r holds its known value
+    constexpr void materialize(uint8_t r, uint32_t pc) {
+        if (!cur.regs[r].known || mat[r]) {
+            return;
+        }
+        uint32_t val = cur.regs[r].val;
+        mat[r] = true;
+        if (val <= 0xff) {
+            emit3('I', r, val);
+            return;
+        }
+        // larger constants are built with A/U, which needs a scratch register and clobbers the flags.
+        // any other known register will do, its residual value is dead
+        int scratch = -1;
+        for (int i = 0; i < NUM_REGS; i++) {
+            if (i != r && cur.regs[i].known && !mat[i]) {
+                scratch = i;
+            }
+        }
+        if (scratch < 0 || !flags_clobberable(pc)) {
+            fail("cannot materialize a constant wider than 8 bits");
+            return;
+        }
+        if (-val <= 0xff) {
+            emit3('I', r, 0);
+            emit3('I', scratch, -val);
+            emit3('U', r, scratch);
+            return;
+        }
+        emit3('I', r, val >> 24);
+        for (int shift = 16; shift >= 0; shift -= 8) {
+            for (int i = 0; i < 8; i++) {
+                emit3('A', r, r);
+            }
+            emit3('I', scratch, (val >> shift) & 0xff);
+            emit3('A', r, scratch);
+        }
+    }
+
+    // loads and stores only use the low byte of a register
+    constexpr void materialize_low(uint8_t r) {
+        if (!cur.regs[r].known || mat[r]) {
+            return;
+        }
+        emit3('I', r, cur.regs[r].val & 0xff);
+        mat[r] = cur.regs[r].val <= 0xff;
+    }
+
+    constexpr void set_known(uint8_t r, uint32_t val) {
+        cur.regs[r] = {true, val};
+        mat[r] = false;
+    }
+
+    constexpr void set_unknown(uint8_t r) {
+        cur.regs[r] = {false, 0};
+    }
+
+    // ----------------------------------------------
+
+    // knowledge at a label: drop dead registers, and generalize once the pc has too many variants
+    constexpr pe_state label_state(uint32_t pc, uint32_t from) {
+        pe_state st = cur;
+        for (int i = 0; i < NUM_REGS; i++) {
+            if (!(live[pc] & (1u << i))) {
+                st.regs[i] = {false, 0};
+            }
+        }
+        if (!(live[pc] & PE_FLAGS)) {
+            st.flags = {false, 0};
+        }
+        uint32_t variants = 0;
+        for (uint32_t i = 0; i < nlabels; i++) {
+            if (labels[i].pc == pc) {
+                if (pe_same(labels[i].st, st)) {
+                    return st;
+                }
+                variants++;
+            }
+        }
+        if (variants >= PE_MAX_VARIANTS) {
+            for (int i = 0; i < NUM_REGS; i++) {
+                if (st.regs[i].known) {
+                    materialize(i, from);
+                    st.regs[i] = {false, 0};
+                }
+            }
+        }
+        return st;
+    }
+
+    constexpr uint32_t label(uint32_t pc, const pe_state &st) {
+        for (uint32_t i = 0; i < nlabels; i++) {
+            if (labels[i].pc == pc && pe_same(labels[i].st, st)) {
+                return i;
+            }
+        }
+        if (nlabels >= PE_MAX_LABELS) {
+            fail("too many residual labels");
+            return 0;
+        }
+        labels[nlabels] = {pc, st, PE_NONE};
+        return nlabels++;
+    }
+
+    // start emitting the code of a pending label at the current residual offset
+    constexpr uint32_t enter(uint32_t l) {
+        labels[l].out = res.len;
+        cur = labels[l].st;
+        for (int i = 0; i < NUM_REGS; i++) {
+            mat[i] = false;
+        }
+        return labels[l].pc;
+    }
+
+    constexpr void block(uint32_t l) {
+        uint32_t pc = enter(l);
+        bool first = true;
+        while (!res.error) {
+            if (!first && pc < len && memo[pc]) {
+                uint32_t next = label(pc, label_state(pc, pc));
+                if (labels[next].out == PE_NONE) {
+                    pc = enter(next);
+                } else {
+                    // there is no unconditional jump
+                    emit_branch('E', next);
+                    emit_branch('N', next);
+                    return;
+                }
+            }
+            first = false;
+
+            uint32_t n = pc < len ? insn_length(code[pc]) : 0;
+            if (n == 0 || pc + n > len) {
+                // residual illegal instruction
+                emit(pc < len ? code[pc] : 0);
+                return;
+            }
+            uint8_t op1 = n > 1 ? code[pc + 1] : 0;
+            uint8_t op2 = n > 2 ? code[pc + 2] : 0;
+            uint32_t vregs = vreg_operands(code[pc]);
+            if (op1 >= (vregs & 1 ? NUM_VREGS : NUM_REGS) && code[pc] != 'B') {
+                emit(code[pc]);
+                fail("register index out of range");
+                return;
+            }
+            if (op2 >= (vregs & 2 ? NUM_VREGS : NUM_REGS) && code[pc] != 'B' && code[pc] != 'I') {
+                emit(code[pc]);
+                fail("register index out of range");
+                return;
+            }
+
+            // the known values, for the handlers
+            struct state shadow = {};
+            for (int i = 0; i < NUM_REGS; i++) {
+                shadow.regfile[i] = cur.regs[i].val;
+            }
+            shadow.flags = cur.flags.val;
+            shadow.data = image;
+
+            switch (code[pc]) {
+                case 'I':
+                    set_known(op1, op2);
+                    break;
+                case 'M':
+                    if (op1 == op2) {
+                        break;
+                    }
+                    if (cur.regs[op2].known) {
+                        set_known(op1, cur.regs[op2].val);
+                    } else {
+                        emit3('M', op1, op2);
+                        set_unknown(op1);
+                    }
+                    break;
+                case 'A':
+                case 'U':
+                case '&':
+                case '|':
+                case '^':
+                case '<':
+                case '>':
+                case '*':
+                    if (cur.regs[op1].known && cur.regs[op2].known) {
+                        pe_alu(&shadow, code[pc], op1, op2);
+                        set_known(op1, shadow.regfile[op1]);
+                        cur.flags = {true, shadow.flags};
+                    } else {
+                        materialize(op1, pc);
+                        materialize(op2, pc);
+                        emit3(code[pc], op1, op2);
+                        set_unknown(op1);
+                        cur.flags = {false, 0};
+                    }
+                    break;
+                case 'L': {
+                    int8_t ptr = cur.regs[op1].val;
+                    if (cur.regs[op1].known && ptr >= 0 && (uint32_t) ptr < image_len) {
+                        load(&shadow, op1, op2);
+                        set_known(op2, shadow.regfile[op2]);
+                    } else {
+                        materialize_low(op1);
+                        emit3('L', op1, op2);
+                        set_unknown(op2);
+                    }
+                    break;
+                }
+                case 'S': {
+                    int8_t ptr = cur.regs[op1].val;
+                    if (cur.regs[op1].known && ptr >= 0 && (uint32_t) ptr < image_len) {
+                        fail("store into the static data image");
+                        return;
+                    }
+                    materialize_low(op1);
+                    materialize_low(op2);
+                    emit3('S', op1, op2);
+                    break;
+                }
+                case 'B': {
+                    int32_t off = read32(&code[pc + 2]);
+                    uint32_t target = pc + 6 + off;
+                    if (op1 != 'E' && op1 != 'N' && op1 != 'L') {
+                        for (uint32_t i = 0; i < 6; i++) {
+                            emit(code[pc + i]);
+                        }
+                        return;
+                    }
+                    if (cur.flags.known) {
+                        shadow.pc = pc;
+                        if (op1 == 'E') {
+                            beq(&shadow, off);
+                        } else if (op1 == 'N') {
+                            bne(&shadow, off);
+                        } else {
+                            blt(&shadow, off);
+                        }
+                        pc = shadow.pc != pc ? target : pc + 6;
+                        continue;
+                    }
+                    if (target >= len) {
+                        fail("branch target out of range");
+                        return;
+                    }
+                    emit_branch(op1, label(target, label_state(target, pc)));
+                    break;
+                }
+                case 'V':
+                case 'W': {
+                    int8_t ptr = cur.regs[op1].val;
+                    for (int i = 0; code[pc] == 'W' && cur.regs[op1].known && i < VREG_SIZE; i++) {
+                        int8_t at = ptr + i;
+                        if (at >= 0 && (uint32_t) at < image_len) {
+                            fail("store into the static data image");
+                            return;
+                        }
+                    }
+                    materialize_low(op1);
+                    emit3(code[pc], op1, op2);
+                    break;
+                }
+                case 'D':
+                    materialize_low(op2);
+                    emit3('D', op1, op2);
+                    break;
+                case '+':
+                case '-':
+                case 'X':
+                case '=':
+                    emit3(code[pc], op1, op2);
+                    break;
+                case 'R':
+                    emit3('R', op1, op2);
+                    set_unknown(op1);
+                    cur.flags = {false, 0};
+                    break;
+                case 'K':
+                case 'P':
+                case 'C': {
+                    // atomics are for data shared with other threads, always residual
+                    int8_t ptr = cur.regs[op1].val;
+                    if (code[pc] != 'K' && cur.regs[op1].known && ptr >= 0 && (uint32_t) ptr < image_len) {
+                        fail("store into the static data image");
+                        return;
+                    }
+                    materialize_low(op1);
+                    if (code[pc] != 'K') {
+                        materialize_low(op2);
+                    }
+                    if (code[pc] == 'C') {
+                        materialize_low(0);
+                        emit3('C', op1, op2);
+                        set_unknown(0);
+                        cur.flags = {false, 0};
+                    } else {
+                        emit3(code[pc], op1, op2);
+                    }
+                    if (code[pc] == 'K') {
+                        set_unknown(op2);
+                    }
+                    break;
+                }
+                case 'J': {
+                    // only a known target can be followed, the residual code has other pcs
+                    if (!cur.regs[op1].known) {
+                        emit(code[pc]);
+                        fail("indirect jump to an unknown target");
+                        return;
+                    }
+                    uint32_t target = cur.regs[op1].val;
+                    if (target >= len) {
+                        fail("jump target out of range");
+                        return;
+                    }
+                    // continued like a branch to a label, which bounds the variants of a loop
+                    uint32_t next = label(target, label_state(target, pc));
+                    if (labels[next].out != PE_NONE) {
+                        emit_branch('E', next);
+                        emit_branch('N', next);
+                        return;
+                    }
+                    pc = enter(next);
+                    first = true;
+                    continue;
+                }
+                case 'H':
+                    // wide constants first, while the others can still be their scratch register
+                    for (int wide = 1; wide >= 0; wide--) {
+                        for (int i = 0; i < NUM_REGS; i++) {
+                            if ((halt_live & (1u << i)) && (cur.regs[i].val > 0xff) == wide) {
+                                materialize(i, pc);
+                            }
+                        }
+                    }
+                    emit('H');
+                    return;
+            }
+            pc += n;
+        }
+    }
+
+    constexpr void run(const pe_state &entry, uint32_t entry_pc) {
+        analyze();
+        cur = entry;
+        label(entry_pc, label_state(entry_pc, entry_pc));
+        for (uint32_t i = 0; i < nlabels && !res.error; i++) {
+            if (labels[i].out == PE_NONE) {
+                block(i);
+            }
+        }
+        for (uint32_t i = 0; i < nfixups; i++) {
+            uint32_t at = fixups[i][0];
+            uint32_t off = labels[fixups[i][1]].out - (at + 6);
+            for (int b = 0; b < 4; b++) {
+                res.code[at + 2 + b] = off >> (8 * b);
+            }
+        }
+    }
+};
+
+// Specialize `code` (entry at entry_pc) to the first `image_len` bytes of its data segment, which
+// hold `image` followed by zeros, and to the known registers in `entry`. `halt_live` are the
+// registers observable after H, as a bit mask. Stores into the image are a specialization error.
+// The residual code is entered at pc 0.
+constexpr pe_result pe_specialize(const uint8_t *code, uint32_t len, const uint8_t *image, uint32_t image_size,
+                                  uint32_t image_len, const pe_state &entry, uint32_t halt_live,
+                                  uint32_t entry_pc = 0) {
+    pe_specializer pe = {};
+    pe.code = code;
+    pe.len = len;
+    pe.halt_live = halt_live;
+    if (len > PE_MAX_CODE || image_len > PE_MAX_IMAGE || image_size > image_len || entry_pc >= len) {
+        pe.fail("input too large");
+        return pe.res;
+    }
+    pe.image_len = image_len;
+    for (uint32_t i = 0; i < image_size; i++) {
+        pe.image[i] = image[i];
+    }
+    pe.run(entry, entry_pc);
+    return pe.res;
+}
+
+#endif
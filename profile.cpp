@@ -0,0 +1,192 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "profile.h"
+
+// --------------------------------------------------
+// VALUE PROFILING
+// --------------------------------------------------
+
+void vp_init(struct value_profile *vp, uint32_t pc, uint8_t reg) {
+    *vp = {};
+    vp->pc = pc;
+    vp->reg = reg;
+}
+
+static int bucket(uint32_t value) {
+    return value ? 32 - __builtin_clz(value) : 0;
+}
+
+void vp_record(struct value_profile *vp, uint32_t value, uint64_t n) {
+    vp->samples += n;
+    vp->buckets[bucket(value)] += n;
+    // space saving: a tracked value is counted, any other replaces the least counted one
+    int min = 0;
+    for (int i = 0; i < VP_MAX_VALUES; i++) {
+        if (vp->counts[i] && vp->values[i] == value) {
+            vp->counts[i] += n;
+            return;
+        }
+        if (vp->counts[i] < vp->counts[min]) {
+            min = i;
+        }
+    }
+    vp->values[min] = value;
+    vp->counts[min] += n;
+}
+
+// --------------------------------------------------
+// BRANCH PROFILING
+// --------------------------------------------------
+
+void bp_init(struct branch_profile *bp, uint32_t len) {
+    bp->len = len;
+    bp->count = (uint64_t *) calloc(len ? len : 1, sizeof(uint64_t));
+    bp->taken = (uint64_t *) calloc(len ? len : 1, sizeof(uint64_t));
+    bp->targets = (struct value_profile **) calloc(len ? len : 1, sizeof(struct value_profile *));
+}
+
+// the target profile of the indirect jump at pc, created on first use
+static struct value_profile *bp_targets(struct branch_profile *bp, uint32_t pc) {
+    if (!bp->targets[pc]) {
+        bp->targets[pc] = (struct value_profile *) malloc(sizeof(struct value_profile));
+        vp_init(bp->targets[pc], pc, 0);
+    }
+    return bp->targets[pc];
+}
+
+void bp_free(struct branch_profile *bp) {
+    free(bp->count);
+    free(bp->taken);
+    for (uint32_t pc = 0; pc < bp->len; pc++) {
+        free(bp->targets[pc]);
+    }
+    free(bp->targets);
+}
+
+void bp_save(const struct branch_profile *bp, FILE *out) {
+    for (uint32_t pc = 0; pc < bp->len; pc++) {
+        if (bp->count[pc]) {
+            fprintf(out, "%u %llu %llu\n", pc, (unsigned long long) bp->count[pc],
+                    (unsigned long long) bp->taken[pc]);
+        }
+    }
+    for (uint32_t pc = 0; pc < bp->len; pc++) {
+        const struct value_profile *vp = bp->targets[pc];
+        for (int i = 0; vp && i < VP_MAX_VALUES; i++) {
+            if (vp->counts[i]) {
+                fprintf(out, "J %u %u %llu\n", pc, vp->values[i], (unsigned long long) vp->counts[i]);
+            }
+        }
+    }
+}
+
+bool bp_load(struct branch_profile *bp, FILE *in) {
+    char line[128];
+    while (fgets(line, sizeof(line), in)) {
+        unsigned pc, target;
+        unsigned long long count, taken;
+        if (sscanf(line, "J %u %u %llu", &pc, &target, &count) == 3) {
+            if (pc >= bp->len) {
+                return false;
+            }
+            vp_record(bp_targets(bp, pc), target, count);
+            continue;
+        }
+        if (sscanf(line, "%u %llu %llu", &pc, &count, &taken) != 3 || pc >= bp->len || taken > count) {
+            return false;
+        }
+        bp->count[pc] += count;
+        bp->taken[pc] += taken;
+    }
+    return true;
+}
+
+// --------------------------------------------------
+// VM INTERPRETER
+// instrumented
+// --------------------------------------------------
+
+#define OP1 (*op1)
+#define OP2 (*op2)
+#define OFF off
+
+static int interp_profiled(const uint8_t *code, uint32_t len, struct state *st, struct value_profile *vps,
+                           uint32_t nvps, const bool *probe, struct branch_profile *bp) {
+    while (1) {
+        uint32_t pc = st->pc;
+        if (pc >= len) {
+            return VM_BAD_PC;
+        }
+        if (probe[pc]) {
+            for (uint32_t i = 0; i < nvps; i++) {
+                if (vps[i].pc == pc) {
+                    vp_record(&vps[i], st->regfile[vps[i].reg]);
+                }
+            }
+        }
+        if (bp) {
+            bp->count[pc]++;
+        }
+        uint32_t n = insn_length(code[pc]);
+        if (n == 0 || pc + n > len) {
+            return VM_ILLEGAL;
+        }
+        const uint8_t *op1 = &code[pc + 1];
+        const uint8_t *op2 = &code[pc + 2];
+        switch (code[pc]) {
+#define INSN(op, len, handler) \
+            case op:           \
+                handler;       \
+                break;
+            VM_INSNS(INSN)
+#undef INSN
+            case 'B': {
+                int32_t off = read32(&code[pc + 2]);
+                switch (code[pc + 1]) {
+#define BRANCH(cc, handler) \
+                    case cc:        \
+                        handler;    \
+                        break;
+                    VM_BRANCHES(BRANCH)
+#undef BRANCH
+                    default:
+                        return VM_ILLEGAL;
+                }
+                if (bp && off && st->pc == pc + off) {
+                    bp->taken[pc]++;
+                }
+                break;
+            }
+#define JUMP(op, len, handler)                             \
+            case op:                                       \
+                handler;                                   \
+                if (bp) {                                  \
+                    vp_record(bp_targets(bp, pc), st->pc); \
+                }                                          \
+                continue;
+            VM_JUMPS(JUMP)
+#undef JUMP
+            case 'H':
+                return VM_HALT;
+            default:
+                return VM_ILLEGAL;
+        }
+        st->pc += n;
+    }
+}
+
+int profile_run(const uint8_t *code, uint32_t len, struct state *st, struct value_profile *vps, uint32_t nvps,
+                struct branch_profile *bp) {
+    bool *probe = (bool *) calloc(len ? len : 1, sizeof(bool));
+    for (uint32_t i = 0; i < nvps; i++) {
+        if (vps[i].pc < len) {
+            probe[vps[i].pc] = true;
+        }
+    }
+    int res = interp_profiled(code, len, st, vps, nvps, probe, bp);
+    free(probe);
+    return res;
+}
@@ -0,0 +1,60 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <cstdint>
+#include <cstdio>
+
+#include "vm.h"
+
+// --------------------------------------------------
+// PROFILING
+// --------------------------------------------------
+//
+// An instrumented interpreter collecting the profiles the specializers are guided by: value
+// profiles of chosen registers at chosen pcs (speculate.cpp) and how often each instruction runs
+// and each branch is taken, and where each indirect jump goes (block layout, branch weights and
+// jump targets in cogen.cpp).
+
+#define VP_MAX_VALUES 8
+#define VP_BUCKETS 33
+
+// A value profile records the values a register holds at one pc: the most frequent values
+// (space-saving counters) and a histogram of their magnitudes.
+struct value_profile {
+    uint32_t pc;
+    uint8_t reg;
+    uint64_t samples;
+    uint32_t values[VP_MAX_VALUES];
+    uint64_t counts[VP_MAX_VALUES]; // an overestimate, by at most the count evicted before
+    uint64_t buckets[VP_BUCKETS]; // [0] zero, [k] values in [2^(k-1), 2^k)
+};
+
+void vp_init(struct value_profile *vp, uint32_t pc, uint8_t reg);
+
+// record n samples of value
+void vp_record(struct value_profile *vp, uint32_t value, uint64_t n = 1);
+
+struct branch_profile {
+    uint32_t len;
+    uint64_t *count; // executions of the instruction at each pc
+    uint64_t *taken; // of those, for a branch, how often it went to its target
+    struct value_profile **targets; // for an indirect jump that ran, the pcs it went to
+};
+
+void bp_init(struct branch_profile *bp, uint32_t len);
+
+void bp_free(struct branch_profile *bp);
+
+// "<pc> <count> <taken>" lines for the instructions that ran, then "J <pc> <target> <count>"
+// lines for the targets of the indirect jumps
+void bp_save(const struct branch_profile *bp, FILE *out);
+
+// returns false on a malformed line or a pc out of range
+bool bp_load(struct branch_profile *bp, FILE *in);
+
+// Interpret from st->pc, recording each value profile when its pc is reached and, if bp is not
+// nullptr, every instruction, branch and indirect jump. Returns VM_HALT, VM_ILLEGAL or VM_BAD_PC.
+int profile_run(const uint8_t *code, uint32_t len, struct state *st, struct value_profile *vps, uint32_t nvps,
+                struct branch_profile *bp);
+
+#endif
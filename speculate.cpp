@@ -0,0 +1,169 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "block.h"
+#include "pe.h"
+#include "speculate.h"
+
+// --------------------------------------------------
+// SPECULATION
+// --------------------------------------------------
+
+struct spec_variant {
+    uint32_t value;
+    struct vm_program *prog; // nullptr if specialization failed, the value runs generic
+    uint32_t len; // of the residual code
+    uint64_t hits;
+};
+
+struct spec_program {
+    struct vm_program *generic;
+    uint32_t pc;
+    uint8_t reg;
+    // a dense range [lo, hi) is indexed by the value, constants are compared one by one
+    bool range;
+    uint32_t lo, hi;
+    uint32_t nvariants;
+    struct spec_variant *variants;
+    uint64_t misses;
+};
+
+// the residual program for reg == value at pc, which must leave every register as the generic one
+// does (the flags are not observable after H)
+static void specialize(const uint8_t *code, uint32_t len, uint32_t pc, uint8_t reg, struct spec_variant *var) {
+    pe_state entry = {};
+    entry.regs[reg] = {true, var->value};
+    pe_result *res = new pe_result(pe_specialize(code, len, nullptr, 0, 0, entry, (1u << NUM_REGS) - 1, pc));
+    if (!res->error) {
+        var->prog = prog_translate(res->code, res->len);
+        var->len = res->len;
+    }
+    delete res;
+}
+
+struct spec_program *spec_new(const uint8_t *code, uint32_t len, const struct value_profile *vp,
+                              const struct spec_policy *policy) {
+    struct spec_program *sp = (struct spec_program *) calloc(1, sizeof(struct spec_program));
+    sp->generic = prog_translate(code, len);
+    sp->pc = vp->pc;
+    sp->reg = vp->reg;
+    uint64_t need = (uint64_t) (policy->coverage * vp->samples);
+    if (!vp->samples || vp->pc >= len) {
+        return sp;
+    }
+
+    // the smallest range [0, 2^k) of values that covers enough samples
+    uint64_t covered = 0;
+    for (int k = 0; k < VP_BUCKETS && (1ull << k) <= policy->max_range; k++) {
+        covered += vp->buckets[k];
+        if (covered >= need) {
+            sp->range = true;
+            sp->lo = 0;
+            sp->hi = 1u << k;
+            sp->nvariants = sp->hi;
+            break;
+        }
+    }
+
+    // otherwise the most frequent values, if they do
+    uint32_t order[VP_MAX_VALUES];
+    uint32_t nconst = 0;
+    if (!sp->range) {
+        covered = 0;
+        bool taken[VP_MAX_VALUES] = {};
+        while (covered < need && nconst < VP_MAX_VALUES) {
+            int best = -1;
+            for (int i = 0; i < VP_MAX_VALUES; i++) {
+                if (vp->counts[i] && !taken[i] && (best < 0 || vp->counts[i] > vp->counts[best])) {
+                    best = i;
+                }
+            }
+            if (best < 0) {
+                break;
+            }
+            taken[best] = true;
+            order[nconst++] = best;
+            covered += vp->counts[best];
+        }
+        if (covered < need) {
+            return sp;
+        }
+        sp->nvariants = nconst;
+    }
+
+    sp->variants = (struct spec_variant *) calloc(sp->nvariants, sizeof(struct spec_variant));
+    for (uint32_t i = 0; i < sp->nvariants; i++) {
+        sp->variants[i].value = sp->range ? sp->lo + i : vp->values[order[i]];
+        specialize(code, len, sp->pc, sp->reg, &sp->variants[i]);
+    }
+    return sp;
+}
+
+// the variant for value, or nullptr
+static struct spec_variant *guard(const struct spec_program *sp, uint32_t value) {
+    if (sp->range) {
+        return value - sp->lo < sp->hi - sp->lo ? &sp->variants[value - sp->lo] : nullptr;
+    }
+    for (uint32_t i = 0; i < sp->nvariants; i++) {
+        if (sp->variants[i].value == value) {
+            return &sp->variants[i];
+        }
+    }
+    return nullptr;
+}
+
+bool spec_covers(const struct spec_program *sp, uint32_t value) {
+    struct spec_variant *var = guard(sp, value);
+    return var && var->prog;
+}
+
+int spec_run(struct spec_program *sp, struct state *st) {
+    if (st->pc == sp->pc && sp->nvariants) {
+        struct spec_variant *var = guard(sp, st->regfile[sp->reg]);
+        if (var && var->prog) {
+            var->hits++;
+            st->pc = 0;
+            return prog_run(var->prog, st);
+        }
+        sp->misses++;
+    }
+    return prog_run(sp->generic, st);
+}
+
+void spec_report(const struct spec_program *sp, FILE *out) {
+    if (!sp->nvariants) {
+        fprintf(out, "no speculation at pc %u\n", sp->pc);
+        return;
+    }
+    if (sp->range) {
+        fprintf(out, "guard at pc %u: r%u in [%u, %u)\n", sp->pc, sp->reg, sp->lo, sp->hi);
+    } else {
+        fprintf(out, "guard at pc %u: r%u in %u constants\n", sp->pc, sp->reg, sp->nvariants);
+    }
+    uint64_t hits = 0;
+    uint32_t failed = 0;
+    for (uint32_t i = 0; i < sp->nvariants; i++) {
+        const struct spec_variant *var = &sp->variants[i];
+        hits += var->hits;
+        failed += !var->prog;
+        if (!sp->range) {
+            fprintf(out, "  r%u == %u: %u bytes, %llu hits\n", sp->reg, var->value, var->len,
+                    (unsigned long long) var->hits);
+        }
+    }
+    fprintf(out, "%llu hits, %llu misses, %u variants failed to specialize\n", (unsigned long long) hits,
+            (unsigned long long) sp->misses, failed);
+}
+
+void spec_free(struct spec_program *sp) {
+    for (uint32_t i = 0; i < sp->nvariants; i++) {
+        if (sp->variants[i].prog) {
+            prog_free(sp->variants[i].prog);
+        }
+    }
+    free(sp->variants);
+    prog_free(sp->generic);
+    free(sp);
+}
@@ -0,0 +1,44 @@
+#ifndef SPECULATE_H
+#define SPECULATE_H
+
+#include <cstdint>
+#include <cstdio>
+
+#include "vm.h"
+#include "profile.h"
+
+// --------------------------------------------------
+// SPECULATION
+// --------------------------------------------------
+//
+// spec_new uses a value profile (profile.h) to specialize the program with pe.h to the values
+// seen most, either a few constants or a dense range of small values, each residual program
+// entered from a guard on the register. A call whose value is not covered runs the generic one.
+// This is data specialization, where SPEC=2 to 6 only specialize to the code.
+
+struct spec_policy {
+    double coverage; // fraction of the samples the speculated values must cover
+    uint32_t max_range; // largest dense range of values to specialize to
+};
+
+struct spec_program;
+
+// Specialize code, entered at vp->pc, to the values in the profile. Without enough coverage there
+// are no variants and every call is generic.
+struct spec_program *spec_new(const uint8_t *code, uint32_t len, const struct value_profile *vp,
+                              const struct spec_policy *policy);
+
+// Run from st->pc, through a variant if st->pc is the profiled pc and the register holds a value
+// it was specialized to. Returns VM_HALT, VM_ILLEGAL or VM_BAD_PC; after a variant ran, st->pc
+// is a pc of the residual code.
+int spec_run(struct spec_program *sp, struct state *st);
+
+// whether the guard passes for this value of the register
+bool spec_covers(const struct spec_program *sp, uint32_t value);
+
+// the guard and the variants, and how many calls took them
+void spec_report(const struct spec_program *sp, FILE *out);
+
+void spec_free(struct spec_program *sp);
+
+#endif
@@ -0,0 +1,204 @@
+#include <cstdlib>
+
+#include "super.h"
+#include "super.gen.h"
+
+// The instructions of a sequence in VM_SUPERS are opcodes, or 'B' | cc << 8 for a branch, and 0
+// past its end.
+
+static const uint16_t sequences[][SUPER_MAX_INSNS + 1] = {
+#define SUPER_SEQUENCE(op, a, b, c, d) {op, a, b, c, d},
+        VM_SUPERS(SUPER_SEQUENCE)
+#undef SUPER_SEQUENCE
+        {0}, // (so that the table is not empty)
+};
+
+#define NSUPERS (sizeof(sequences) / sizeof(sequences[0]) - 1)
+
+// --------------------------------------------------
+// TRANSLATION
+// --------------------------------------------------
+
+// the number of instructions of the sequence s starting at pc, 0 if they are not there
+static uint32_t match(const struct super_program *prog, uint32_t pc, const uint16_t *s) {
+    uint32_t n = 0;
+    for (; n < SUPER_MAX_INSNS && s[n]; n++) {
+        if (pc >= prog->len) {
+            return 0;
+        }
+        const struct vm_insn *in = &prog->insns[pc];
+        uint16_t insn = in->opcode == 'B' ? 'B' | in->op1 << 8 : in->opcode;
+        if (!in->opcode || insn != s[n]) {
+            return 0;
+        }
+        pc += in->len;
+    }
+    return n;
+}
+
+struct super_program *super_translate(const uint8_t *code, uint32_t len, bool supers) {
+    struct super_program *prog = (struct super_program *) calloc(1, sizeof(struct super_program));
+    prog->len = len;
+    prog->insns = (struct vm_insn *) calloc(len ? len : 1, sizeof(struct vm_insn));
+    for (uint32_t pc = 0; pc < len; pc++) {
+        decode_insn(code, len, pc, &prog->insns[pc]);
+    }
+    if (!supers) {
+        return prog;
+    }
+    // (matched against the plain decoding, before any pc is rewritten)
+    uint8_t *rewrite = (uint8_t *) calloc(len ? len : 1, 1);
+    for (uint32_t pc = 0; pc < len; pc++) {
+        uint32_t longest = 0;
+        for (uint32_t i = 0; i < NSUPERS; i++) {
+            uint32_t n = match(prog, pc, sequences[i] + 1);
+            if (n > longest) {
+                longest = n;
+                rewrite[pc] = sequences[i][0];
+            }
+        }
+    }
+    for (uint32_t pc = 0; pc < len; pc++) {
+        if (rewrite[pc]) {
+            prog->insns[pc].opcode = rewrite[pc];
+            prog->rewritten++;
+        }
+    }
+    free(rewrite);
+    return prog;
+}
+
+void super_free(struct super_program *prog) {
+    free(prog->insns);
+    free(prog);
+}
+
+// --------------------------------------------------
+// VM INTERPRETER
+// runs the pre-decoded instructions
+// --------------------------------------------------
+
+#define OP1 (in->op1)
+#define OP2 (in->op2)
+#define OFF (in->off)
+
+constexpr uint32_t step_length(uint16_t insn) {
+    return insn_length(insn & 0xff);
+}
+
+// whether step runs insn (not 'H', nor an illegal opcode or condition)
+constexpr bool steppable(uint16_t insn) {
+    switch (insn) {
+#define STEPPABLE(op, ...) case op:
+        VM_INSNS(STEPPABLE)
+        VM_JUMPS(STEPPABLE)
+#undef STEPPABLE
+#define STEPPABLE(cc, handler) case 'B' | cc << 8:
+        VM_BRANCHES(STEPPABLE)
+#undef STEPPABLE
+            return true;
+        default:
+            return false;
+    }
+}
+
+// one instruction of a superinstruction, decoded at in
+template<uint16_t INSN>
+static inline void step(struct state *st, const struct vm_insn *in) {
+    static_assert(steppable(INSN), "a superinstruction can only hold instructions step runs");
+#define STEP(op, len, handler)     \
+    if constexpr (INSN == op) {    \
+        handler;                   \
+        st->pc += len;             \
+    }
+    VM_INSNS(STEP)
+#undef STEP
+#define STEP(op, len, handler)     \
+    if constexpr (INSN == op) {    \
+        handler;                   \
+    }
+    VM_JUMPS(STEP)
+#undef STEP
+#define STEP(cc, handler)                     \
+    if constexpr (INSN == ('B' | cc << 8)) {  \
+        handler;                              \
+        st->pc += 6;                          \
+    }
+    VM_BRANCHES(STEP)
+#undef STEP
+}
+
+template<uint16_t A, uint16_t B, uint16_t C, uint16_t D>
+static inline void run_super(struct state *st, const struct vm_insn *in) {
+    step<A>(st, in);
+    if constexpr (B != 0) {
+        step<B>(st, in + step_length(A));
+    }
+    if constexpr (C != 0) {
+        step<C>(st, in + step_length(A) + step_length(B));
+    }
+    if constexpr (D != 0) {
+        step<D>(st, in + step_length(A) + step_length(B) + step_length(C));
+    }
+}
+
+template<bool COUNT>
+static int run(const struct super_program *prog, struct state *st, struct super_stats *stats) {
+    while (1) {
+        if (st->pc >= prog->len) {
+            return VM_BAD_PC;
+        }
+        const struct vm_insn *in = &prog->insns[st->pc];
+        if constexpr (COUNT) {
+            stats->dispatches++;
+            stats->insns++;
+        }
+        switch (in->opcode) {
+#define INSN(op, len, handler) \
+            case op:           \
+                handler;       \
+                st->pc += len; \
+                continue;
+            VM_INSNS(INSN)
+#undef INSN
+#define JUMP(op, len, handler) \
+            case op:           \
+                handler;       \
+                continue;
+            VM_JUMPS(JUMP)
+#undef JUMP
+            case 'B':
+                switch (in->op1) {
+#define BRANCH(cc, handler) \
+                    case cc:        \
+                        handler;    \
+                        break;
+                    VM_BRANCHES(BRANCH)
+#undef BRANCH
+                }
+                st->pc += 6;
+                continue;
+#define SUPER(op, a, b, c, d)                                           \
+            case op:                                                    \
+                run_super<a, b, c, d>(st, in);                          \
+                if constexpr (COUNT) {                                  \
+                    stats->insns += ((b) != 0) + ((c) != 0) + ((d) != 0); \
+                }                                                       \
+                continue;
+            VM_SUPERS(SUPER)
+#undef SUPER
+            case 'H':
+                return VM_HALT;
+            default:
+                return VM_ILLEGAL;
+        }
+    }
+}
+
+#undef OP1
+#undef OP2
+#undef OFF
+
+int super_run(const struct super_program *prog, struct state *st, struct super_stats *stats) {
+    return stats ? run<true>(prog, st, stats) : run<false>(prog, st, nullptr);
+}
@@ -0,0 +1,49 @@
+#ifndef SUPER_H
+#define SUPER_H
+
+#include <cstdint>
+
+#include "vm.h"
+
+// --------------------------------------------------
+// SUPERINSTRUCTIONS
+// --------------------------------------------------
+//
+// An interpreter over pre-decoded bytecode in which the instruction sequences mined from the
+// execution counts of the programs in bytecode.h (see mine.cpp) run as one dispatch each. mine.out
+// writes the sequences to super.gen.h at build time as VM_SUPERS, each gets an internal opcode
+// above the ASCII ones of the instruction set and a handler instantiated from the handlers of its
+// instructions. Translation decodes the instruction at every byte of the code and rewrites each
+// pc starting the longest of the sequences to its superinstruction. The instructions after the
+// first are still decoded at their own pcs, so a branch or indirect jump into the middle of a
+// sequence runs them one by one.
+
+// the longest sequence, only its last instruction may be a branch or an indirect jump
+#define SUPER_MAX_INSNS 4
+
+// the first internal opcode
+#define SUPER_OPCODE 0x80
+
+struct super_program {
+    uint32_t len;
+    // by pc; the opcode at the start of a superinstruction is its own, the length still that of
+    // its first instruction
+    struct vm_insn *insns;
+    uint32_t rewritten; // pcs starting a superinstruction
+};
+
+struct super_stats {
+    uint64_t dispatches;
+    uint64_t insns; // instructions run, each instruction of a superinstruction counts
+};
+
+// supers false decodes without rewriting, for comparison
+struct super_program *super_translate(const uint8_t *code, uint32_t len, bool supers = true);
+
+void super_free(struct super_program *prog);
+
+// Run from st->pc, returns VM_HALT, VM_ILLEGAL or VM_BAD_PC. With stats, the dispatches and
+// instructions are counted into it (on a separately instantiated interpreter).
+int super_run(const struct super_program *prog, struct state *st, struct super_stats *stats = nullptr);
+
+#endif
@@ -0,0 +1,663 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "vm.h"
+#include "bytecode.h"
+#include "isa.h"
+#include "sweep.h"
+
+// --------------------------------------------------
+// SWEEP COORDINATOR
+// --------------------------------------------------
+//
+// usage: sweep.out [-j workers] [-s shard size] [-t timeout] [-x n] [-o file] first last program...
+//        -j the number of worker processes (default one per core)
+//        -s the inputs per shard (default 65536)
+//        -t seconds a worker may take for a shard before it is killed (default none)
+//        -x a worker crashes on a shard with a chance of 1 in n, to exercise recovery
+//        -o the output file (default sweep.bin)
+//        programs of bytecode.h by name, run over r0 = first ... last
+//
+//        sweep.out -w socket [-x n]
+//        runs as a worker of the coordinator listening on socket
+//
+// See sweep.h for the sweep, its file and the protocol.
+
+static const struct {
+    const char *name;
+    const uint8_t *code;
+    uint32_t len;
+} programs[] = {
+        {"fib",        fib,        sizeof(fib) - 1},
+        {"xorshift",   xorshift,   sizeof(xorshift) - 1},
+        {"jstates",    jstates,    sizeof(jstates) - 1},
+        {"vsum",       vsum,       sizeof(vsum) - 1},
+        {"simd_sum",   simd_sum,   sizeof(simd_sum) - 1},
+        {"simd_count", simd_count, sizeof(simd_count) - 1},
+};
+
+#define NPROGRAMS (sizeof(programs) / sizeof(programs[0]))
+
+static void usage() {
+    puts("usage: sweep.out [-j workers] [-s shard size] [-t timeout] [-x n] [-o file] first last program...");
+    puts("       sweep.out -w socket [-x n]");
+    exit(1);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// --------------------------------------------------
+// MESSAGES
+// --------------------------------------------------
+
+// all of buf, false on EOF or an error
+static bool read_all(int fd, void *buf, size_t size) {
+    for (size_t done = 0; done < size;) {
+        ssize_t n = read(fd, (uint8_t *) buf + done, size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void *buf, size_t size) {
+    for (size_t done = 0; done < size;) {
+        ssize_t n = write(fd, (const uint8_t *) buf + done, size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+// uint32 in place, between host order and the little-endian of the wire and the file
+static void to_le(uint32_t *words, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        uint8_t b[4] = {(uint8_t) words[i], (uint8_t) (words[i] >> 8), (uint8_t) (words[i] >> 16),
+                        (uint8_t) (words[i] >> 24)};
+        memcpy(&words[i], b, 4);
+    }
+}
+
+static void from_le(uint32_t *words, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        uint8_t b[4];
+        memcpy(b, &words[i], 4);
+        words[i] = b[0] | b[1] << 8 | b[2] << 16 | (uint32_t) b[3] << 24;
+    }
+}
+
+static bool send_header(int fd, uint32_t type, uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+    uint32_t h[SWEEP_HEADER_WORDS] = {type, a, b, c, d};
+    to_le(h, SWEEP_HEADER_WORDS);
+    return write_all(fd, h, sizeof(h));
+}
+
+static bool recv_header(int fd, uint32_t *h) {
+    if (!read_all(fd, h, SWEEP_HEADER_WORDS * sizeof(uint32_t))) {
+        return false;
+    }
+    from_le(h, SWEEP_HEADER_WORDS);
+    return true;
+}
+
+// --------------------------------------------------
+// WORKER
+// --------------------------------------------------
+
+static int worker(const char *path, uint32_t crash_one_in) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        perror("worker: connect");
+        return 1;
+    }
+    if (!send_header(fd, SWEEP_HELLO, SWEEP_VERSION, getpid(), 0, 0)) {
+        return 1;
+    }
+    // zero past the code of the task, so that a program running past its end stops on an illegal
+    // instruction instead of running what is left of a longer one before it (isa_interp does not
+    // bound the pc), and an instruction at the very end is not read past the buffer
+    uint8_t *code = (uint8_t *) calloc(SWEEP_MAX_CODE + 8, 1);
+    uint32_t used = 0; // bytes of the last task's code
+    uint32_t *out = (uint32_t *) calloc(SWEEP_MAX_SHARD, sizeof(uint32_t));
+    uint8_t data[0x100];
+    uint32_t h[SWEEP_HEADER_WORDS];
+    unsigned seed = getpid();
+    while (recv_header(fd, h)) {
+        if (h[0] == SWEEP_BYE) {
+            return 0;
+        }
+        uint32_t shard = h[1], first = h[2], count = h[3], len = h[4];
+        if (h[0] != SWEEP_TASK || count > SWEEP_MAX_SHARD || len > SWEEP_MAX_CODE || !read_all(fd, code, len)) {
+            break;
+        }
+        if (len < used) {
+            memset(code + len, 0, used - len);
+        }
+        used = len;
+        if (crash_one_in && rand_r(&seed) % crash_one_in == 0) {
+            abort();
+        }
+        uint32_t stopped = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            memset(data, 0, sizeof(data));
+            struct state st = {};
+            st.regfile[0] = first + i;
+            st.data = data + 0x80;
+            st.code = code;
+            stopped += isa_interp(&st) != VM_HALT;
+            out[i] = st.regfile[0];
+        }
+        to_le(out, count);
+        if (!send_header(fd, SWEEP_RESULT, shard, count, stopped, 0) ||
+            !write_all(fd, out, count * sizeof(uint32_t))) {
+            break;
+        }
+    }
+    // the coordinator went away
+    return 1;
+}
+
+// --------------------------------------------------
+// COORDINATOR
+// --------------------------------------------------
+
+struct ckpt_header {
+    char magic[8];
+    uint32_t first, last;
+    uint32_t shard_size;
+    uint32_t nprograms;
+    uint64_t programs; // hash of the names and code of the programs, in order
+};
+
+struct conn {
+    int fd; // -1 if free
+    pid_t pid; // of the worker if it is a child of the coordinator, from the socket, else 0
+    bool hello;
+    int64_t shard; // -1 while idle
+    double deadline;
+};
+
+struct sweep {
+    // the sweep
+    const uint32_t *progs; // indices into programs
+    uint32_t nprogs;
+    uint32_t first;
+    uint64_t count; // inputs per program
+    uint32_t shard_size;
+    uint64_t shards_per_prog, nshards;
+    // the files
+    int out, ckpt;
+    uint8_t *done; // by shard
+    uint64_t ndone;
+    // the queue of shards neither done nor assigned, a ring
+    uint64_t *queue;
+    uint64_t head, tail;
+    uint8_t *attempts; // by shard
+    // the workers
+    const char *path;
+    uint32_t crash_one_in;
+    double timeout;
+    struct conn *conns;
+    uint32_t nconns;
+    uint32_t nworkers; // to keep running
+    uint32_t live; // spawned and not reaped
+    pid_t *spawned; // children not connected yet
+    uint32_t nspawned;
+    uint32_t respawned;
+    uint32_t unconnected; // children in a row that exited before they connected
+    uint64_t items; // run, not resumed
+    uint64_t stopped;
+};
+
+// the socket of the coordinator and its directory, removed on exit
+static char socket_dir[] = "/tmp/vm-sweep.XXXXXX", socket_path[64];
+
+// written to on SIGCHLD, so that poll wakes up for a child that exits before it connects
+static int child_pipe[2];
+
+static void fail(const char *msg) {
+    printf("sweep failed: %s\n", msg);
+    unlink(socket_path);
+    rmdir(socket_dir);
+    exit(1);
+}
+
+// the workers die with the coordinator, the socket is removed here
+static void interrupted(int sig) {
+    unlink(socket_path);
+    rmdir(socket_dir);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void child_exited(int) {
+    int saved = errno;
+    (void) !write(child_pipe[1], "", 1);
+    errno = saved;
+}
+
+static uint64_t hash_programs(const uint32_t *progs, uint32_t n) {
+    uint64_t h = hash64(nullptr, 0);
+    for (uint32_t i = 0; i < n; i++) {
+        const char *name = programs[progs[i]].name;
+        h = hash64((const uint8_t *) name, strlen(name) + 1, h);
+        h = hash64(programs[progs[i]].code, programs[progs[i]].len, h);
+    }
+    return h;
+}
+
+// Opens the output file and its checkpoint, resuming from the checkpoint if it is of the same
+// sweep. Returns the shards found done.
+static uint64_t open_files(struct sweep *sw, const char *file) {
+    char ckpt_path[4096];
+    snprintf(ckpt_path, sizeof(ckpt_path), "%s.ckpt", file);
+    struct ckpt_header want = {};
+    memcpy(want.magic, "VMSWEEP1", 8);
+    want.first = sw->first;
+    want.last = sw->first + (uint32_t) (sw->count - 1);
+    want.shard_size = sw->shard_size;
+    want.nprograms = sw->nprogs;
+    want.programs = hash_programs(sw->progs, sw->nprogs);
+
+    sw->done = (uint8_t *) calloc(sw->nshards, 1);
+    uint64_t resumed = 0;
+    struct ckpt_header have;
+    int ckpt = open(ckpt_path, O_RDWR | O_CLOEXEC);
+    bool resume = ckpt >= 0 && read_all(ckpt, &have, sizeof(have)) && !memcmp(&have, &want, sizeof(want)) &&
+                  read_all(ckpt, sw->done, sw->nshards);
+    if (resume) {
+        sw->out = open(file, O_RDWR | O_CLOEXEC);
+        resume = sw->out >= 0;
+    }
+    if (!resume) {
+        if (ckpt >= 0) {
+            close(ckpt);
+        }
+        memset(sw->done, 0, sw->nshards);
+        sw->out = open(file, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        ckpt = open(ckpt_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (sw->out < 0 || ckpt < 0 || !write_all(ckpt, &want, sizeof(want)) ||
+            !write_all(ckpt, sw->done, sw->nshards) || fdatasync(ckpt) != 0) {
+            fail("can't create the output file or its checkpoint");
+        }
+    }
+    // (sparse until the shards are written)
+    if (ftruncate(sw->out, sw->nprogs * sw->count * sizeof(uint32_t)) != 0) {
+        fail("can't size the output file");
+    }
+    sw->ckpt = ckpt;
+    for (uint64_t s = 0; s < sw->nshards; s++) {
+        resumed += sw->done[s] != 0;
+    }
+    return resumed;
+}
+
+// the output, then the checkpoint: a shard recorded as done is on disk
+static void record(struct sweep *sw, uint64_t shard, const uint32_t *out, uint32_t count) {
+    uint64_t prog = shard / sw->shards_per_prog;
+    uint64_t index = prog * sw->count + (shard % sw->shards_per_prog) * sw->shard_size;
+    uint8_t one = 1;
+    if (pwrite(sw->out, out, count * sizeof(uint32_t), index * sizeof(uint32_t)) !=
+        (ssize_t) (count * sizeof(uint32_t)) || fdatasync(sw->out) != 0 ||
+        pwrite(sw->ckpt, &one, 1, sizeof(struct ckpt_header) + shard) != 1 || fdatasync(sw->ckpt) != 0) {
+        fail("can't write the output file or its checkpoint");
+    }
+    sw->done[shard] = 1;
+    sw->ndone++;
+    sw->items += count;
+}
+
+static void spawn(struct sweep *sw) {
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        fail("can't fork a worker");
+    }
+    if (pid == 0) {
+        // a local worker dies with the coordinator, even one busy with a shard that never ends
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (getppid() != parent) {
+            _exit(1);
+        }
+        char crash[16];
+        snprintf(crash, sizeof(crash), "%u", sw->crash_one_in);
+        execl("/proc/self/exe", "sweep.out", "-w", sw->path, "-x", crash, (char *) nullptr);
+        _exit(127);
+    }
+    sw->spawned = (pid_t *) realloc(sw->spawned, (sw->nspawned + 1) * sizeof(pid_t));
+    sw->spawned[sw->nspawned++] = pid;
+    sw->live++;
+}
+
+// The pid of the peer on fd if it is a child not connected yet, else 0. Only such a pid is ever
+// signaled, never one that came in a message.
+static pid_t claim_child(struct sweep *sw, int fd) {
+    struct ucred cred;
+    socklen_t size = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &size) != 0) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < sw->nspawned; i++) {
+        if (sw->spawned[i] == cred.pid) {
+            sw->spawned[i] = sw->spawned[--sw->nspawned];
+            sw->unconnected = 0;
+            return cred.pid;
+        }
+    }
+    return 0;
+}
+
+// Reap the children that exited before they connected (exec or connect failed) and replace them,
+// unless SWEEP_ATTEMPTS of them in a row did. One that exits after it connected is noticed as the
+// end of its connection instead.
+static void reap_unconnected(struct sweep *sw) {
+    char buf[64];
+    while (read(child_pipe[0], buf, sizeof(buf)) > 0) {
+    }
+    for (uint32_t i = 0; i < sw->nspawned;) {
+        if (waitpid(sw->spawned[i], nullptr, WNOHANG) != sw->spawned[i]) {
+            i++;
+            continue;
+        }
+        sw->spawned[i] = sw->spawned[--sw->nspawned];
+        sw->live--;
+        if (++sw->unconnected >= SWEEP_ATTEMPTS) {
+            fail("workers exit before they connect");
+        }
+        if (sw->ndone < sw->nshards) {
+            spawn(sw);
+            sw->respawned++;
+        }
+    }
+}
+
+static void assign(struct sweep *sw, struct conn *c) {
+    if (sw->head == sw->tail) {
+        c->shard = -1;
+        return;
+    }
+    uint64_t shard = sw->queue[sw->head++ % sw->nshards];
+    uint64_t prog = shard / sw->shards_per_prog;
+    uint64_t offset = (shard % sw->shards_per_prog) * sw->shard_size;
+    uint32_t count = offset + sw->shard_size <= sw->count ? sw->shard_size : sw->count - offset;
+    const auto &p = programs[sw->progs[prog]];
+    c->shard = shard;
+    c->deadline = now() + sw->timeout;
+    // a failed send is noticed as the end of the connection
+    if (send_header(c->fd, SWEEP_TASK, shard, sw->first + offset, count, p.len)) {
+        write_all(c->fd, p.code, p.len);
+    }
+}
+
+// the connection ended or timed out: its shard goes back to the queue, a child worker is replaced
+static void lost(struct sweep *sw, struct conn *c) {
+    close(c->fd);
+    c->fd = -1;
+    // (first, so that a hung worker does not outlive a failed sweep)
+    if (c->pid > 0) {
+        kill(c->pid, SIGKILL);
+        waitpid(c->pid, nullptr, 0);
+        sw->live--;
+    }
+    if (c->shard >= 0) {
+        if (++sw->attempts[c->shard] >= SWEEP_ATTEMPTS) {
+            uint64_t prog = c->shard / sw->shards_per_prog;
+            printf("shard %lld (%s from r0 = %llu) lost its worker %u times\n", (long long) c->shard,
+                   programs[sw->progs[prog]].name,
+                   (unsigned long long) sw->first + (c->shard % sw->shards_per_prog) * sw->shard_size,
+                   SWEEP_ATTEMPTS);
+            fail("a shard failed too many times, the checkpoint is kept");
+        }
+        sw->queue[sw->tail++ % sw->nshards] = c->shard;
+        c->shard = -1;
+    }
+    if (c->pid > 0 && sw->ndone < sw->nshards) {
+        spawn(sw);
+        sw->respawned++;
+    }
+}
+
+static void received(struct sweep *sw, struct conn *c) {
+    uint32_t h[SWEEP_HEADER_WORDS];
+    if (!recv_header(c->fd, h)) {
+        lost(sw, c);
+        return;
+    }
+    if (h[0] == SWEEP_HELLO && !c->hello && c->shard < 0) {
+        if (h[1] != SWEEP_VERSION) {
+            lost(sw, c);
+            return;
+        }
+        c->hello = true;
+        assign(sw, c);
+        return;
+    }
+    if (h[0] != SWEEP_RESULT || c->shard < 0) {
+        lost(sw, c);
+        return;
+    }
+    uint64_t offset = (c->shard % sw->shards_per_prog) * sw->shard_size;
+    uint32_t expect = offset + sw->shard_size <= sw->count ? sw->shard_size : sw->count - offset;
+    static uint32_t *out;
+    if (!out) {
+        out = (uint32_t *) calloc(SWEEP_MAX_SHARD, sizeof(uint32_t));
+    }
+    if (h[1] != c->shard || h[2] != expect || !read_all(c->fd, out, expect * sizeof(uint32_t))) {
+        lost(sw, c);
+        return;
+    }
+    // (already little-endian)
+    record(sw, c->shard, out, expect);
+    sw->stopped += h[3];
+    assign(sw, c);
+}
+
+static int coordinate(struct sweep *sw, const char *file) {
+    sw->shards_per_prog = (sw->count + sw->shard_size - 1) / sw->shard_size;
+    sw->nshards = sw->nprogs * sw->shards_per_prog;
+    uint64_t resumed = open_files(sw, file);
+    sw->ndone = resumed;
+    sw->queue = (uint64_t *) calloc(sw->nshards, sizeof(uint64_t));
+    sw->attempts = (uint8_t *) calloc(sw->nshards, 1);
+    for (uint64_t s = 0; s < sw->nshards; s++) {
+        if (!sw->done[s]) {
+            sw->queue[sw->tail++] = s;
+        }
+    }
+
+    // the socket, in a fresh directory of its own
+    if (!mkdtemp(socket_dir)) {
+        fail("can't create the socket directory");
+    }
+    snprintf(socket_path, sizeof(socket_path), "%s/socket", socket_dir);
+    sw->path = socket_path;
+    // (none of the coordinator's descriptors are inherited by the workers)
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(lfd, 64) != 0) {
+        fail("can't listen on the socket");
+    }
+    if (pipe2(child_pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+        fail("can't create a pipe");
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGCHLD, child_exited);
+    signal(SIGINT, interrupted);
+    signal(SIGTERM, interrupted);
+
+    double t = now();
+    uint32_t nworkers = sw->nworkers < sw->nshards - resumed ? sw->nworkers : sw->nshards - resumed;
+    sw->nconns = 0;
+    sw->conns = (struct conn *) calloc(nworkers + 1, sizeof(struct conn));
+    struct pollfd *fds = (struct pollfd *) calloc(nworkers + 3, sizeof(struct pollfd));
+    for (uint32_t w = 0; w < nworkers; w++) {
+        spawn(sw);
+    }
+    while (sw->ndone < sw->nshards) {
+        // the listening socket, the pipe of SIGCHLD, then the connections
+        uint32_t nfds = 0;
+        fds[nfds++] = {lfd, POLLIN, 0};
+        fds[nfds++] = {child_pipe[0], POLLIN, 0};
+        double wait_s = -1;
+        for (uint32_t i = 0; i < sw->nconns; i++) {
+            fds[nfds++] = {sw->conns[i].fd, POLLIN, 0};
+            if (sw->timeout > 0 && sw->conns[i].shard >= 0) {
+                double left = sw->conns[i].deadline - now();
+                wait_s = wait_s < 0 || left < wait_s ? (left > 0 ? left : 0) : wait_s;
+            }
+        }
+        if (poll(fds, nfds, wait_s < 0 ? -1 : (int) (wait_s * 1000) + 1) < 0 && errno != EINTR) {
+            fail("poll");
+        }
+        for (uint32_t i = 0; i < sw->nconns; i++) {
+            struct conn *c = &sw->conns[i];
+            if (fds[i + 2].revents) {
+                received(sw, c);
+            } else if (sw->timeout > 0 && c->shard >= 0 && now() > c->deadline) {
+                lost(sw, c);
+            }
+        }
+        reap_unconnected(sw);
+        // shards back in the queue go to the idle
+        for (uint32_t i = 0; i < sw->nconns && sw->head != sw->tail; i++) {
+            if (sw->conns[i].fd >= 0 && sw->conns[i].hello && sw->conns[i].shard < 0) {
+                assign(sw, &sw->conns[i]);
+            }
+        }
+        // compact the connections, then accept
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < sw->nconns; i++) {
+            if (sw->conns[i].fd >= 0) {
+                sw->conns[n++] = sw->conns[i];
+            }
+        }
+        sw->nconns = n;
+        if (fds[0].revents & POLLIN) {
+            int fd = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd >= 0 && sw->nconns < nworkers + 1) {
+                sw->conns[sw->nconns++] = {fd, claim_child(sw, fd), false, -1, 0};
+            } else if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+    t = now() - t;
+
+    for (uint32_t i = 0; i < sw->nconns; i++) {
+        send_header(sw->conns[i].fd, SWEEP_BYE, 0, 0, 0, 0);
+        close(sw->conns[i].fd);
+    }
+    while (sw->live && wait(nullptr) > 0) {
+        sw->live--;
+    }
+    close(lfd);
+    unlink(socket_path);
+    rmdir(socket_dir);
+    close(sw->out);
+    close(sw->ckpt);
+    char ckpt_path[4096];
+    snprintf(ckpt_path, sizeof(ckpt_path), "%s.ckpt", file);
+    unlink(ckpt_path);
+
+    printf("%llu shards (%llu resumed) on %u workers (%u respawned) in %.2f s, %.0f items/s, "
+           "%llu items did not halt\n", (unsigned long long) sw->nshards, (unsigned long long) resumed, nworkers,
+           sw->respawned, t, sw->items / t, (unsigned long long) sw->stopped);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct sweep sw = {};
+    sw.shard_size = 65536;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    sw.nworkers = cores > 0 ? cores : 1;
+    const char *file = "sweep.bin";
+    const char *socket_path = nullptr;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:s:t:x:o:w:")) != -1) {
+        switch (opt) {
+            case 'j':
+                sw.nworkers = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                sw.shard_size = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                sw.timeout = strtod(optarg, NULL);
+                break;
+            case 'x':
+                sw.crash_one_in = strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                file = optarg;
+                break;
+            case 'w':
+                socket_path = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (socket_path) {
+        return worker(socket_path, sw.crash_one_in);
+    }
+    if (argc - optind < 3 || !sw.nworkers || !sw.shard_size || sw.shard_size > SWEEP_MAX_SHARD) {
+        usage();
+    }
+    char *end;
+    unsigned long long first = strtoull(argv[optind], &end, 10), last = strtoull(argv[optind + 1], &end, 10);
+    if (first > last || last > UINT32_MAX) {
+        usage();
+    }
+    sw.first = first;
+    sw.count = last - first + 1;
+    sw.nprogs = argc - optind - 2;
+    uint32_t *progs = (uint32_t *) calloc(sw.nprogs, sizeof(uint32_t));
+    for (uint32_t i = 0; i < sw.nprogs; i++) {
+        const char *name = argv[optind + 2 + i];
+        progs[i] = NPROGRAMS;
+        for (uint32_t p = 0; p < NPROGRAMS; p++) {
+            if (!strcmp(name, programs[p].name)) {
+                progs[i] = p;
+            }
+        }
+        if (progs[i] == NPROGRAMS) {
+            printf("no program %s\n", name);
+            return 1;
+        }
+    }
+    sw.progs = progs;
+    return coordinate(&sw, file);
+}
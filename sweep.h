@@ -0,0 +1,46 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <cstdint>
+
+// --------------------------------------------------
+// SHARDED SWEEPS
+// --------------------------------------------------
+//
+// A sweep runs programs over every r0 of a range, each in a fresh state with a zeroed data segment,
+// and writes the r0 after each halts to one file: a little-endian uint32 per input, ordered by
+// program, then by input. The coordinator (sweep.cpp) splits it into shards of consecutive inputs
+// and hands them to worker processes over stream sockets, one shard at a time, so faster workers
+// take more of them. A worker that dies or overruns the timeout loses its shard back to the queue,
+// and is killed and replaced if the coordinator forked it. A shard that fails SWEEP_ATTEMPTS times
+// stops the sweep, and so do SWEEP_ATTEMPTS forked workers in a row that exit before they connect.
+// Each result is written at its place in the file as it arrives, then recorded as done in a
+// checkpoint next to it (<file>.ckpt), from which a stopped sweep resumes. The checkpoint is
+// removed at the end.
+//
+// The protocol only needs a byte stream: the workers are local processes on a Unix socket, but
+// nothing in it assumes the same host. Every message is a header of five little-endian uint32,
+// the type and four fields, then a payload:
+//
+//   worker      -> coordinator  SWEEP_HELLO   version, pid (0 if not local; only informative, the
+//                                             coordinator knows its workers by SO_PEERCRED)
+//   coordinator -> worker       SWEEP_TASK    shard, first r0, count, code length; the code
+//   worker      -> coordinator  SWEEP_RESULT  shard, count, items that stopped on anything but
+//                                             a halt (their r0 is the one they stopped at); the
+//                                             r0 of each
+//   coordinator -> worker       SWEEP_BYE     no more shards
+
+#define SWEEP_VERSION 1
+
+#define SWEEP_HELLO 1
+#define SWEEP_TASK 2
+#define SWEEP_RESULT 3
+#define SWEEP_BYE 4
+
+#define SWEEP_HEADER_WORDS 5
+#define SWEEP_MAX_CODE 0x10000
+#define SWEEP_MAX_SHARD (1u << 24)
+
+#define SWEEP_ATTEMPTS 3
+
+#endif
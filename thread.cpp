@@ -0,0 +1,332 @@
+#include <atomic>
+#include <cstdlib>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "thread.h"
+
+struct vm_thread {
+    struct state st;
+    bool done; // guarded by the runtime's lock, like joiners
+    struct vm_thread *joiners; // parked until this thread halts
+    struct vm_thread *next; // in the joiners of another thread
+};
+
+// a ring of THREADS_MAX slots, each thread is in at most one deque
+struct deque {
+    pthread_mutex_t lock;
+    struct vm_thread **items;
+    uint32_t top; // stolen from
+    uint32_t bottom; // pushed to and popped from
+};
+
+struct threads_runtime {
+    const uint8_t *code;
+    uint32_t len;
+    std::atomic<struct vm_thread *> threads[THREADS_MAX]; // by id, the first thread is 0
+    std::atomic<uint32_t> nthreads; // ids handed out, may run past THREADS_MAX
+    // LIVE per thread that has not halted, plus ACTIVE per thread queued or being run (parked ones
+    // are not), in one word so that both are read at once: no active with live threads is a deadlock
+    std::atomic<uint64_t> counts;
+    std::atomic<int> result; // VM_CONTINUE while running
+    std::atomic<uint64_t> steals;
+    pthread_mutex_t lock; // joins
+    struct deque *deques;
+    uint32_t nworkers;
+};
+
+#define LIVE (1ull << 32)
+#define ACTIVE 1ull
+
+// the thread instructions are not in insn_length, no other engine runs them
+static uint32_t thread_insn_length(uint8_t opcode) {
+    switch (opcode) {
+#define THREAD_LENGTH(op, len) \
+        case op:               \
+            return len;
+        VM_THREADS(THREAD_LENGTH)
+#undef THREAD_LENGTH
+        default:
+            return insn_length(opcode);
+    }
+}
+
+// --------------------------------------------------
+// SCHEDULING
+// --------------------------------------------------
+
+static void push(struct deque *d, struct vm_thread *t) {
+    pthread_mutex_lock(&d->lock);
+    d->items[d->bottom++ % THREADS_MAX] = t;
+    pthread_mutex_unlock(&d->lock);
+}
+
+static struct vm_thread *pop(struct deque *d) {
+    struct vm_thread *t = nullptr;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom != d->top) {
+        t = d->items[--d->bottom % THREADS_MAX];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return t;
+}
+
+static struct vm_thread *steal(struct deque *d) {
+    struct vm_thread *t = nullptr;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom != d->top) {
+        t = d->items[d->top++ % THREADS_MAX];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return t;
+}
+
+// the next thread for worker w, its own newest or another's oldest
+static struct vm_thread *next_thread(struct threads_runtime *rt, uint32_t w) {
+    struct vm_thread *t = pop(&rt->deques[w]);
+    for (uint32_t i = 1; !t && i < rt->nworkers; i++) {
+        t = steal(&rt->deques[(w + i) % rt->nworkers]);
+        if (t) {
+            rt->steals++;
+        }
+    }
+    return t;
+}
+
+static void stop(struct threads_runtime *rt, int result) {
+    int running = VM_CONTINUE;
+    rt->result.compare_exchange_strong(running, result);
+}
+
+// the id of a new thread at pc with a copy of st in which rdst is 0, or 0 if there are too many
+static uint32_t spawn(struct threads_runtime *rt, uint32_t w, const struct state *st, uint8_t rdst, uint32_t pc) {
+    uint32_t id = rt->nthreads++;
+    if (id >= THREADS_MAX) {
+        return 0;
+    }
+    struct vm_thread *t = (struct vm_thread *) calloc(1, sizeof(struct vm_thread));
+    t->st = *st;
+    t->st.regfile[rdst] = 0;
+    t->st.pc = pc;
+    rt->threads[id] = t;
+    rt->counts += LIVE + ACTIVE;
+    push(&rt->deques[w], t);
+    return id;
+}
+
+// park t until the thread with the given id halts, false if it already has (or never existed)
+static bool park(struct threads_runtime *rt, struct vm_thread *t, uint32_t id) {
+    struct vm_thread *target = id && id < THREADS_MAX ? rt->threads[id].load() : nullptr;
+    if (!target) {
+        return false;
+    }
+    pthread_mutex_lock(&rt->lock);
+    bool wait = !target->done;
+    if (wait) {
+        t->next = target->joiners;
+        target->joiners = t;
+        rt->counts -= ACTIVE;
+    }
+    pthread_mutex_unlock(&rt->lock);
+    return wait;
+}
+
+static void halt(struct threads_runtime *rt, uint32_t w, struct vm_thread *t) {
+    pthread_mutex_lock(&rt->lock);
+    t->done = true;
+    struct vm_thread *joiners = t->joiners;
+    t->joiners = nullptr;
+    pthread_mutex_unlock(&rt->lock);
+    while (joiners) {
+        struct vm_thread *next = joiners->next;
+        rt->counts += ACTIVE;
+        push(&rt->deques[w], joiners);
+        joiners = next;
+    }
+    rt->counts -= LIVE + ACTIVE;
+}
+
+// --------------------------------------------------
+// VM INTERPRETER
+// runs one slice of a thread
+// --------------------------------------------------
+
+// the thread was parked in a join
+#define THREAD_PARKED (-1)
+
+#define OP1 (*op1)
+#define OP2 (*op2)
+#define OFF off
+
+static int run_slice(struct threads_runtime *rt, uint32_t w, struct vm_thread *t) {
+    const uint8_t *code = rt->code;
+    struct state *st = &t->st;
+    uint32_t budget = THREADS_SLICE;
+    while (1) {
+        uint32_t pc = st->pc;
+        if (pc >= rt->len) {
+            return VM_BAD_PC;
+        }
+        uint32_t n = thread_insn_length(code[pc]);
+        if (n == 0 || pc + n > rt->len) {
+            return VM_ILLEGAL;
+        }
+        const uint8_t *op1 = &code[pc + 1];
+        const uint8_t *op2 = &code[pc + 2];
+        switch (code[pc]) {
+#define INSN(op, len, handler) \
+            case op:           \
+                handler;       \
+                st->pc += len; \
+                continue;
+            VM_INSNS(INSN)
+#undef INSN
+            case 'B': {
+                int32_t off = read32(&code[pc + 2]);
+                switch (code[pc + 1]) {
+#define BRANCH(cc, handler) \
+                    case cc:        \
+                        handler;    \
+                        break;
+                    VM_BRANCHES(BRANCH)
+#undef BRANCH
+                    default:
+                        return VM_ILLEGAL;
+                }
+                st->pc += 6;
+                if (st->pc <= pc && --budget == 0) {
+                    return VM_CONTINUE;
+                }
+                continue;
+            }
+#define JUMP(op, len, handler)                        \
+            case op:                                  \
+                handler;                              \
+                if (st->pc <= pc && --budget == 0) {  \
+                    return VM_CONTINUE;               \
+                }                                     \
+                continue;
+            VM_JUMPS(JUMP)
+#undef JUMP
+            case 'T':
+                st->regfile[OP1] = spawn(rt, w, st, OP1, st->regfile[OP2]);
+                st->pc += 3;
+                continue;
+            case 'Y':
+                st->pc += 2;
+                if (park(rt, t, st->regfile[OP1])) {
+                    return THREAD_PARKED;
+                }
+                continue;
+            case 'H':
+                return VM_HALT;
+            default:
+                return VM_ILLEGAL;
+        }
+    }
+}
+
+#undef OP1
+#undef OP2
+#undef OFF
+
+// --------------------------------------------------
+// WORKERS
+// --------------------------------------------------
+
+struct worker_arg {
+    struct threads_runtime *rt;
+    uint32_t w;
+};
+
+static void *worker(void *arg) {
+    struct threads_runtime *rt = ((struct worker_arg *) arg)->rt;
+    uint32_t w = ((struct worker_arg *) arg)->w;
+    while (rt->result == VM_CONTINUE) {
+        struct vm_thread *t = next_thread(rt, w);
+        if (!t) {
+            uint64_t counts = rt->counts;
+            if (counts / LIVE == 0) {
+                stop(rt, VM_HALT);
+            } else if (counts % LIVE == 0) {
+                stop(rt, VM_DEADLOCK);
+            }
+            sched_yield();
+            continue;
+        }
+        int res = run_slice(rt, w, t);
+        if (res == VM_CONTINUE) {
+            push(&rt->deques[w], t);
+        } else if (res == VM_HALT) {
+            halt(rt, w, t);
+        } else if (res != THREAD_PARKED) {
+            stop(rt, res);
+        }
+    }
+    return nullptr;
+}
+
+int threads_run(const uint8_t *code, uint32_t len, struct state *st, uint32_t workers,
+                struct threads_stats *stats) {
+    if (workers == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cores > 0 ? cores : 1;
+    }
+    struct threads_runtime *rt = new struct threads_runtime();
+    rt->code = code;
+    rt->len = len;
+    rt->result = VM_CONTINUE;
+    pthread_mutex_init(&rt->lock, nullptr);
+    rt->nworkers = workers;
+    rt->deques = (struct deque *) calloc(workers, sizeof(struct deque));
+    for (uint32_t w = 0; w < workers; w++) {
+        pthread_mutex_init(&rt->deques[w].lock, nullptr);
+        rt->deques[w].items = (struct vm_thread **) calloc(THREADS_MAX, sizeof(struct vm_thread *));
+    }
+
+    // the first thread, then the calling thread is worker 0
+    struct vm_thread *first = (struct vm_thread *) calloc(1, sizeof(struct vm_thread));
+    first->st = *st;
+    rt->threads[0] = first;
+    rt->nthreads = 1;
+    rt->counts = LIVE + ACTIVE;
+    push(&rt->deques[0], first);
+
+    pthread_t *threads = (pthread_t *) calloc(workers, sizeof(pthread_t));
+    struct worker_arg *args = (struct worker_arg *) calloc(workers, sizeof(struct worker_arg));
+    for (uint32_t w = 0; w < workers; w++) {
+        args[w] = {rt, w};
+    }
+    // as many workers as can be created: the others' deques stay empty, since a worker only pushes
+    // onto its own, and are only looked at to steal from
+    uint32_t started = 1;
+    while (started < workers && pthread_create(&threads[started], nullptr, worker, &args[started]) == 0) {
+        started++;
+    }
+    worker(&args[0]);
+    for (uint32_t w = 1; w < started; w++) {
+        pthread_join(threads[w], nullptr);
+    }
+
+    *st = first->st;
+    int result = rt->result;
+    uint32_t n = rt->nthreads < THREADS_MAX ? rt->nthreads.load() : THREADS_MAX;
+    if (stats) {
+        *stats = {started, n, rt->steals};
+    }
+    for (uint32_t id = 0; id < n; id++) {
+        free(rt->threads[id].load());
+    }
+    for (uint32_t w = 0; w < workers; w++) {
+        pthread_mutex_destroy(&rt->deques[w].lock);
+        free(rt->deques[w].items);
+    }
+    pthread_mutex_destroy(&rt->lock);
+    free(rt->deques);
+    free(threads);
+    free(args);
+    delete rt;
+    return result;
+}
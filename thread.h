@@ -0,0 +1,41 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+#include <cstdint>
+
+#include "vm.h"
+
+// --------------------------------------------------
+// VM THREADS
+// --------------------------------------------------
+//
+// Runs a program whose VM threads (spawned with 'T' and joined with 'Y', see VM_THREADS in vm.h)
+// share its data segment, on a pool of host workers with work stealing. Each worker has a deque of
+// runnable VM threads: it runs the one at the bottom for a slice of THREADS_SLICE back edges and
+// pushes it back, a spawned thread is pushed to the bottom of the spawning worker's deque, and a
+// worker whose deque is empty steals from the top of another's. Spawned work spreads over the
+// workers while each mostly runs the threads it spawned itself. A thread joining one that has not
+// halted is parked on it instead of being requeued, and is requeued by the halting thread.
+//
+// Threads only share the data segment, and synchronize through it with K, P and C (see vm.h).
+
+#define THREADS_MAX 4096
+#define THREADS_SLICE 1000
+
+// every thread that has not halted is parked in a join
+#define VM_DEADLOCK 4
+
+struct threads_stats {
+    uint32_t workers; // that could be started, fewer than asked for if thread creation failed
+    uint32_t threads; // VM threads run, including the first
+    uint64_t steals;
+};
+
+// Run from st->pc on `workers` host threads (0 for one per core) until every VM thread has
+// halted, st is left as the state of the first thread. Returns VM_HALT, VM_DEADLOCK, or the result
+// of the first thread to stop on VM_ILLEGAL or VM_BAD_PC, which stops the others. stats may be
+// nullptr.
+int threads_run(const uint8_t *code, uint32_t len, struct state *st, uint32_t workers,
+                struct threads_stats *stats);
+
+#endif
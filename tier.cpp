@@ -0,0 +1,270 @@
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <new>
+
+#include <pthread.h>
+
+#include "block.h"
+#include "jitcache.h"
+#include "tier.h"
+
+// back edges run between checks of the counters and of the compiler thread
+#define TIER_SLICE 4096
+
+struct tier_program {
+    uint8_t *code;
+    uint32_t len;
+    struct tier_policy policy;
+    char *cache_dir;
+
+    int tier; // the highest tier entered so far
+    uint64_t count; // calls and back edges, in any tier
+    uint64_t *loops; // back edges to each pc, counted by the interpreter
+    struct vm_program *baseline;
+
+    pthread_t thread;
+    bool compiling; // the thread was started and not joined
+    std::atomic<bool> done; // the thread finished, optimized is set if it succeeded
+    vm_entry optimized;
+
+    double time[TIER_COUNT];
+    uint64_t entries[TIER_COUNT];
+    double compile_time;
+};
+
+static const char *const tier_names[TIER_COUNT] = {"interp", "baseline", "optimized"};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+bool tier_policy_parse(const char *spec, struct tier_policy *policy) {
+    policy->background = true;
+    if (!strcmp(spec, "default")) {
+        policy->baseline = 1000;
+        policy->optimize = 1000000;
+    } else if (!strcmp(spec, "interp")) {
+        policy->baseline = UINT64_MAX;
+        policy->optimize = UINT64_MAX;
+    } else if (!strcmp(spec, "baseline")) {
+        policy->baseline = 0;
+        policy->optimize = UINT64_MAX;
+    } else if (!strcmp(spec, "optimized")) {
+        policy->baseline = 0;
+        policy->optimize = 0;
+        policy->background = false;
+    } else {
+        char *end;
+        policy->baseline = strtoull(spec, &end, 10);
+        if (end == spec || *end != ',') {
+            return false;
+        }
+        const char *rest = end + 1;
+        policy->optimize = strtoull(rest, &end, 10);
+        if (end == rest || *end) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// --------------------------------------------------
+// INTERPRETER TIER
+// counts the back edges to each loop header
+// --------------------------------------------------
+
+#define OP1 (*op1)
+#define OP2 (*op2)
+#define OFF off
+
+// returns VM_CONTINUE at a loop header once a loop reached the baseline count, or after `budget`
+// back edges
+static int interp_for(struct tier_program *tp, struct state *st, uint64_t budget) {
+    const uint8_t *code = tp->code;
+    while (1) {
+        uint32_t pc = st->pc;
+        if (pc >= tp->len) {
+            return VM_BAD_PC;
+        }
+        uint32_t n = insn_length(code[pc]);
+        if (n == 0 || pc + n > tp->len) {
+            return VM_ILLEGAL;
+        }
+        const uint8_t *op1 = &code[pc + 1];
+        const uint8_t *op2 = &code[pc + 2];
+        switch (code[pc]) {
+#define INSN(op, len, handler) \
+            case op:           \
+                handler;       \
+                st->pc += len; \
+                continue;
+            VM_INSNS(INSN)
+#undef INSN
+            case 'B': {
+                int32_t off = read32(&code[pc + 2]);
+                switch (code[pc + 1]) {
+#define BRANCH(cc, handler) \
+                    case cc:        \
+                        handler;    \
+                        break;
+                    VM_BRANCHES(BRANCH)
+#undef BRANCH
+                    default:
+                        return VM_ILLEGAL;
+                }
+                st->pc += 6;
+                if (st->pc <= pc) {
+                    tp->count++;
+                    if (++tp->loops[st->pc] >= tp->policy.baseline || --budget == 0) {
+                        return VM_CONTINUE;
+                    }
+                }
+                continue;
+            }
+#define JUMP(op, len, handler)                                                         \
+            case op:                                                                   \
+                handler;                                                               \
+                if (st->pc <= pc) {                                                    \
+                    tp->count++;                                                       \
+                    if (++tp->loops[st->pc] >= tp->policy.baseline || --budget == 0) { \
+                        return VM_CONTINUE;                                            \
+                    }                                                                  \
+                }                                                                      \
+                continue;
+            VM_JUMPS(JUMP)
+#undef JUMP
+            case 'H':
+                return VM_HALT;
+            default:
+                return VM_ILLEGAL;
+        }
+    }
+}
+
+#undef OP1
+#undef OP2
+#undef OFF
+
+// --------------------------------------------------
+// OPTIMIZED TIER
+// compiled on a background thread
+// --------------------------------------------------
+
+static void *compile_thread(void *arg) {
+    struct tier_program *tp = (struct tier_program *) arg;
+    double t = now();
+    tp->optimized = jit_load(tp->cache_dir, tp->code, tp->len);
+    tp->compile_time = now() - t;
+    tp->done.store(true, std::memory_order_release);
+    return nullptr;
+}
+
+static void start_compile(struct tier_program *tp) {
+    if (tp->compiling || tp->done.load(std::memory_order_acquire)) {
+        return;
+    }
+    if (!tp->policy.background || pthread_create(&tp->thread, nullptr, compile_thread, tp)) {
+        compile_thread(tp);
+        return;
+    }
+    tp->compiling = true;
+}
+
+// the optimized code, if it finished compiling
+static vm_entry optimized(struct tier_program *tp) {
+    return tp->done.load(std::memory_order_acquire) ? tp->optimized : nullptr;
+}
+
+// --------------------------------------------------
+// TIER MANAGER
+// --------------------------------------------------
+
+struct tier_program *tier_new(const uint8_t *code, uint32_t len, const struct tier_policy *policy) {
+    struct tier_program *tp = (struct tier_program *) calloc(1, sizeof(struct tier_program));
+    new(&tp->done) std::atomic<bool>(false);
+    tp->code = (uint8_t *) malloc(len ? len : 1);
+    memcpy(tp->code, code, len);
+    tp->len = len;
+    tp->policy = *policy;
+    tp->cache_dir = strdup(policy->cache_dir);
+    tp->loops = (uint64_t *) calloc(len ? len : 1, sizeof(uint64_t));
+    return tp;
+}
+
+// promote according to the counters, returns the tier to continue in at pc
+static int promote(struct tier_program *tp, uint32_t pc) {
+    if (tp->count >= tp->policy.optimize) {
+        start_compile(tp);
+    }
+    if (optimized(tp)) {
+        tp->tier = TIER_OPTIMIZED;
+    } else if (tp->tier == TIER_INTERP) {
+        if (tp->count >= tp->policy.baseline || (pc < tp->len && tp->loops[pc] >= tp->policy.baseline)) {
+            tp->tier = TIER_BASELINE;
+        }
+    }
+    return tp->tier;
+}
+
+int tier_run(struct tier_program *tp, struct state *st) {
+    tp->count++;
+    int res = VM_CONTINUE;
+    while (res == VM_CONTINUE) {
+        // every slice ends at a loop header (or the entry), where the tiers can be switched
+        int tier = promote(tp, st->pc);
+        tp->entries[tier]++;
+        double t = now();
+        switch (tier) {
+            case TIER_INTERP:
+                res = interp_for(tp, st, TIER_SLICE);
+                break;
+            case TIER_BASELINE: {
+                if (!tp->baseline) {
+                    tp->baseline = prog_translate(tp->code, tp->len);
+                }
+                uint64_t backedges = tp->baseline->backedges;
+                res = prog_run_for(tp->baseline, st, TIER_SLICE);
+                tp->count += tp->baseline->backedges - backedges;
+                break;
+            }
+            default:
+                // the highest tier, runs to the end
+                res = tp->optimized(st);
+                break;
+        }
+        tp->time[tier] += now() - t;
+    }
+    return res;
+}
+
+void tier_report(const struct tier_program *tp, FILE *out) {
+    for (int tier = 0; tier < TIER_COUNT; tier++) {
+        fprintf(out, "%-9s %10.3f ms, entered %llu times\n", tier_names[tier], tp->time[tier] * 1e3,
+                (unsigned long long) tp->entries[tier]);
+    }
+    if (tp->compiling || tp->done.load(std::memory_order_acquire)) {
+        bool done = tp->done.load(std::memory_order_acquire);
+        fprintf(out, "compile   %10.3f ms%s\n", done ? tp->compile_time * 1e3 : 0.0,
+                !done ? ", still running" : tp->optimized ? "" : ", failed");
+    }
+}
+
+void tier_free(struct tier_program *tp) {
+    if (tp->compiling) {
+        pthread_join(tp->thread, nullptr);
+    }
+    if (tp->baseline) {
+        prog_free(tp->baseline);
+    }
+    tp->done.~atomic();
+    free(tp->loops);
+    free(tp->cache_dir);
+    free(tp->code);
+    free(tp);
+}
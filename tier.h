@@ -0,0 +1,49 @@
+#ifndef TIER_H
+#define TIER_H
+
+#include <cstdint>
+#include <cstdio>
+
+#include "vm.h"
+
+// --------------------------------------------------
+// TIERED EXECUTION
+// --------------------------------------------------
+//
+// A program starts in the interpreter, which costs nothing to start. Counters promote it to the
+// block translation of block.cpp (baseline), and then to the residual program from cogen, which
+// is compiled on a background thread and cached on disk by jitcache.cpp (optimized). The program
+// keeps running in the lower tier while it compiles, and switches at the next call or loop
+// header once the code is ready, so short runs never wait for a compiler.
+
+#define TIER_INTERP 0
+#define TIER_BASELINE 1
+#define TIER_OPTIMIZED 2
+#define TIER_COUNT 3
+
+// counts are of calls plus taken back edges, UINT64_MAX never promotes
+struct tier_policy {
+    uint64_t baseline; // count of one loop header (or of the program) before the baseline tier
+    uint64_t optimize; // count of the program before the optimized tier is compiled
+    bool background; // compile on a thread, otherwise the program waits for the compiler
+    const char *cache_dir; // of the optimized tier
+};
+
+// "default", "interp", "baseline", "optimized" (compiled before the first instruction), or
+// "<baseline>,<optimize>" counts. Returns false if spec is not one of these.
+bool tier_policy_parse(const char *spec, struct tier_policy *policy);
+
+struct tier_program;
+
+struct tier_program *tier_new(const uint8_t *code, uint32_t len, const struct tier_policy *policy);
+
+// Run from st->pc in the best tier available, returns VM_HALT, VM_ILLEGAL or VM_BAD_PC.
+int tier_run(struct tier_program *tp, struct state *st);
+
+// time spent in each tier, and compiling
+void tier_report(const struct tier_program *tp, FILE *out);
+
+// waits for a compilation in progress, so that it lands in the cache
+void tier_free(struct tier_program *tp);
+
+#endif
@@ -0,0 +1,201 @@
+#include <cstdlib>
+
+#include "verify.h"
+
+// --------------------------------------------------
+// VERIFICATION
+// --------------------------------------------------
+
+static bool valid_condition(uint8_t cc) {
+    switch (cc) {
+#define BRANCH_COND(cc, handler) case cc:
+        VM_BRANCHES(BRANCH_COND)
+#undef BRANCH_COND
+            return true;
+        default:
+            return false;
+    }
+}
+
+// the register operands of an instruction of n bytes, below NUM_VREGS for vector registers
+static bool valid_registers(uint8_t opcode, uint32_t n, uint8_t op1, uint8_t op2) {
+    uint32_t vregs = vreg_operands(opcode);
+    if (n > 1 && op1 >= (vregs & 1 ? NUM_VREGS : NUM_REGS)) {
+        return false;
+    }
+    return n < 3 || opcode == 'I' || op2 < (vregs & 2 ? NUM_VREGS : NUM_REGS);
+}
+
+static bool reject(struct verify_error *err, uint32_t pc, const char *msg) {
+    err->pc = pc;
+    err->msg = msg;
+    return false;
+}
+
+// whether the branch at pc ends a BE/BN pair to the same target (the idiom for an unconditional
+// branch, see pe.h), which only falls through when entered at pc
+static bool ends_pair(const uint8_t *code, uint32_t pc) {
+    if (pc < 6 || code[pc] != 'B' || code[pc - 6] != 'B') {
+        return false;
+    }
+    uint8_t a = code[pc - 5], b = code[pc + 1];
+    bool complementary = (a == 'E' && b == 'N') || (a == 'N' && b == 'E');
+    return complementary && pc + read32(&code[pc - 4]) == pc + 6 + read32(&code[pc + 2]);
+}
+
+// follow fallthrough and branches from pc 0, checking every instruction reached. The first
+// indirect jump reached makes every legal instruction decoded from pc 0 on reachable.
+static bool check(const uint8_t *code, uint32_t len, bool *start, struct verify_error *err) {
+    if (len == 0) {
+        return reject(err, 0, "empty program");
+    }
+    bool *covered = (bool *) calloc(len, sizeof(bool));
+    bool *targeted = (bool *) calloc(len, sizeof(bool));
+    // every instruction is pushed by at most its fallthrough, one branch and the first jump
+    uint32_t *work = (uint32_t *) malloc((3 * len + 1) * sizeof(uint32_t));
+    uint32_t nwork = 0;
+    bool jumps = false;
+    uint32_t tail = len; // a BE/BN pair at the end of the code, which must not be branched into
+    work[nwork++] = 0;
+    bool ok = true;
+    while (ok && nwork) {
+        uint32_t pc = work[--nwork];
+        if (start[pc]) {
+            continue;
+        }
+        uint8_t opcode = code[pc];
+        uint32_t n = insn_length(opcode);
+        if (n == 0) {
+            ok = reject(err, pc, "illegal opcode");
+            break;
+        }
+        if (pc + n > len) {
+            ok = reject(err, pc, "instruction runs past the end of the code");
+            break;
+        }
+        for (uint32_t i = 0; i < n && ok; i++) {
+            if (covered[pc + i]) {
+                ok = reject(err, pc, "instruction overlaps another");
+            }
+            covered[pc + i] = true;
+        }
+        start[pc] = true;
+        uint8_t op1 = n > 1 ? code[pc + 1] : 0;
+        uint8_t op2 = n > 2 ? code[pc + 2] : 0;
+        if (opcode == 'B') {
+            uint32_t target = pc + n + read32(&code[pc + 2]);
+            if (!valid_condition(op1)) {
+                ok = reject(err, pc, "illegal branch condition");
+            } else if (target >= len) {
+                ok = reject(err, pc, "branch target out of range");
+            } else {
+                targeted[target] = true;
+                work[nwork++] = target;
+            }
+        } else if (!valid_registers(opcode, n, op1, op2)) {
+            ok = reject(err, pc, "register index out of range");
+        }
+        if (ok && opcode == 'J' && !jumps) {
+            jumps = true;
+            for (uint32_t at = 0, size; at < len; at += size ? size : 1) {
+                size = insn_length(code[at]);
+                if (size && at + size <= len) {
+                    work[nwork++] = at;
+                }
+            }
+        }
+        if (ok && opcode != 'H' && opcode != 'J') {
+            if (pc + n < len) {
+                work[nwork++] = pc + n;
+            } else if (ends_pair(code, pc)) {
+                tail = pc;
+            } else {
+                ok = reject(err, pc, "execution falls through past the end of the code");
+            }
+        }
+    }
+    if (ok && tail < len && (targeted[tail] || jumps || !start[tail - 6])) {
+        ok = reject(err, tail, "execution falls through past the end of the code");
+    }
+    free(work);
+    free(targeted);
+    free(covered);
+    return ok;
+}
+
+struct vm_verified *verify(const uint8_t *code, uint32_t len, struct verify_error *err) {
+    bool *start = (bool *) calloc(len ? len : 1, sizeof(bool));
+    if (!check(code, len, start, err)) {
+        free(start);
+        return nullptr;
+    }
+    struct vm_verified *v = (struct vm_verified *) calloc(1, sizeof(struct vm_verified));
+    v->code = code;
+    v->len = len;
+    v->start = start;
+    return v;
+}
+
+void verified_free(struct vm_verified *v) {
+    free(v->start);
+    free(v);
+}
+
+// --------------------------------------------------
+// VM INTERPRETER
+// unchecked, for verified bytecode
+// --------------------------------------------------
+
+#define OP1 (*op1)
+#define OP2 (*op2)
+#define OFF off
+
+int verified_run(const struct vm_verified *v, struct state *st) {
+    const uint8_t *code = v->code;
+    uint32_t code_len = v->len;
+    if (st->pc >= code_len || !v->start[st->pc]) {
+        return VM_BAD_PC;
+    }
+    while (1) {
+        uint32_t pc = st->pc;
+        const uint8_t *op1 = &code[pc + 1];
+        const uint8_t *op2 = &code[pc + 2];
+        switch (code[pc]) {
+#define INSN(op, len, handler) \
+            case op:           \
+                handler;       \
+                st->pc += len; \
+                continue;
+            VM_INSNS(INSN)
+#undef INSN
+#define JUMP(op, len, handler)                                 \
+            case op:                                           \
+                handler;                                       \
+                if (st->pc >= code_len || !v->start[st->pc]) { \
+                    return VM_BAD_PC;                          \
+                }                                              \
+                continue;
+            VM_JUMPS(JUMP)
+#undef JUMP
+            case 'B': {
+                int32_t off = read32(&code[pc + 2]);
+                switch (code[pc + 1]) {
+#define BRANCH(cc, handler) \
+                    case cc:        \
+                        handler;    \
+                        break;
+                    VM_BRANCHES(BRANCH)
+#undef BRANCH
+                    default:
+                        __builtin_unreachable();
+                }
+                st->pc += 6;
+                continue;
+            }
+            case 'H':
+                return VM_HALT;
+            default:
+                __builtin_unreachable();
+        }
+    }
+}
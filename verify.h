@@ -0,0 +1,40 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <cstdint>
+
+#include "vm.h"
+
+// --------------------------------------------------
+// VERIFIER
+// --------------------------------------------------
+//
+// Proves once, when bytecode is loaded, what the interpreters otherwise check at every instruction
+// (or assume): every instruction reachable from pc 0 decodes, its register operands are below
+// NUM_REGS (NUM_VREGS for vector registers), its operands are inside the code, branch targets are
+// the start of an instruction and no instruction runs into another or falls through past the end
+// of the code. A verified program then runs on an interpreter with all these checks compiled out.
+// The target of an indirect jump is only known at run time, so it is still checked against the
+// verified instructions.
+
+struct vm_verified {
+    const uint8_t *code; // not copied, must outlive the verified program
+    uint32_t len;
+    bool *start; // the instructions reachable from pc 0
+};
+
+struct verify_error {
+    uint32_t pc;
+    const char *msg;
+};
+
+// nullptr if the bytecode is rejected, with the first problem found in err
+struct vm_verified *verify(const uint8_t *code, uint32_t len, struct verify_error *err);
+
+// Run from st->pc without checking the instructions. Returns VM_HALT, or VM_BAD_PC if st->pc or
+// the target of an indirect jump is not a verified instruction.
+int verified_run(const struct vm_verified *v, struct state *st);
+
+void verified_free(struct vm_verified *v);
+
+#endif
@@ -1,159 +1,127 @@
+#include <array>
 #include <cerrno>
-#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <utility>
 
-// read in little endian byte order
-int32_t read32(const uint8_t *ptr) {
-    return (*ptr) + (*(ptr + 1) << 8) + (*(ptr + 2) << 16) + (*(ptr + 3) << 24);
-}
-
-// --------------------------------------------------
-// VM CODE
-// --------------------------------------------------
-
-#define NUM_REGS 16
+#include <sys/stat.h>
+#include <unistd.h>
 
-#define FLAG_N 1
-#define FLAG_Z 2
-#define FLAG_V 4
+#include "vm.h"
+#include "bytecode.h"
+#include "pe.h"
+#include "block.h"
+#include "jitcache.h"
+#include "tier.h"
+#include "verify.h"
+#include "thread.h"
+#include "super.h"
+#include "context.h"
+#include "closure.h"
+#include "isa.h"
+#include "checkpoint.h"
+#include "lazy.h"
 
-struct state {
-    // Registers
-    uint32_t regfile[NUM_REGS]; // general purpose registers: r0, r1 ... r15
-    uint32_t flags; // like x86 EFLAGS, ARM CPSR
-    uint32_t pc; // program counter
-
-    // Memory
-    uint8_t *data; // ".data" section (data segment)
-    const uint8_t *code; // ".text" section (code segment)
-    // (these could be omitted, and the address space of the VM could be the same as the process)
-};
-
-// --------------------------------------------------
+// Specialization,
+// 0 - the regular VM interpreter
+// 1 - the VM interpreter dispatch specialized to the PC
+// 2 - the VM interpreter dispatch specialized to PC "transitions"
+// 3 - like 2, but only the transitions the bytecode can take are enumerated (any program size)
+// 4 - the residual program generated by cogen, linked in from another translation unit
+// 5 - the regular VM interpreter over basic blocks translated at run time
+// 6 - like 4, but compiled at run time and cached on disk across runs
+// 7 - tiered, starting in an interpreter and promoting hot programs up to 6 (see tier.h)
+// 8 - the regular VM interpreter without its checks, over bytecode verified at load (see verify.h)
+// 9 - the regular VM interpreter on VM threads, with 'T' and 'Y' (see thread.h)
+// 10 - the VM interpreter over pre-decoded bytecode, with superinstructions mined offline (see super.h)
+// 11 - context threaded, the bytecode translated to native calls of the handlers and branches (see context.h)
+// 12 - the bytecode compiled to closures over statically compiled code, no code is generated (see closure.h)
+// 13 - the regular VM interpreter built for several ISA levels, one chosen from CPUID at startup (see isa.h)
+// 14 - the regular VM interpreter checkpointing at back edges, with a fuel limit (see checkpoint.h)
+// 15 - the VM interpreter over instructions decoded on first execution, block by block (see lazy.h)
 
-void store(struct state *st, uint8_t rptr, uint8_t rval) {
-    int8_t ptr = st->regfile[rptr];
-    uint8_t val = st->regfile[rval];
-    *(st->data + ptr) = val;
-}
+#ifndef SPEC
+#define SPEC 0
+#endif
 
-void load(struct state *st, uint8_t rptr, uint8_t rdst) {
-    int8_t ptr = st->regfile[rptr];
-    st->regfile[rdst] = *(st->data + ptr);
-}
+// Program,
+// 0 - fib
+// 1 - fib, run by the VM-in-VM `vmvm`
+// 2 - `vmvm` partially evaluated to fib by pe.h, removing the inner dispatch
 
-// arithmetic
-void setflags(struct state *st, uint64_t res) {
-    st->flags = 0;
-    if (res == 0) {
-        st->flags |= FLAG_Z;
-    }
-    if ((int32_t) res < 0) {
-        st->flags |= FLAG_N;
-    }
-    // check for overflow
-    if (res & ~((uint64_t)((uint32_t) - 1))) {
-        st->flags |= FLAG_V;
-    }
-}
+#ifndef NESTED
+#define NESTED 0
+#endif
 
-void add(struct state *st, uint8_t rdst, uint8_t rsrc) {
-    uint64_t res = st->regfile[rdst] + st->regfile[rsrc];
-    st->regfile[rdst] = (uint32_t) res;
-    setflags(st, res);
-}
+#if defined(PROGRAM)
+// another program from bytecode.h, e.g. -DPROGRAM=jstates
+#define PROGRAM_LEN (sizeof(PROGRAM) - 1)
+#elif (NESTED == 0)
+#define PROGRAM fib
+#define PROGRAM_LEN (sizeof(fib) - 1)
+#elif (NESTED == 1)
+#define PROGRAM vmvm
+#define PROGRAM_LEN (sizeof(vmvm) - 1)
+#else
+// only r0 is observed after halt
+constexpr pe_result vmvm_fib = pe_specialize(vmvm, sizeof(vmvm) - 1, fib, sizeof(fib) - 1, VMVM_CODE_SIZE, {}, 1 << 0);
+static_assert(vmvm_fib.error == nullptr, "partial evaluation of vmvm failed");
+#define PROGRAM vmvm_fib.code
+#define PROGRAM_LEN vmvm_fib.len
+#endif
 
-void sub(struct state *st, uint8_t rdst, uint8_t rsrc) {
-    uint64_t res = st->regfile[rdst] - st->regfile[rsrc];
-    st->regfile[rdst] = (uint32_t) res;
-    setflags(st, res);
-}
+// Output,
+// ONESHOT - startup-optimized for one run per process: no stdio, the output is formatted by hand
+// into one buffer and written with a single write(2) at exit (build it static-pie, see Makefile)
 
-void movr(struct state *st, uint8_t rdst, uint8_t rsrc) {
-    st->regfile[rdst] = st->regfile[rsrc];
-}
+#ifdef ONESHOT
 
-void movi(struct state *st, uint8_t rdst, uint8_t immu8) {
-    st->regfile[rdst] = immu8;
-}
+static char out[256];
+static uint32_t out_len;
 
-// branching
-void beq(struct state *st, int32_t imms32) {
-    if (st->flags & FLAG_Z) {
-        st->pc += imms32;
+static void out_str(const char *s) {
+    while (*s && out_len < sizeof(out)) {
+        out[out_len++] = *s++;
     }
 }
 
-void bne(struct state *st, int32_t imms32) {
-    if (!(st->flags & FLAG_Z)) {
-        st->pc += imms32;
+static void out_u32(uint32_t v) {
+    char digits[10];
+    int n = 0;
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    while (n && out_len < sizeof(out)) {
+        out[out_len++] = digits[--n];
     }
 }
 
-void blt(struct state *st, int32_t imms32) {
-    int n = !!(st->flags & FLAG_N);
-    int v = !!(st->flags & FLAG_V);
-    if (n != v) {
-        st->pc += imms32;
+// on every exit, also the exit(1) of the engines
+static void out_flush() {
+    if (out_len && write(1, out, out_len) < 0) {
+        _exit(1);
     }
+    out_len = 0;
 }
 
-// --------------------------------------------------
-// VM BYTECODE
-// --------------------------------------------------
-
-// Compute the nth fibonacci number.
-// r0 is both the parameter and result uint8_t.
-//
-// f(0) = 1
-// f(1) = 1
-// f(2) = 2
-// f(3) = 3
-// f(4) = 5
-// f(5) = 8
-// ...
-//
-constexpr uint8_t
-fib[] =
-"M\x03\x00" // r3 := r0
-"I\x01\x01" // r1 := 1
-"I\x02\x01" // r2 := 1
-
-// if r3 < 2 -> halt
-"I\x04\x02" // r4 := 2
-"M\x05\x03" // r5 := r3
-"U\x05\x04" // r5 := r5 - r4
-"BL\x1b\x00\x00\x00"
-
-// loop begin
-
-"I\x05\x01" // r5 := 1
-"U\x03\x05" // r3 := r3 - r5
-"M\x04\x02" // r4 := r2
-"A\x02\x01" // r2 := r2 + r1
-"M\x01\x04" // r1 := r4
-"I\x06\x00" // r6 := 0
-"A\x06\x03" // r6 := r6 + r3
-"BN\xe5\xff\xff\xff" // if r3 != 0 -> loop entry
-
-// loop end (+0x1b bytes)
-
-"I\x00\x00" // r0 := 0
-"S\x00\x02" // *r0 := r2
-"L\x00\x00" // r0 := *r0
-"H" // halt
-;
+// for the engines, which report with puts
+static int out_puts(const char *s) {
+    out_str(s);
+    out_str("\n");
+    return 0;
+}
 
-// Specialization,
-// 0 - the regular VM interpreter
-// 1 - the VM interpreter dispatch specialized to the PC
-// 2 - the VM interpreter dispatch specialized to PC "transitions"
+#define puts out_puts
 
-#ifndef SPEC
-#define SPEC 0
 #endif
 
+// operands of the handlers in VM_INSNS and VM_BRANCHES
+#define OP1 (*op1)
+#define OP2 (*op2)
+#define OFF off
+
 // --------------------------------------------------
 // VM INTERPRETER
 // --------------------------------------------------
@@ -171,53 +139,36 @@ void interp(struct state *st) {
         const uint8_t *op1 = &code[pc + 1];
         const uint8_t *op2 = &code[pc + 2];
         switch (opcode) {
-            case 'S':
-                store(st, *op1, *op2);
-                st->pc += 3;
+#define INSN(op, len, handler) \
+            case op:           \
+                handler;       \
+                st->pc += len; \
                 break;
-            case 'L':
-                load(st, *op1, *op2);
-                st->pc += 3;
-                break;
-            case 'A':
-                add(st, *op1, *op2);
-                st->pc += 3;
-                break;
-            case 'U':
-                sub(st, *op1, *op2);
-                st->pc += 3;
+            VM_INSNS(INSN)
+#undef INSN
+#define JUMP(op, len, handler) \
+            case op:           \
+                handler;       \
                 break;
+            VM_JUMPS(JUMP)
+#undef JUMP
             case 'B': {
                 // assume no oob
                 char cc = code[pc + 1];
                 int32_t off = read32(&code[pc + 2]);
                 switch (cc) {
-                    case 'E':
-                        // beq
-                        beq(st, off);
-                        break;
-                    case 'N':
-                        // bne
-                        bne(st, off);
-                        break;
-                    case 'L':
-                        // blt
-                        blt(st, off);
+#define BRANCH(cc, handler) \
+                    case cc:        \
+                        handler;    \
                         break;
+                    VM_BRANCHES(BRANCH)
+#undef BRANCH
                     default:
                         goto illegal;
                 }
                 st->pc += 6;
                 break;
             }
-            case 'M':
-                movr(st, *op1, *op2);
-                st->pc += 3;
-                break;
-            case 'I':
-                movi(st, *op1, *op2);
-                st->pc += 3;
-                break;
             case 'H':
                 puts("halt");
                 return;
@@ -244,6 +195,60 @@ struct U8Array {
     uint8_t value[N];
 };
 
+// The value of the source register of the 3 byte instruction at pc, when it is only reached from the
+// instruction decoded right before it and that is `I` into the register. Nothing else reaches pc
+// if no branch targets it and there is no indirect jump; a branch into the middle of an
+// instruction could fall through to pc from differently decoded bytes, so it gives up on those too.
+template<U8Array ccode>
+constexpr pe_value known_operand(uint32_t pc) {
+    const uint8_t *code = ccode.value;
+    uint32_t len = sizeof(ccode.value) - 1;
+    if (pc + 3 > len) {
+        return {false, 0};
+    }
+    switch (code[pc]) {
+#define CONST_INSN(op, handler) case op:
+        VM_CONST_INSNS(CONST_INSN)
+#undef CONST_INSN
+            break;
+        default:
+            return {false, 0};
+    }
+    uint32_t prev = PE_NONE;
+    for (uint32_t at = 0; at < len;) {
+        uint32_t n = insn_length(code[at]);
+        if (at + n == pc) {
+            prev = at;
+        }
+        at += n ? n : 1;
+    }
+    for (uint32_t at = 0; at < len;) {
+        uint32_t n = insn_length(code[at]);
+        if (code[at] == 'J') {
+            return {false, 0};
+        }
+        if (code[at] == 'B' && at + 6 <= len) {
+            uint32_t target = at + 6 + read32(&code[at + 2]);
+            if (target == pc) {
+                return {false, 0};
+            }
+            bool boundary = target >= len;
+            for (uint32_t b = 0; b < len && !boundary;) {
+                boundary = b == target;
+                b += insn_length(code[b]) ? insn_length(code[b]) : 1;
+            }
+            if (!boundary) {
+                return {false, 0};
+            }
+        }
+        at += n ? n : 1;
+    }
+    if (prev == PE_NONE || code[prev] != 'I' || code[prev + 1] != code[pc + 2]) {
+        return {false, 0};
+    }
+    return {true, code[prev + 2]};
+}
+
 // --------------------------------------------------
 // VM INTERPRETER
 // interpreter is specialized to code and program counter
@@ -258,62 +263,62 @@ static int interp_body(struct state *st) {
 #endif
     const uint8_t *op1 = &code[pc + 1];
     const uint8_t *op2 = &code[pc + 2];
+    // a shift or multiplication by a known constant is a single host instruction
+    constexpr pe_value known = known_operand<ccode>(pc);
+    if constexpr (known.known) {
+#undef OP2
+#define OP2 (known.val)
+        switch (opcode) {
+#define CONST_INSN(op, handler) \
+            case op:            \
+                handler;        \
+                st->pc += 3;    \
+                return VM_CONTINUE;
+            VM_CONST_INSNS(CONST_INSN)
+#undef CONST_INSN
+        }
+#undef OP2
+#define OP2 (*op2)
+    }
     switch (opcode) {
-        case 'S':
-            store(st, *op1, *op2);
-            st->pc += 3;
-            break;
-        case 'L':
-            load(st, *op1, *op2);
-            st->pc += 3;
-            break;
-        case 'A':
-            add(st, *op1, *op2);
-            st->pc += 3;
+#define INSN(op, len, handler) \
+        case op:               \
+            handler;           \
+            st->pc += len;     \
             break;
-        case 'U':
-            sub(st, *op1, *op2);
-            st->pc += 3;
+        VM_INSNS(INSN)
+#undef INSN
+#define JUMP(op, len, handler) \
+        case op:               \
+            handler;           \
             break;
+        VM_JUMPS(JUMP)
+#undef JUMP
         case 'B': {
             // assume no oob
             char cc = code[pc + 1];
             int32_t off = read32(&code[pc + 2]);
             switch (cc) {
-                case 'E':
-                    // beq
-                    beq(st, off);
-                    break;
-                case 'N':
-                    // bne
-                    bne(st, off);
-                    break;
-                case 'L':
-                    // blt
-                    blt(st, off);
+#define BRANCH(cc, handler) \
+                case cc:            \
+                    handler;        \
                     break;
+                VM_BRANCHES(BRANCH)
+#undef BRANCH
                 default:
                     goto illegal;
             }
             st->pc += 6;
             break;
         }
-        case 'M':
-            movr(st, *op1, *op2);
-            st->pc += 3;
-            break;
-        case 'I':
-            movi(st, *op1, *op2);
-            st->pc += 3;
-            break;
         case 'H':
-            return 0;
+            return VM_HALT;
         default:
             goto illegal;
     }
-    return 2;
+    return VM_CONTINUE;
     illegal:
-    return 1;
+    return VM_ILLEGAL;
 }
 
 #if (SPEC == 1)
@@ -325,11 +330,11 @@ static int interp_body(struct state *st) {
 
 #define DISPATCHSPEC(X) case X:             \
   st->pc = X;                               \
-  res = interp_body<X, U8Array(fib)>(st);   \
-  if (res == 0) {                           \
+  res = interp_body<X, U8Array(PROGRAM)>(st); \
+  if (res == VM_HALT) {                     \
     goto halt;                              \
   }                                         \
-  if (res == 1) {                           \
+  if (res == VM_ILLEGAL) {                  \
     goto illegal;                           \
   }                                         \
   break;
@@ -434,11 +439,11 @@ extern void dummy(uint32_t X, uint32_t Y);
 #define DISPATCHSPECPOST(X, Y) case Y: { dummy(X, Y); goto lab_##Y; }
 #define DISPATCHSPEC(X) case X: lab_##X:    \
   st->pc = X;                               \
-  res = interp_body<X, U8Array(fib)>(st);   \
-  if (res == 0) {                           \
+  res = interp_body<X, U8Array(PROGRAM)>(st); \
+  if (res == VM_HALT) {                     \
     goto halt;                              \
   }                                         \
-  if (res == 1) {                           \
+  if (res == VM_ILLEGAL) {                  \
     goto illegal;                           \
   }                                         \
   switch (st->pc) {                         \
@@ -593,22 +598,487 @@ large_pc:
 
 #endif
 
+#if (SPEC == 3)
+
+// --------------------------------------------------
+// VM INTERPRETER
+// dispatch is specialized to the PC transitions of each instruction
+// --------------------------------------------------
+
+// The successors of each instruction are taken from its decoding instead of a switch over every
+// PC, so only reachable PCs are instantiated and the dispatch is not limited to 64 bytes of
+// bytecode. Each PC is a function tail calling its successors, which clang turns into jumps.
+// An indirect jump has no static successor, it goes through a table of every instruction.
+#if defined(__clang__)
+#define MUSTTAIL [[clang::musttail]]
+#else
+#define MUSTTAIL
+#endif
+
+template<uint32_t pc, U8Array ccode>
+static int interp_trans(struct state *st);
+
+typedef int (*interp_entry)(struct state *st);
+
+// whether pc starts a complete instruction, decoding from 0
+template<U8Array ccode>
+constexpr bool insn_boundary(uint32_t pc) {
+    for (uint32_t at = 0; at < sizeof(ccode.value) - 1;) {
+        uint32_t n = insn_length(ccode.value[at]);
+        if (at == pc) {
+            return n && at + n < sizeof(ccode.value);
+        }
+        at += n ? n : 1;
+    }
+    return false;
+}
+
+template<uint32_t pc, U8Array ccode>
+constexpr interp_entry jump_entry() {
+    if constexpr (insn_boundary<ccode>(pc)) {
+        return interp_trans<pc, ccode>;
+    } else {
+        return nullptr;
+    }
+}
+
+// the dense table of every instruction, for the targets of indirect jumps
+template<U8Array ccode, uint32_t... pcs>
+constexpr std::array<interp_entry, sizeof...(pcs)> jump_table(std::integer_sequence<uint32_t, pcs...>) {
+    return {jump_entry<pcs, ccode>()...};
+}
+
+template<uint32_t pc, U8Array ccode>
+static int interp_trans(struct state *st) {
+    st->pc = pc;
+    int res = interp_body<pc, ccode>(st);
+    if (res != VM_CONTINUE) {
+        return res;
+    }
+    constexpr uint8_t opcode = ccode.value[pc];
+    constexpr uint32_t next = pc + insn_length(opcode);
+    if constexpr (opcode == 'J') {
+        static constexpr auto table =
+                jump_table<ccode>(std::make_integer_sequence<uint32_t, sizeof(ccode.value) - 1>());
+        if (st->pc < table.size() && table[st->pc]) {
+            MUSTTAIL return table[st->pc](st);
+        }
+        return VM_BAD_PC;
+    }
+    if constexpr (opcode == 'B') {
+        constexpr uint32_t target = next + read32(&ccode.value[pc + 2]);
+        if constexpr (target < sizeof(ccode.value)) {
+            if (st->pc == target) {
+                MUSTTAIL return interp_trans<target, ccode>(st);
+            }
+        }
+    }
+    if constexpr (opcode != 'H' && next > pc && next < sizeof(ccode.value)) {
+        if (st->pc == next) {
+            MUSTTAIL return interp_trans<next, ccode>(st);
+        }
+    }
+    return VM_BAD_PC;
+}
+
+void interp(struct state *st) {
+    if (st->pc != 0) {
+        goto large_pc;
+    }
+    switch (interp_trans<0, U8Array(PROGRAM)>(st)) {
+        case VM_HALT:
+            puts("halt");
+            return;
+        case VM_ILLEGAL:
+            goto illegal;
+        default:
+            goto large_pc;
+    }
+illegal:
+    puts("illegal instruction");
+    exit(1);
+large_pc:
+    puts("pc was too large at runtime");
+    exit(1);
+}
+
+#endif
+
+#if (SPEC >= 4)
+
+// The result of a run of one of the engines below, as interp reports it; returns only on a halt.
+// Those that report on themselves do it on stderr, so that the output is the same for all.
+static void report(int res) {
+    switch (res) {
+        case VM_HALT:
+            puts("halt");
+            return;
+        case VM_ILLEGAL:
+            puts("illegal instruction");
+            exit(1);
+        default:
+            puts("pc was too large at runtime");
+            exit(1);
+    }
+}
+
+#endif
+
+#if (SPEC == 4)
+
+// --------------------------------------------------
+// VM INTERPRETER
+// generated ahead of time by cogen (see cogen.cpp)
+// --------------------------------------------------
+
+extern "C" int vm_run(struct state *st);
+
+void interp(struct state *st) {
+    report(vm_run(st));
+}
+
+#endif
+
+#if (SPEC == 5)
+
+// --------------------------------------------------
+// VM INTERPRETER
+// over basic blocks translated at run time (see block.cpp)
+// --------------------------------------------------
+
+void interp(struct state *st) {
+    struct vm_program *prog = prog_translate(st->code, PROGRAM_LEN);
+    int res = prog_run(prog, st);
+    prog_free(prog);
+    report(res);
+}
+
+#endif
+
+#if (SPEC == 6 || SPEC == 7)
+
+// the cache directory: VM_CACHE_DIR, or vm-cache in $XDG_CACHE_HOME or ~/.cache
+static void cache_dir(char *dir, size_t size) {
+    const char *env = getenv("VM_CACHE_DIR");
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (env && *env) {
+        snprintf(dir, size, "%s", env);
+    } else if (xdg && *xdg == '/') {
+        snprintf(dir, size, "%s/vm-cache", xdg);
+    } else if (home && *home) {
+        snprintf(dir, size, "%s/.cache", home);
+        mkdir(dir, 0700);
+        snprintf(dir, size, "%s/.cache/vm-cache", home);
+    } else {
+        snprintf(dir, size, "/tmp/vm-cache-%u", (unsigned) getuid());
+    }
+}
+
+#endif
+
+#if (SPEC == 6)
+
+// --------------------------------------------------
+// VM INTERPRETER
+// generated by cogen at run time, compiled once and cached (see jitcache.cpp)
+// --------------------------------------------------
+
+void interp(struct state *st) {
+    char dir[4096];
+    cache_dir(dir, sizeof(dir));
+    vm_entry entry = jit_load(dir, st->code, PROGRAM_LEN);
+    if (!entry) {
+        printf("could not compile the program into %s, or it is not a private directory\n", dir);
+        exit(1);
+    }
+    report(entry(st));
+}
+
+#endif
+
+#if (SPEC == 7)
+
+// --------------------------------------------------
+// VM INTERPRETER
+// tiered, the tier is chosen at run time (see tier.cpp)
+// --------------------------------------------------
+
+// the policy is taken from the VM_TIER environment variable, see tier_policy_parse
+void interp(struct state *st) {
+    char dir[4096];
+    cache_dir(dir, sizeof(dir));
+    struct tier_policy policy;
+    const char *spec = getenv("VM_TIER");
+    if (!tier_policy_parse(spec && *spec ? spec : "default", &policy)) {
+        puts("invalid VM_TIER");
+        exit(1);
+    }
+    policy.cache_dir = dir;
+    struct tier_program *tp = tier_new(st->code, PROGRAM_LEN, &policy);
+    int res = tier_run(tp, st);
+    tier_report(tp, stderr);
+    tier_free(tp);
+    report(res);
+}
+
+#endif
+
+#if (SPEC == 8)
+
+// --------------------------------------------------
+// VM INTERPRETER
+// unchecked, over bytecode verified once at load (see verify.cpp)
+// --------------------------------------------------
+
+void interp(struct state *st) {
+    struct verify_error err;
+    struct vm_verified *v = verify(st->code, PROGRAM_LEN, &err);
+    if (!v) {
+        printf("bytecode rejected at pc %u: %s\n", err.pc, err.msg);
+        exit(1);
+    }
+    int res = verified_run(v, st);
+    verified_free(v);
+    report(res);
+}
+
+#endif
+
+#if (SPEC == 9)
+
+// --------------------------------------------------
+// VM INTERPRETER
+// on VM threads, scheduled over the host cores (see thread.cpp)
+// --------------------------------------------------
+
+// the number of host workers is taken from the VM_WORKERS environment variable, one per core if unset
+void interp(struct state *st) {
+    const char *env = getenv("VM_WORKERS");
+    struct threads_stats stats;
+    int res = threads_run(st->code, PROGRAM_LEN, st, env ? strtoul(env, NULL, 10) : 0, &stats);
+    fprintf(stderr, "%u VM threads on %u workers, %llu steals\n", stats.threads, stats.workers,
+            (unsigned long long) stats.steals);
+    if (res == VM_DEADLOCK) {
+        puts("every thread is waiting in a join");
+        exit(1);
+    }
+    report(res);
+}
+
+#endif
+
+#if (SPEC == 10)
+
+// --------------------------------------------------
+// VM INTERPRETER
+// pre-decoded, with the superinstructions of super.gen.h
+// --------------------------------------------------
+
+void interp(struct state *st) {
+    struct super_program *prog = super_translate(st->code, PROGRAM_LEN);
+    int res = super_run(prog, st);
+    super_free(prog);
+    report(res);
+}
+
+#endif
+
+#if (SPEC == 11)
+
+// --------------------------------------------------
+// VM INTERPRETER
+// context threaded (see context.cpp)
+// --------------------------------------------------
+
+void interp(struct state *st) {
+    struct ctx_program *prog = ctx_translate(st->code, PROGRAM_LEN);
+    if (!prog) {
+#if defined(__x86_64__)
+        puts("can't map the translated code");
+#else
+        puts("context threading needs an x86-64 host");
+#endif
+        exit(1);
+    }
+    int res = ctx_run(prog, st);
+    ctx_free(prog);
+    report(res);
+}
+
+#endif
+
+#if (SPEC == 12)
+
+// --------------------------------------------------
+// VM INTERPRETER
+// closures over the blocks of the bytecode (see closure.cpp)
+// --------------------------------------------------
+
+void interp(struct state *st) {
+    struct cl_program *prog = cl_compile(st->code, PROGRAM_LEN, st);
+    int res = cl_run(prog);
+    cl_free(prog);
+    report(res);
+}
+
+#endif
+
+#if (SPEC == 13)
+
+// --------------------------------------------------
+// VM INTERPRETER
+// the interpreter of the ISA level chosen at startup (see isa.cpp)
+// --------------------------------------------------
+
+void interp(struct state *st) {
+    isa_report(stderr);
+    report(isa_interp(st));
+}
+
+#endif
+
+#if (SPEC == 14)
+
+// --------------------------------------------------
+// VM INTERPRETER
+// checkpointing to disk at back edges (see checkpoint.cpp)
+// --------------------------------------------------
+
+extern uint8_t vmdata[0x100];
+
+// The checkpoint is VM_CHECKPOINT (vm.ckpt if unset), taken every VM_CHECKPOINT_INTERVAL seconds
+// (60 if unset) and when VM_FUEL back edges have run (no limit if unset). A run resumes from the
+// checkpoint if there is one, so a long job is time-sliced by running it again until it halts.
+void interp(struct state *st) {
+    const char *path = getenv("VM_CHECKPOINT");
+    const char *interval = getenv("VM_CHECKPOINT_INTERVAL");
+    const char *fuel = getenv("VM_FUEL");
+    struct ckpt_policy policy = {
+            path && *path ? path : "vm.ckpt",
+            interval && *interval ? strtod(interval, NULL) : 60,
+            fuel && *fuel ? strtoull(fuel, NULL, 10) : 0,
+    };
+    const char *err = ckpt_load(policy.path, st->code, PROGRAM_LEN, st, vmdata, sizeof(vmdata));
+    if (err && access(policy.path, F_OK) == 0) {
+        printf("can't resume %s: %s\n", policy.path, err);
+        exit(1);
+    }
+    struct ckpt_stats stats;
+    uint32_t from = st->pc;
+    int res = ckpt_run(st->code, PROGRAM_LEN, st, vmdata, sizeof(vmdata), &policy, &stats);
+    fprintf(stderr, "%s at pc %u, %llu back edges, %u checkpoints (%u failed) in %.1f ms\n",
+            err ? "started" : "resumed", from, (unsigned long long) stats.back_edges, stats.saves, stats.failed_saves,
+            stats.save_seconds * 1e3);
+    if (res == VM_OUT_OF_FUEL) {
+        printf("out of fuel, checkpointed to %s\n", policy.path);
+        exit(2);
+    }
+    if (res == VM_HALT) {
+        unlink(policy.path);
+    }
+    report(res);
+}
+
+#endif
+
+#if (SPEC == 15)
+
+// --------------------------------------------------
+// VM INTERPRETER
+// over instructions decoded on first execution (see lazy.cpp)
+// --------------------------------------------------
+
+void interp(struct state *st) {
+    struct lazy_program *prog = lazy_open(st->code, PROGRAM_LEN);
+    if (!prog) {
+        puts("out of memory");
+        exit(1);
+    }
+    int res = lazy_run(prog, st);
+    lazy_free(prog);
+    report(res);
+}
+
+#endif
+
 uint8_t vmdata[0x100];
 
+#ifdef ONESHOT
+
+// r0 from s like strtoull in base 10: leading white space, a sign, then the digits up to the
+// first other character (0 if there are none); false where strtoull fails with ERANGE
+static bool parse_input(const char *s, unsigned long long *input) {
+    while (*s == ' ' || (*s >= '\t' && *s <= '\r')) {
+        s++;
+    }
+    bool negative = *s == '-';
+    if (*s == '-' || *s == '+') {
+        s++;
+    }
+    unsigned long long v = 0;
+    for (; *s >= '0' && *s <= '9'; s++) {
+        if (__builtin_mul_overflow(v, 10, &v) || __builtin_add_overflow(v, (unsigned) (*s - '0'), &v)) {
+            return false;
+        }
+    }
+    *input = negative ? -v : v;
+    return true;
+}
+
+#endif
+
 int main(int argc, char **argv) {
     unsigned long long input;
+#ifdef ONESHOT
+    atexit(out_flush);
+    if (argc < 2 || !parse_input(argv[1], &input)) {
+        puts("invalid usage");
+        exit(1);
+    }
+#else
     if (argc < 2 || ((input = strtoull(argv[1], NULL, 10), errno == ERANGE))) {
         puts("invalid usage");
         exit(1);
     }
+#endif
     struct state st = {
             .data = vmdata,
-            .code = fib
+            .code = PROGRAM
     };
+#if (NESTED != 0)
+    // the inner program, for the VM-in-VM
+    memcpy(vmdata, fib, sizeof(fib) - 1);
+#endif
 
     // Set r0 to the integer provided in argv
     st.regfile[0] = input;
+#ifndef ONESHOT
+    // or resume a checkpoint (see checkpoint.h), in any engine that runs from st->pc
+    const char *resume = getenv("VM_RESUME");
+    if (resume && *resume) {
+#if (SPEC == 3)
+        puts("can't resume a checkpoint: this engine starts at pc 0 only");
+        exit(1);
+#endif
+        const char *err = ckpt_load(resume, st.code, PROGRAM_LEN, &st, vmdata, sizeof(vmdata));
+        if (err) {
+            printf("can't resume %s: %s\n", resume, err);
+            exit(1);
+        }
+    }
+#endif
+#ifdef ONESHOT
+    out_str("register r0 input is: ");
+    out_u32(st.regfile[0]);
+    out_str("\n");
+    interp(&st);
+    out_str("register r0 output is: ");
+    out_u32(st.regfile[0]);
+    out_str("\n");
+#else
     printf("register r0 input is: %u\n", st.regfile[0]);
     interp(&st);
     printf("register r0 output is: %u\n", st.regfile[0]);
+#endif
 }
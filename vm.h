@@ -0,0 +1,491 @@
+#ifndef VM_H
+#define VM_H
+
+#include <cstdint>
+
+// read in little endian byte order
+constexpr int32_t read32(const uint8_t *ptr) {
+    return (int32_t) ((uint32_t) *ptr + ((uint32_t) *(ptr + 1) << 8) + ((uint32_t) *(ptr + 2) << 16) +
+                      ((uint32_t) *(ptr + 3) << 24));
+}
+
+// 64 bit FNV-1a, continuing from h
+constexpr uint64_t hash64(const uint8_t *ptr, uint64_t len, uint64_t h = 0xcbf29ce484222325) {
+    for (uint64_t i = 0; i < len; i++) {
+        h = (h ^ ptr[i]) * 0x100000001b3;
+    }
+    return h;
+}
+
+// --------------------------------------------------
+// VM CODE
+// --------------------------------------------------
+
+#define NUM_REGS 16
+#define NUM_VREGS 8
+#define VREG_SIZE 16
+
+#define FLAG_N 1
+#define FLAG_Z 2
+#define FLAG_V 4
+
+struct state {
+    // Registers
+    uint32_t regfile[NUM_REGS]; // general purpose registers: r0, r1 ... r15
+    uint8_t vregfile[NUM_VREGS][VREG_SIZE]; // vector registers of byte lanes: v0, v1 ... v7
+    uint32_t flags; // like x86 EFLAGS, ARM CPSR
+    uint32_t pc; // program counter
+
+    // Memory
+    uint8_t *data; // ".data" section (data segment)
+    const uint8_t *code; // ".text" section (code segment)
+    // (these could be omitted, and the address space of the VM could be the same as the process)
+};
+
+// --------------------------------------------------
+
+constexpr void store(struct state *st, uint8_t rptr, uint8_t rval) {
+    int8_t ptr = st->regfile[rptr];
+    uint8_t val = st->regfile[rval];
+    *(st->data + ptr) = val;
+}
+
+constexpr void load(struct state *st, uint8_t rptr, uint8_t rdst) {
+    int8_t ptr = st->regfile[rptr];
+    st->regfile[rdst] = *(st->data + ptr);
+}
+
+// arithmetic
+constexpr void setflags(struct state *st, uint64_t res) {
+    st->flags = 0;
+    if (res == 0) {
+        st->flags |= FLAG_Z;
+    }
+    if ((int32_t) res < 0) {
+        st->flags |= FLAG_N;
+    }
+    // check for overflow
+    if (res & ~((uint64_t)((uint32_t) - 1))) {
+        st->flags |= FLAG_V;
+    }
+}
+
+// handlers that set the flags take FLAGS, false where the flags are known to be dead (cogen
+// unrolling a loop)
+template<bool FLAGS = true>
+constexpr void add(struct state *st, uint8_t rdst, uint8_t rsrc) {
+    uint64_t res = st->regfile[rdst] + st->regfile[rsrc];
+    st->regfile[rdst] = (uint32_t) res;
+    if constexpr (FLAGS) {
+        setflags(st, res);
+    }
+}
+
+template<bool FLAGS = true>
+constexpr void sub(struct state *st, uint8_t rdst, uint8_t rsrc) {
+    uint64_t res = st->regfile[rdst] - st->regfile[rsrc];
+    st->regfile[rdst] = (uint32_t) res;
+    if constexpr (FLAGS) {
+        setflags(st, res);
+    }
+}
+
+// bitwise, shifts and multiplication, as `rdst op= value`. The *i handlers take the value itself,
+// where it is a known constant (see VM_CONST_INSNS), the others read it from rsrc. A shift amount
+// is taken mod 32. Z and N come from the 32 bits written, as for add and sub (which compute in 32
+// bits and so never set V); a shift left or multiplication that carries out of 32 bits also sets V.
+template<bool FLAGS>
+constexpr void alu_result(struct state *st, uint8_t rdst, uint64_t res) {
+    st->regfile[rdst] = (uint32_t) res;
+    if constexpr (FLAGS) {
+        setflags(st, (uint32_t) res);
+        if (res >> 32) {
+            st->flags |= FLAG_V;
+        }
+    }
+}
+
+template<bool FLAGS = true>
+constexpr void bandi(struct state *st, uint8_t rdst, uint32_t val) {
+    alu_result<FLAGS>(st, rdst, st->regfile[rdst] & val);
+}
+
+template<bool FLAGS = true>
+constexpr void bori(struct state *st, uint8_t rdst, uint32_t val) {
+    alu_result<FLAGS>(st, rdst, st->regfile[rdst] | val);
+}
+
+template<bool FLAGS = true>
+constexpr void bxori(struct state *st, uint8_t rdst, uint32_t val) {
+    alu_result<FLAGS>(st, rdst, st->regfile[rdst] ^ val);
+}
+
+template<bool FLAGS = true>
+constexpr void shli(struct state *st, uint8_t rdst, uint32_t val) {
+    alu_result<FLAGS>(st, rdst, (uint64_t) st->regfile[rdst] << (val & 31));
+}
+
+template<bool FLAGS = true>
+constexpr void shri(struct state *st, uint8_t rdst, uint32_t val) {
+    alu_result<FLAGS>(st, rdst, st->regfile[rdst] >> (val & 31));
+}
+
+template<bool FLAGS = true>
+constexpr void muli(struct state *st, uint8_t rdst, uint32_t val) {
+    alu_result<FLAGS>(st, rdst, (uint64_t) st->regfile[rdst] * val);
+}
+
+template<bool FLAGS = true>
+constexpr void band(struct state *st, uint8_t rdst, uint8_t rsrc) {
+    bandi<FLAGS>(st, rdst, st->regfile[rsrc]);
+}
+
+template<bool FLAGS = true>
+constexpr void bor(struct state *st, uint8_t rdst, uint8_t rsrc) {
+    bori<FLAGS>(st, rdst, st->regfile[rsrc]);
+}
+
+template<bool FLAGS = true>
+constexpr void bxor(struct state *st, uint8_t rdst, uint8_t rsrc) {
+    bxori<FLAGS>(st, rdst, st->regfile[rsrc]);
+}
+
+template<bool FLAGS = true>
+constexpr void shl(struct state *st, uint8_t rdst, uint8_t rsrc) {
+    shli<FLAGS>(st, rdst, st->regfile[rsrc]);
+}
+
+template<bool FLAGS = true>
+constexpr void shr(struct state *st, uint8_t rdst, uint8_t rsrc) {
+    shri<FLAGS>(st, rdst, st->regfile[rsrc]);
+}
+
+template<bool FLAGS = true>
+constexpr void mul(struct state *st, uint8_t rdst, uint8_t rsrc) {
+    muli<FLAGS>(st, rdst, st->regfile[rsrc]);
+}
+
+// the flags after r0 := a op b, checked below for results that wrap around to 0
+template<void (*OP)(struct state *, uint8_t, uint8_t)>
+constexpr uint32_t flags_of(uint32_t a, uint32_t b) {
+    struct state st = {};
+    st.regfile[0] = a;
+    st.regfile[1] = b;
+    OP(&st, 0, 1);
+    return st.flags;
+}
+
+static_assert(flags_of<shl>(0x80000000, 1) == (FLAG_Z | FLAG_V), "a shift out to 0 sets Z and V");
+static_assert(flags_of<mul>(0x80000000, 2) == (FLAG_Z | FLAG_V), "a multiplication out to 0 sets Z and V");
+static_assert(flags_of<add>(0xffffffff, 1) == FLAG_Z, "add wraps around in 32 bits");
+static_assert(flags_of<shl>(3, 31) == (FLAG_N | FLAG_V), "a shift that carries out of 32 bits sets V");
+
+// vector registers, lane by lane. Lane i of a load or store addresses ptr + i, wrapping around the
+// data segment like the int8_t pointer of load and store; the loop without the wrap around is the
+// common case and compiles to a single 16 byte move.
+constexpr void vload(struct state *st, uint8_t rptr, uint8_t vdst) {
+    int8_t ptr = st->regfile[rptr];
+    if (ptr <= INT8_MAX - (VREG_SIZE - 1)) {
+        for (int i = 0; i < VREG_SIZE; i++) {
+            st->vregfile[vdst][i] = *(st->data + ptr + i);
+        }
+        return;
+    }
+    for (int i = 0; i < VREG_SIZE; i++) {
+        st->vregfile[vdst][i] = *(st->data + (int8_t) (ptr + i));
+    }
+}
+
+constexpr void vstore(struct state *st, uint8_t rptr, uint8_t vsrc) {
+    int8_t ptr = st->regfile[rptr];
+    if (ptr <= INT8_MAX - (VREG_SIZE - 1)) {
+        for (int i = 0; i < VREG_SIZE; i++) {
+            *(st->data + ptr + i) = st->vregfile[vsrc][i];
+        }
+        return;
+    }
+    for (int i = 0; i < VREG_SIZE; i++) {
+        *(st->data + (int8_t) (ptr + i)) = st->vregfile[vsrc][i];
+    }
+}
+
+// every lane := the low byte of rsrc
+constexpr void vdup(struct state *st, uint8_t vdst, uint8_t rsrc) {
+    for (int i = 0; i < VREG_SIZE; i++) {
+        st->vregfile[vdst][i] = st->regfile[rsrc];
+    }
+}
+
+constexpr void vadd(struct state *st, uint8_t vdst, uint8_t vsrc) {
+    for (int i = 0; i < VREG_SIZE; i++) {
+        st->vregfile[vdst][i] += st->vregfile[vsrc][i];
+    }
+}
+
+constexpr void vsub(struct state *st, uint8_t vdst, uint8_t vsrc) {
+    for (int i = 0; i < VREG_SIZE; i++) {
+        st->vregfile[vdst][i] -= st->vregfile[vsrc][i];
+    }
+}
+
+constexpr void vxor(struct state *st, uint8_t vdst, uint8_t vsrc) {
+    for (int i = 0; i < VREG_SIZE; i++) {
+        st->vregfile[vdst][i] ^= st->vregfile[vsrc][i];
+    }
+}
+
+// each lane := 0xff where equal, 0 where not
+constexpr void vcmpeq(struct state *st, uint8_t vdst, uint8_t vsrc) {
+    for (int i = 0; i < VREG_SIZE; i++) {
+        st->vregfile[vdst][i] = st->vregfile[vdst][i] == st->vregfile[vsrc][i] ? 0xff : 0;
+    }
+}
+
+// rdst := the sum of the lanes of vsrc, setting the flags
+template<bool FLAGS = true>
+constexpr void vreduce(struct state *st, uint8_t rdst, uint8_t vsrc) {
+    uint32_t sum = 0;
+    for (int i = 0; i < VREG_SIZE; i++) {
+        sum += st->vregfile[vsrc][i];
+    }
+    alu_result<FLAGS>(st, rdst, sum);
+}
+
+constexpr void movr(struct state *st, uint8_t rdst, uint8_t rsrc) {
+    st->regfile[rdst] = st->regfile[rsrc];
+}
+
+constexpr void movi(struct state *st, uint8_t rdst, uint8_t immu8) {
+    st->regfile[rdst] = immu8;
+}
+
+// atomic accesses to the data segment, for programs running on several threads (see thread.h).
+// cmpxchg is x86 CMPXCHG on a byte: if the byte at rptr is the low byte of r0, it becomes the low
+// byte of rnew and Z is set, otherwise r0 := the byte and Z is clear. (Not constexpr, the atomic
+// builtins have no constant evaluation.)
+inline void aload(struct state *st, uint8_t rptr, uint8_t rdst) {
+    int8_t ptr = st->regfile[rptr];
+    st->regfile[rdst] = __atomic_load_n(st->data + ptr, __ATOMIC_ACQUIRE);
+}
+
+inline void astore(struct state *st, uint8_t rptr, uint8_t rval) {
+    int8_t ptr = st->regfile[rptr];
+    __atomic_store_n(st->data + ptr, (uint8_t) st->regfile[rval], __ATOMIC_RELEASE);
+}
+
+template<bool FLAGS = true>
+void cmpxchg(struct state *st, uint8_t rptr, uint8_t rnew) {
+    int8_t ptr = st->regfile[rptr];
+    uint8_t expected = st->regfile[0];
+    bool ok = __atomic_compare_exchange_n(st->data + ptr, &expected, (uint8_t) st->regfile[rnew], false,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    st->regfile[0] = expected;
+    if constexpr (FLAGS) {
+        st->flags = ok ? FLAG_Z : 0;
+    }
+}
+
+// branching
+constexpr void beq(struct state *st, int32_t imms32) {
+    if (st->flags & FLAG_Z) {
+        st->pc += imms32;
+    }
+}
+
+constexpr void bne(struct state *st, int32_t imms32) {
+    if (!(st->flags & FLAG_Z)) {
+        st->pc += imms32;
+    }
+}
+
+constexpr void blt(struct state *st, int32_t imms32) {
+    int n = !!(st->flags & FLAG_N);
+    int v = !!(st->flags & FLAG_V);
+    if (n != v) {
+        st->pc += imms32;
+    }
+}
+
+// register indirect jump, to an absolute pc
+constexpr void jmp(struct state *st, uint8_t rtarget) {
+    st->pc = st->regfile[rtarget];
+}
+
+// --------------------------------------------------
+// VM INSTRUCTION SET
+// --------------------------------------------------
+
+// X(opcode, length, handler) for every instruction with register or immediate operands.
+// The handler is written in terms of the operand bytes OP1 and OP2, which each engine defines.
+// The table is the single definition of the instruction semantics: the interpreters expand it
+// into their switches, and cogen stringifies it to emit residual code.
+#define VM_INSNS(X)                          \
+    X('S', 3, store(st, OP1, OP2))           \
+    X('L', 3, load(st, OP1, OP2))            \
+    X('A', 3, add(st, OP1, OP2))             \
+    X('U', 3, sub(st, OP1, OP2))             \
+    X('M', 3, movr(st, OP1, OP2))            \
+    X('I', 3, movi(st, OP1, OP2))            \
+    X('&', 3, band(st, OP1, OP2))            \
+    X('|', 3, bor(st, OP1, OP2))             \
+    X('^', 3, bxor(st, OP1, OP2))            \
+    X('<', 3, shl(st, OP1, OP2))             \
+    X('>', 3, shr(st, OP1, OP2))             \
+    X('*', 3, mul(st, OP1, OP2))             \
+    X('V', 3, vload(st, OP1, OP2))           \
+    X('W', 3, vstore(st, OP1, OP2))          \
+    X('D', 3, vdup(st, OP1, OP2))            \
+    X('+', 3, vadd(st, OP1, OP2))            \
+    X('-', 3, vsub(st, OP1, OP2))            \
+    X('X', 3, vxor(st, OP1, OP2))            \
+    X('=', 3, vcmpeq(st, OP1, OP2))          \
+    X('R', 3, vreduce(st, OP1, OP2))         \
+    X('K', 3, aload(st, OP1, OP2))           \
+    X('P', 3, astore(st, OP1, OP2))          \
+    X('C', 3, cmpxchg(st, OP1, OP2))
+
+// the operands of an instruction in VM_INSNS that are vector registers (< NUM_VREGS), 1 for op1 and
+// 2 for op2, the others are general purpose registers
+constexpr uint32_t vreg_operands(uint8_t opcode) {
+    switch (opcode) {
+        case 'V':
+        case 'W':
+        case 'R':
+            return 2;
+        case 'D':
+            return 1;
+        case '+':
+        case '-':
+        case 'X':
+        case '=':
+            return 1 | 2;
+        default:
+            return 0;
+    }
+}
+
+// whether the handler of an instruction in VM_INSNS sets the flags, found by running it on a probe
+// (not constexpr, the atomic handlers are not)
+inline bool sets_flags(uint8_t opcode) {
+    uint8_t data[0x100] = {};
+    struct state probe = {};
+    struct state *st = &probe;
+    st->data = data + 0x80;
+    st->flags = ~0u;
+#define OP1 0
+#define OP2 0
+    switch (opcode) {
+#define INSN_FLAGS(op, len, handler) \
+        case op:                     \
+            handler;                 \
+            break;
+        VM_INSNS(INSN_FLAGS)
+#undef INSN_FLAGS
+        default:
+            return false;
+    }
+#undef OP1
+#undef OP2
+    return st->flags != ~0u;
+}
+
+// X(opcode, handler) for the instructions of VM_INSNS that can be specialized to a known value of
+// their source register: the handler with OP2 standing for the value. interp_body and cogen use it
+// when the instruction right before sets the register with I, so that a shift or multiplication by
+// a constant becomes a single host instruction.
+#define VM_CONST_INSNS(X)                    \
+    X('&', bandi(st, OP1, OP2))              \
+    X('|', bori(st, OP1, OP2))               \
+    X('^', bxori(st, OP1, OP2))              \
+    X('<', shli(st, OP1, OP2))               \
+    X('>', shri(st, OP1, OP2))               \
+    X('*', muli(st, OP1, OP2))
+
+// X(condition, handler) for the 6 byte branches 'B' condition imms32.
+// The handler is written in terms of the branch offset OFF.
+#define VM_BRANCHES(X)                       \
+    X('E', beq(st, OFF))                     \
+    X('N', bne(st, OFF))                     \
+    X('L', blt(st, OFF))
+
+// X(opcode, length, handler) for the jumps, whose handler sets the pc itself: 'J' rtarget jumps
+// to the pc held in a register. The engines compiling control flow statically can't know the
+// target, see cogen.cpp and interp_trans in vm.cpp.
+#define VM_JUMPS(X)                          \
+    X('J', 2, jmp(st, OP1))
+
+// 'H' (1 byte) halts
+
+// X(opcode, length) for the thread instructions, which only the runtime of thread.h runs; to the
+// other engines they are illegal:
+//   'T' rdst, rpc  spawns a thread at the pc held in rpc, with a copy of the registers in which
+//                  rdst is 0, and sets rdst to its id (0 if it could not be spawned)
+//   'Y' rid        waits until the thread with the id held in rid has halted (0 does not wait)
+#define VM_THREADS(X)                        \
+    X('T', 3)                                \
+    X('Y', 2)
+
+// results of running an instruction or program
+#define VM_HALT 0
+#define VM_ILLEGAL 1
+#define VM_CONTINUE 2
+#define VM_BAD_PC 3
+
+// length in bytes of the instruction starting with opcode, or 0 if the opcode is illegal
+constexpr uint32_t insn_length(uint8_t opcode) {
+    switch (opcode) {
+#define INSN_LENGTH(op, len, handler) \
+        case op:                      \
+            return len;
+        VM_INSNS(INSN_LENGTH)
+        VM_JUMPS(INSN_LENGTH)
+#undef INSN_LENGTH
+        case 'B':
+            return 6;
+        case 'H':
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// an instruction decoded once, for the engines that run decoded instructions (block.cpp,
+// super.cpp, lazy.cpp)
+struct vm_insn {
+    uint8_t opcode; // 0 if illegal
+    uint8_t op1; // the condition for 'B'
+    uint8_t op2;
+    uint8_t len; // 1 if illegal
+    int32_t off;
+};
+
+// the instruction at pc of code (len bytes); one running past the end is illegal
+constexpr void decode_insn(const uint8_t *code, uint32_t len, uint32_t pc, struct vm_insn *in) {
+    uint32_t n = insn_length(code[pc]);
+    *in = {};
+    in->len = 1;
+    if (n == 0 || pc + n > len) {
+        return;
+    }
+    if (code[pc] == 'B') {
+        switch (code[pc + 1]) {
+#define BRANCH_COND(cc, handler) case cc:
+            VM_BRANCHES(BRANCH_COND)
+#undef BRANCH_COND
+                break;
+            default:
+                return;
+        }
+        in->off = read32(&code[pc + 2]);
+    }
+    in->opcode = code[pc];
+    in->len = n;
+    if (n > 1) {
+        in->op1 = code[pc + 1];
+    }
+    if (n > 2) {
+        in->op2 = code[pc + 2];
+    }
+}
+
+#endif